@@ -18,7 +18,7 @@ using boost::asio::ip::tcp;
 int api_connection::connections = 0;
 
 api_connection::api_connection(api_server &api_server, local_peer &local_peer, io_service &io_service) :
-server_(api_server), local_peer_(local_peer), socket_(io_service), authenticated_(false), message_(nullptr), rcv_buffer_start_(0), rcv_buffer_end_(0) {
+server_(api_server), local_peer_(local_peer), socket_(io_service), authenticated_(false), message_(nullptr), rcv_buffer_start_(0), rcv_buffer_end_(0), writing_(false) {
 	id_ = connections++;
 
 	rcv_buffer_ = new BYTE[256];
@@ -63,52 +63,33 @@ void api_connection::send(const string &string) {
 }
 
 void api_connection::send(const BYTE *bytes, size_t size) {
-	// data still to be sent
-	size_t buffer_data = snd_buffer_end_ - snd_buffer_start_;
+	snd_queue_.push(bytes, size);
 
-	// space at the end of the buffer
-	size_t buffer_space = snd_buffer_size_ - snd_buffer_end_;
-
-	if (buffer_data == 0) {
-		snd_buffer_start_ = 0;
-		snd_buffer_end_ = 0;
+	if (!writing_ && !snd_queue_.empty()) {
+		// only send when there's not already a send request in the queue
+		// otherwise handle_write will call write_next
+		writing_ = true;
+		local_peer_.io_service().post(boost::bind(&api_connection::write_next, shared_from_this()));
 	}
+}
 
-	if (size > buffer_space) {
-		if (size <= snd_buffer_size_ - buffer_data) {
-			// shift to beginning to create space at the end (doesn't resize the buffer)
-			memmove(snd_buffer_, snd_buffer_ + snd_buffer_start_, buffer_data);
+void api_connection::send(const shared_buffer &buffer) {
+	snd_queue_.push(buffer);
 
-			snd_buffer_start_ = 0;
-			snd_buffer_end_ = buffer_data;
-			//new_buffer_space = snd_buffer_size_ - buffer_data;
-		} else {
-			// enlarge buffer space for expected bytes to next power of 2
-			snd_buffer_size_ = next_power(buffer_data + size);
-			BYTE *new_buffer = new BYTE[snd_buffer_size_];
-			memcpy(new_buffer, snd_buffer_ + snd_buffer_start_, buffer_data);
-			delete[] snd_buffer_;
-			snd_buffer_ = new_buffer;
-
-			snd_buffer_start_ = 0;
-			snd_buffer_end_ = buffer_data;
-			//new_buffer_space = snd_buffer_size_ - buffer_data;
-		}
+	if (!writing_ && !snd_queue_.empty()) {
+		writing_ = true;
+		local_peer_.io_service().post(boost::bind(&api_connection::write_next, shared_from_this()));
 	}
+}
 
-	// copy the data to the buffer
-	memcpy(snd_buffer_ + snd_buffer_end_, bytes, size);
-
-	snd_buffer_end_ += size;
-
-
-	if (buffer_data == 0) {
-		// only send when there's not already a send request in the queue
-		// if buffer_data != 0 handle_write will call async_write_some
-		socket_.async_write_some(boost::asio::buffer(snd_buffer_ + snd_buffer_start_, buffer_data + size), boost::bind(&api_connection::handle_write, shared_from_this(),
-			boost::asio::placeholders::error,
-			boost::asio::placeholders::bytes_transferred));
+void api_connection::write_next() {
+	if (!socket_.is_open()) {
+		return;
 	}
+
+	socket_.async_write_some(snd_queue_.buffers(), boost::bind(&api_connection::handle_write, shared_from_this(),
+		boost::asio::placeholders::error,
+		boost::asio::placeholders::bytes_transferred));
 }
 
 void api_connection::handle_write(const boost::system::error_code& error, size_t bytes_transferred) {
@@ -118,14 +99,12 @@ void api_connection::handle_write(const boost::system::error_code& error, size_t
 	}
 
 	if (bytes_transferred) {
-		snd_buffer_start_ += bytes_transferred;
+		snd_queue_.consume(bytes_transferred);
 
-		size_t buffer_data = snd_buffer_end_ - snd_buffer_start_;
-
-		if (buffer_data != 0) {
-			socket_.async_write_some(boost::asio::buffer(snd_buffer_ + snd_buffer_start_, buffer_data), boost::bind(&api_connection::handle_write, shared_from_this(),
-				boost::asio::placeholders::error,
-				boost::asio::placeholders::bytes_transferred));
+		if (!snd_queue_.empty()) {
+			write_next();
+		} else {
+			writing_ = false;
 		}
 	} else {
 		cout << "An error occurred: no bytes transferred" << endl;
@@ -1,6 +1,7 @@
 #ifndef DDSN_API_CONNECTION_H
 #define DDSN_API_CONNECTION_H
 
+#include "buffer.h"
 #include "definitions.h"
 #include "local_peer.h"
 
@@ -37,6 +38,10 @@ public:
 private:
 	void send(const std::string &string);
 	void send(const BYTE *bytes, size_t size);
+	// queues the buffer itself, its bytes aren't copied unless it's small
+	void send(const shared_buffer &buffer);
+
+	void write_next();
 
 	void handle_read(const boost::system::error_code& error, std::size_t bytes_transferred);
 	void handle_write(const boost::system::error_code& error, std::size_t bytes_transferred);
@@ -53,10 +58,9 @@ private:
 	size_t rcv_buffer_end_;
 	size_t rcv_buffer_size_;
 
-	BYTE *snd_buffer_;
-	size_t snd_buffer_start_;
-	size_t snd_buffer_end_;
-	size_t snd_buffer_size_;
+	send_queue snd_queue_;
+	// a write is running or about to start
+	bool writing_;
 
 	api_in_message *message_;
 
@@ -122,14 +122,11 @@ void api_in_ping::feed(const BYTE *data, size_t size, int &type, size_t &expecte
 // STORE FILE
 
 api_in_store_file::api_in_store_file(local_peer &local_peer, api_connection::pointer connection) :
-api_in_message(local_peer, connection), state_(0), chunk_(0), data_pointer_(0), data_(nullptr) {
+api_in_message(local_peer, connection), state_(0), chunk_(0), data_pointer_(0), merkle_(false) {
 	
 }
 
 api_in_store_file::~api_in_store_file() {
-	if (data_ != nullptr) {
-		delete data_;
-	}
 }
 
 void api_in_store_file::first_action(int &type, size_t &expected_size) {
@@ -141,7 +138,8 @@ void api_in_store_file::feed(const string &line, int &type, size_t &expected_siz
 		if (line == "") { // End of file information
 			state_ = 1;
 
-			data_ = new BYTE[file_size_];
+			data_ = shared_buffer(file_size_);
+			merkle_ = local_peer_.merkle() && file_size_ > DDSN_MERKLE_LEAF_SIZE;
 
 			type = DDSN_MESSAGE_TYPE_STRING;
 		} else {
@@ -199,23 +197,42 @@ static void action_api_store_block(api_connection::pointer connection, const blo
 void api_in_store_file::feed(const BYTE *data, size_t size, int &type, size_t &expected_size) {
 	type = DDSN_MESSAGE_TYPE_STRING;
 
-	if (chunk_ < chunks_) {
-		memcpy(data_ + data_pointer_, data, size);
+	memcpy(data_.mutable_data() + data_pointer_, data, size);
 
-		data_pointer_ += size;
+	if (merkle_) {
+		merkle_hasher_.update(data, size);
+	} else {
+		hasher_.update(data, size);
+	}
 
+	data_pointer_ += size;
+
+	if (chunk_ < chunks_) {
 		type = DDSN_MESSAGE_TYPE_STRING;
 	} else {
-		memcpy(data_ + data_pointer_, data, size);
+		block block(file_name_);
+		block.set_data(data_);
+		block.set_owner(local_peer_.keypair());
 
-		for (UINT32 occurrence = 0; occurrence < 4; occurrence++) {
-			block block(file_name_);
-			block.set_data(data_, file_size_);
-			block.set_owner(local_peer_.keypair());
-			block.set_occurrence(occurrence);
-			block.seal();
+		if (merkle_) {
+			block.set_merkle(true);
+		}
 
-			local_peer_.store(block, boost::bind(&action_api_store_block, connection_, _1, _2));
+		if (data_pointer_ == file_size_ && merkle_) {
+			// leaves hashed chunk by chunk already
+			block.set_leaf_hashes(merkle_hasher_.finish());
+		} else if (data_pointer_ == file_size_) {
+			// hashed chunk by chunk already
+			BYTE data_hash[32];
+			hasher_.finish(file_name_, data_hash);
+			block.set_data_hash(data_hash);
+		}
+
+		vector<ddsn::block> blocks;
+		block.seal(4, blocks);
+
+		for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+			local_peer_.store(*it, boost::bind(&action_api_store_block, connection_, _1, _2));
 		}
 
 		type = DDSN_MESSAGE_TYPE_END;
@@ -427,6 +444,24 @@ local_peer_(local_peer) {
 api_out_peer_info::~api_out_peer_info() {
 }
 
+string api_out_peer_info::crypto_fields() const {
+	worker_pool *pool = local_peer_.crypto_pool();
+
+	if (pool == nullptr) {
+		return "";
+	}
+
+	worker_pool::statistics stats = pool->stats();
+
+	return "Crypto-threads: " + boost::lexical_cast<string>(pool->threads()) + "\n"
+		"Crypto-completed: " + boost::lexical_cast<string>(stats.completed) + "\n"
+		"Crypto-refused: " + boost::lexical_cast<string>(stats.refused) + "\n"
+		"Crypto-backlog: " + boost::lexical_cast<string>(local_peer_.crypto_backlog()) + "\n"
+		"Crypto-queued: " + boost::lexical_cast<string>(stats.queued) + "\n"
+		"Crypto-max-queued: " + boost::lexical_cast<string>(stats.max_queued) + "\n"
+		"Crypto-wait-us: " + boost::lexical_cast<string>(stats.completed > 0 ? stats.wait_us / stats.completed : 0) + "\n";
+}
+
 void api_out_peer_info::send(api_connection::pointer connection) {
 	api_out_message::send(connection, "PEER INFO\n"
 		"Peer-id: " + local_peer_.id().string() + "\n"
@@ -434,7 +469,8 @@ void api_out_peer_info::send(api_connection::pointer connection) {
 		"Integrated: " + (local_peer_.integrated() ? "yes" : "no") + "\n"
 		"Mentor: " + (local_peer_.mentor() ? local_peer_.mentor()->id().string() : "") + "\n"
 		"Blocks: " + boost::lexical_cast<string>(local_peer_.blocks()) + "\n"
-		"Capacity: " + boost::lexical_cast<string>(local_peer_.capacity()) + "\n"
+		"Capacity: " + boost::lexical_cast<string>(local_peer_.capacity()) + "\n" +
+		crypto_fields() +
 		"Peers: " + boost::lexical_cast<string>(local_peer_.foreign_peers().size()) + "\n\n");
 
 	for (auto it = local_peer_.foreign_peers().begin(); it != local_peer_.foreign_peers().end(); ++it) {
@@ -449,7 +485,7 @@ void api_out_peer_info::send(api_connection::pointer connection) {
 
 // PEER BLOCKS
 
-api_out_peer_blocks::api_out_peer_blocks(const local_peer &local_peer) :
+api_out_peer_blocks::api_out_peer_blocks(local_peer &local_peer) :
 local_peer_(local_peer) {
 }
 
@@ -460,18 +496,34 @@ void api_out_peer_blocks::send(api_connection::pointer connection) {
 	api_out_message::send(connection, "PEER BLOCKS\n"
 		"Blocks: " + boost::lexical_cast<string>(local_peer_.blocks()) + "\n\n");
 
-	for (auto it = local_peer_.stored_blocks().begin(); it != local_peer_.stored_blocks().end(); ++it) {
+	vector<code> codes;
+	local_peer_.stored_blocks().list(codes);
+
+	local_peer_.disk_pool()->post(boost::bind(&api_out_peer_blocks::disk_list, *this, connection, codes));
+}
+
+void api_out_peer_blocks::disk_list(api_connection::pointer connection, const vector<code> &codes) {
+	string listing;
+
+	for (auto it = codes.begin(); it != codes.end(); ++it) {
 		block stored_block(*it);
-		stored_block.load_from_filesystem();
 
-		BYTE hash[32];
-		hash_from_rsa(stored_block.owner(), hash);
+		if (local_peer_.block_store()->load(stored_block) != 0) {
+			// removed in the meantime
+			continue;
+		}
 
-		api_out_message::send(connection, "Code: " + stored_block.code().string('_') + "\n"
-			"Owner: " + bytes_to_hex(hash, 32) + "\n"
+		listing += "Code: " + stored_block.code().string('_') + "\n"
+			"Owner: " + bytes_to_hex(stored_block.owner_hash(), 32) + "\n"
 			"Name: " + stored_block.name() + "\n"
-			"Size: " + boost::lexical_cast<string>(stored_block.size()) + "\n\n");
+			"Size: " + boost::lexical_cast<string>(stored_block.size()) + "\n\n";
 	}
 
-	api_out_message::send(connection, "\n");
+	listing += "\n";
+
+	local_peer_.io_service().post(boost::bind(&api_out_peer_blocks::listed, *this, connection, listing));
+}
+
+void api_out_peer_blocks::listed(api_connection::pointer connection, const string &listing) {
+	api_out_message::send(connection, listing);
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include "local_peer.h"
 
 #include <string>
+#include <vector>
 
 namespace ddsn {
 
@@ -83,7 +84,11 @@ private:
 	int file_size_;
 	int chunk_size_;
 	int data_pointer_;
-	BYTE *data_;
+	shared_buffer data_;
+	data_hasher hasher_;
+	// large files are signed over their Merkle root (see local_peer::merkle)
+	bool merkle_;
+	merkle_hasher merkle_hasher_;
 };
 
 class api_in_load_file : public api_in_message {
@@ -188,17 +193,24 @@ public:
 
 	void send(api_connection::pointer connection);
 private:
+	// crypto pool metrics, average wait per completed check
+	std::string crypto_fields() const;
+
 	const local_peer &local_peer_;
 };
 
 class api_out_peer_blocks : public api_out_message {
 public:
-	api_out_peer_blocks(const local_peer &local_peer);
+	api_out_peer_blocks(local_peer &local_peer);
 	~api_out_peer_blocks();
 
 	void send(api_connection::pointer connection);
 private:
-	const local_peer &local_peer_;
+	// load the blocks on the disk pool, the listing is sent from the network thread
+	void disk_list(api_connection::pointer connection, const std::vector<code> &codes);
+	void listed(api_connection::pointer connection, const std::string &listing);
+
+	local_peer &local_peer_;
 };
 
 }
@@ -1,74 +1,107 @@
 #include "block.h"
+#include "compression.h"
 #include "utilities.h"
 
-#include <openssl/pem.h>
-#include <openssl/rsa.h>
+#include <zlib.h>
 #include <cstring>
-#include <fstream>
 #include <iostream>
 
 using namespace ddsn;
 using namespace std;
 
+data_hasher::data_hasher() {
+}
+
+void data_hasher::update(const BYTE *data, size_t size) {
+	sha256_.update(data, size);
+}
+
+void data_hasher::finish(const string &name, BYTE data_hash[32]) {
+	sha256_.update(name.c_str(), name.length());
+	sha256_.finish(data_hash);
+}
+
 block ddsn::block::copy_without_data(const block &block) {
 	ddsn::block block_cp;
 	
 	block_cp.set_code(block.code_);
 	block_cp.set_name(block.name_);
 	block_cp.set_occurrence(block.occurrence_);
+	block_cp.set_merkle(block.merkle_);
 	block_cp.set_owner_hash(block.owner_hash_);
-	block_cp.set_signature(block.signature_);
+	block_cp.set_signature(block.signature_, block.signature_type_);
 	block_cp.set_size(block.size_);
 
 	return block_cp;
 }
 
-code ddsn::block::compute_code(const std::string name, BYTE owner_hash[32], UINT32 occurrence) {
-	SHA256_CTX sha256;
-
-	SHA256_Init(&sha256);
-	SHA256_Update(&sha256, name.c_str(), name.length());
-	SHA256_Update(&sha256, owner_hash, 32);
-	SHA256_Update(&sha256, &occurrence, 4);
+code ddsn::block::compute_code(const std::string name, const BYTE owner_hash[32], UINT32 occurrence) {
+	ddsn::sha256 sha256;
+	sha256.update(name.c_str(), name.length());
+	sha256.update(owner_hash, 32);
+	sha256.update(&occurrence, 4);
 
 	BYTE code_bytes[32];
-	SHA256_Final(code_bytes, &sha256);
+	sha256.finish(code_bytes);
 
 	return ddsn::code(256, code_bytes);
 }
 
-code ddsn::block::compute_code(const std::string name, RSA *owner, UINT32 occurrence) {
-	BYTE owner_hash[32];
-	hash_from_rsa(owner, owner_hash);
-	return compute_code(name, owner_hash, occurrence);
+block::block() : signature_type_(DDSN_SIGNATURE_RSA), size_(0), occurrence_(0), merkle_(false), verified_(false), checksum_(0), data_hash_set_(false), deflate_tried_(false), stored_deflated_(false), stored_external_(false), stored_size_(0) {
 }
 
-block::block() : data_(nullptr), size_(0), owner_(nullptr), occurrence_(0) {
+block::block(const string &name) : signature_type_(DDSN_SIGNATURE_RSA), name_(name), size_(0), occurrence_(0), merkle_(false), verified_(false), checksum_(0), data_hash_set_(false), deflate_tried_(false), stored_deflated_(false), stored_external_(false), stored_size_(0) {
 }
 
-block::block(const string &name) : name_(name), data_(nullptr), size_(0), owner_(nullptr), occurrence_(0) {
-}
-
-block::block(const ddsn::code &code) : code_(code), data_(nullptr), size_(0), owner_(nullptr), occurrence_(0) {
+block::block(const ddsn::code &code) : code_(code), signature_type_(DDSN_SIGNATURE_RSA), size_(0), occurrence_(0), merkle_(false), verified_(false), checksum_(0), data_hash_set_(false), deflate_tried_(false), stored_deflated_(false), stored_external_(false), stored_size_(0) {
 }
 
+// the data is shared, not copied
 block::block(const block &block) :
-code_(block.code_), name_(block.name_), size_(block.size_), owner_(block.owner_), occurrence_(block.occurrence_) {
-	memcpy(signature_, block.signature_, 256);
+code_(block.code_), signature_type_(block.signature_type_), name_(block.name_), data_(block.data_), size_(block.size_), owner_(block.owner_), occurrence_(block.occurrence_), merkle_(block.merkle_),
+verified_(block.verified_), checksum_(block.checksum_), data_hash_set_(block.data_hash_set_), leaf_hashes_(block.leaf_hashes_), deflated_(block.deflated_), deflate_tried_(block.deflate_tried_),
+stored_deflated_(block.stored_deflated_), stored_external_(block.stored_external_), stored_size_(block.stored_size_) {
+	memcpy(signature_, block.signature_, DDSN_SIGNATURE_MAX_SIZE);
 	memcpy(owner_hash_, block.owner_hash_, 32);
+	memcpy(data_hash_, block.data_hash_, 32);
+}
 
-	if (block.data_ != nullptr) {
-		data_ = new BYTE[size_];
-		memcpy(data_, block.data_, size_);
-	} else {
-		data_ = nullptr;
+// the data is shared, not copied
+block &block::operator=(const block &block) {
+	if (this == &block) {
+		return *this;
 	}
+
+	code_ = block.code_;
+	memcpy(signature_, block.signature_, DDSN_SIGNATURE_MAX_SIZE);
+	signature_type_ = block.signature_type_;
+	name_ = block.name_;
+	data_ = block.data_;
+	size_ = block.size_;
+	owner_ = block.owner_;
+	memcpy(owner_hash_, block.owner_hash_, 32);
+	occurrence_ = block.occurrence_;
+	merkle_ = block.merkle_;
+
+	verified_ = block.verified_;
+	checksum_ = block.checksum_;
+
+	memcpy(data_hash_, block.data_hash_, 32);
+	data_hash_set_ = block.data_hash_set_;
+
+	leaf_hashes_ = block.leaf_hashes_;
+
+	deflated_ = block.deflated_;
+	deflate_tried_ = block.deflate_tried_;
+
+	stored_deflated_ = block.stored_deflated_;
+	stored_external_ = block.stored_external_;
+	stored_size_ = block.stored_size_;
+
+	return *this;
 }
 
 block::~block() {
-	if (data_ != nullptr) {
-		delete data_;
-	}
 }
 
 const code &block::code() const {
@@ -79,11 +112,23 @@ const BYTE *block::signature() const {
 	return signature_;
 }
 
+int block::signature_type() const {
+	return signature_type_;
+}
+
+size_t block::signature_size() const {
+	return ddsn::signature_size(signature_type_);
+}
+
 const std::string &block::name() const {
 	return name_;
 }
 
 const BYTE *block::data() const {
+	return data_.data();
+}
+
+const shared_buffer &block::data_buffer() const {
 	return data_;
 }
 
@@ -91,7 +136,24 @@ size_t block::size() const {
 	return size_;
 }
 
-RSA *block::owner() const {
+const shared_buffer &block::deflated() const {
+	if (!deflate_tried_) {
+		deflated_ = deflate_data(data_.data(), size_);
+		deflate_tried_ = true;
+	}
+
+	return deflated_;
+}
+
+size_t block::deflated_size() const {
+	return deflated_.size();
+}
+
+bool block::deflate_tried() const {
+	return deflate_tried_;
+}
+
+const public_key_pointer &block::owner() const {
 	return owner_;
 }
 
@@ -103,36 +165,74 @@ UINT32 block::occurrence() const {
 	return occurrence_;
 }
 
+bool block::merkle() const {
+	return merkle_;
+}
+
+const shared_buffer &block::leaf_hashes() const {
+	if (leaf_hashes_.empty() && merkle_) {
+		leaf_hashes_ = merkle_hasher::leaf_hashes(data_.data(), size_);
+	}
+
+	return leaf_hashes_;
+}
+
 void block::set_code(const ddsn::code &code) {
 	code_ = code;
 }
 
-void block::set_signature(const BYTE signature[256]) {
-	memcpy(signature_, signature, 256);
+void block::set_signature(const BYTE *signature, int signature_type) {
+	signature_type_ = signature_type;
+	memcpy(signature_, signature, signature_size());
 }
 
 void block::set_name(const std::string &name) {
 	name_ = name;
+	data_hash_set_ = false;
 }
 
 void block::set_data(const BYTE *data, size_t size) {
-	if (data_ != nullptr) {
-		delete[] data_;
+	data_ = shared_buffer(data, size);
+	size_ = size;
+	verified_ = false;
+	data_hash_set_ = false;
+	leaf_hashes_ = shared_buffer();
+	deflated_ = shared_buffer();
+	deflate_tried_ = false;
+}
+
+void block::set_data(const shared_buffer &data) {
+	data_ = data;
+	size_ = data.size();
+	verified_ = false;
+	data_hash_set_ = false;
+	leaf_hashes_ = shared_buffer();
+	deflated_ = shared_buffer();
+	deflate_tried_ = false;
+}
+
+int block::set_deflated_data(const shared_buffer &deflated, size_t size) {
+	shared_buffer data(size);
+
+	if (inflate_data(deflated.data(), deflated.size(), data.mutable_data(), size) != 0) {
+		return 1;
 	}
 
-	data_ = new BYTE[size];
-	size_ = size;
+	set_data(data);
+
+	deflated_ = deflated;
+	deflate_tried_ = true;
 
-	memcpy(data_, data, size);
+	return 0;
 }
 
 void block::set_size(size_t size) {
 	size_ = size;
 }
 
-void block::set_owner(RSA *owner) {
+void block::set_owner(const public_key_pointer &owner) {
 	owner_ = owner;
-	hash_from_rsa(owner, owner_hash_);
+	memcpy(owner_hash_, owner->hash(), 32);
 }
 
 void block::set_owner_hash(const BYTE owner_hash[32]) {
@@ -143,185 +243,416 @@ void block::set_occurrence(UINT32 occurrence) {
 	occurrence_ = occurrence;
 }
 
+void block::set_data_hash(const BYTE data_hash[32]) {
+	memcpy(data_hash_, data_hash, 32);
+	data_hash_set_ = true;
+}
+
+void block::set_merkle(bool merkle) {
+	merkle_ = merkle;
+	data_hash_set_ = false;
+}
+
+void block::set_leaf_hashes(const shared_buffer &leaf_hashes) {
+	leaf_hashes_ = leaf_hashes;
+}
+
 void block::seal() {
-	code_ = compute_code(name_, owner_, occurrence_);
+	code_ = compute_code(name_, owner_hash_, occurrence_);
 
 	// signature
 
 	BYTE data_hash[32];
+	compute_data_hash(data_hash);
 
-	SHA256_CTX sha256;
-	SHA256_Init(&sha256);
-	SHA256_Update(&sha256, data_, size_);
-	SHA256_Update(&sha256, name_.c_str(), name_.length());
-	SHA256_Final(data_hash, &sha256);
+	signature_type_ = owner_->signature_type();
+	sign_hash(owner_->key(), data_hash, signature_);
 
-	UINT32 siglen;
-	RSA_sign(NID_sha256, data_hash, 32, signature_, &siglen, owner_);
+	verified_ = true;
 }
 
-bool block::verify() {
-	code_ = compute_code(name_, owner_, occurrence_);
+void block::seal(UINT32 occurrences, vector<block> &blocks) {
+	// the signature doesn't cover the occurrence, one is good for all of them
+	occurrence_ = 0;
+	seal();
+
+	blocks.reserve(blocks.size() + occurrences);
+	blocks.push_back(*this);
+
+	if (occurrences < 2) {
+		return;
+	}
+
+	// the other codes only differ in the occurrence, hash them together
+	vector<BYTE> inputs((occurrences - 1) * (name_.length() + 36));
+	vector<const BYTE *> data(occurrences - 1);
+	vector<size_t> sizes(occurrences - 1, name_.length() + 36);
+	vector<BYTE> codes((occurrences - 1) * 32);
+
+	for (UINT32 occurrence = 1; occurrence < occurrences; occurrence++) {
+		BYTE *input = &inputs[(occurrence - 1) * (name_.length() + 36)];
+
+		memcpy(input, name_.c_str(), name_.length());
+		memcpy(input + name_.length(), owner_hash_, 32);
+		memcpy(input + name_.length() + 32, &occurrence, 4);
+
+		data[occurrence - 1] = input;
+	}
+
+	ddsn::sha256::hash_many(data.data(), sizes.data(), occurrences - 1, (BYTE (*)[32])codes.data());
+
+	for (UINT32 occurrence = 1; occurrence < occurrences; occurrence++) {
+		block replica(*this);
+		replica.occurrence_ = occurrence;
+		replica.code_ = ddsn::code(256, &codes[(occurrence - 1) * 32]);
+
+		blocks.push_back(replica);
+	}
+}
+
+bool block::verify(verify_cache *cache) {
+	if (owner_ == nullptr) {
+		return false;
+	}
+
+	code_ = compute_code(name_, owner_->hash(), occurrence_);
 
 	// signature
 
 	BYTE data_hash[32];
+	compute_data_hash(data_hash);
 
-	SHA256_CTX sha256;
-	SHA256_Init(&sha256);
-	SHA256_Update(&sha256, data_, size_);
-	SHA256_Update(&sha256, name_.c_str(), name_.length());
-	SHA256_Final(data_hash, &sha256);
+	if (signature_type_ != owner_->signature_type()) {
+		return false;
+	}
 
-	if (RSA_verify(NID_sha256, data_hash, 32, signature_, 256, owner_) != 1) {
+	if (cache != nullptr && cache->contains(owner_hash_, data_hash, signature_, signature_size())) {
+		verified_ = true;
+		return true;
+	}
+
+	if (!verify_hash(owner_->key(), data_hash, signature_, signature_size())) {
 		return false;
 	}
 
+	if (cache != nullptr) {
+		cache->add(owner_hash_, data_hash, signature_, signature_size());
+	}
+
+	verified_ = true;
+
 	return true;
 }
 
-int block::save_to_filesystem() const {
-	if (code_.layers() != 256) {
-		return -1;
+void block::compute_data_hash(BYTE data_hash[32]) const {
+	if (data_hash_set_) {
+		memcpy(data_hash, data_hash_, 32);
+		return;
 	}
 
-	ofstream file("blocks/" + code_.string('_'), ios::out | ios::binary);
+	ddsn::sha256 sha256;
 
-	if (file.is_open()) {
-		file.seekp(0, ios::beg);
+	if (merkle_) {
+		// the root stands in for the data, the newline (names can't have
+		// one) keeps it apart from a flat hash of the same bytes
+		BYTE root[32];
+		const shared_buffer &leaves = leaf_hashes();
+		merkle_hasher::root(leaves.data(), leaves.size() / 32, root);
 
-		file.write((CHAR *)code_.bytes(), 32);
-		file.write((CHAR *)&occurrence_, 4);
-		file.write((CHAR *)signature_, 256);
-		file.write(name_.c_str(), name_.length() + 1);
+		sha256.update(root, 32);
+		sha256.update(name_.c_str(), name_.length());
+		sha256.update("\n", 1);
+	} else {
+		sha256.update(data_.data(), size_);
+		sha256.update(name_.c_str(), name_.length());
+	}
 
-		// now the public key
+	sha256.finish(data_hash);
+}
 
-		BIO *pub = BIO_new(BIO_s_mem());
+bool block::verified() const {
+	return verified_;
+}
 
-		PEM_write_bio_RSAPublicKey(pub, owner_);
+UINT32 block::record_checksum() const {
+	BYTE flags = (verified_ ? DDSN_BLOCK_FLAG_VERIFIED : 0) | (merkle_ ? DDSN_BLOCK_FLAG_MERKLE : 0);
+	UINT32 size = size_;
+
+	uLong crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, code_.bytes(), 32);
+	crc = crc32(crc, (const Bytef *)&occurrence_, 4);
+	crc = crc32(crc, signature_, signature_size());
+	crc = crc32(crc, (const Bytef *)name_.c_str(), name_.length() + 1);
+	crc = crc32(crc, owner_hash_, 32);
+	crc = crc32(crc, &flags, 1);
+	crc = crc32(crc, (const Bytef *)&size, 4);
+	crc = crc32(crc, data_.data(), size_);
+
+	return (UINT32)crc;
+}
 
-		size_t pub_len = BIO_pending(pub);
+bool block::check_integrity() const {
+	return record_checksum() == checksum_;
+}
 
-		char *pub_key = new char[pub_len];
+/*
+ * Block record, version 1. Integers are in host byte order.
+ *
+ *  0  magic "DDSB"         4
+ *  4  version              2
+ *  6  flags                2
+ *  8  code                32
+ * 40  occurrence           4
+ * 44  name length          2
+ * 46  signature length     2
+ * 48  owner hash length    2
+ * 50  signature type       2  (DDSN_SIGNATURE_*, 0 is RSA)
+ * 52  data size            4
+ * 56  stored data size     4  (differs from the data size if deflated)
+ * 60  checksum             4  (see record_checksum)
+ * 64  signature, name, owner hash (the key_table reference), stored data
+ *
+ * Records with DDSN_BLOCK_FLAG_EXTERNAL end after the owner hash, their
+ * store keeps the data elsewhere. Records with DDSN_BLOCK_FLAG_MERKLE are
+ * signed over the Merkle root of their data, the leaf hashes aren't stored.
+ */
+
+static void put16(BYTE *p, UINT16 value) {
+	memcpy(p, &value, 2);
+}
 
-		BIO_read(pub, pub_key, pub_len);
+static void put32(BYTE *p, UINT32 value) {
+	memcpy(p, &value, 4);
+}
 
-		BIO_free(pub);
+static UINT16 get16(const BYTE *p) {
+	UINT16 value;
+	memcpy(&value, p, 2);
+	return value;
+}
 
-		file.write(pub_key, pub_len);
-		file.write("\n", 1);
+static UINT32 get32(const BYTE *p) {
+	UINT32 value;
+	memcpy(&value, p, 4);
+	return value;
+}
 
-		delete[] pub_key;
+int block::write(ostream &stream, bool deflate) const {
+	const shared_buffer &stored = deflate ? deflated() : data_;
+	bool deflated = deflate && !stored.empty();
 
-		// and the data
+	if (write_header(stream, deflated ? DDSN_BLOCK_FLAG_DEFLATED : 0, deflated ? stored.size() : size_) != 0) {
+		return 1;
+	}
 
-		file.write((CHAR *)&size_, 4);
-		file.write((CHAR *)data_, size_);
-		file.close();
+	// and the data
 
-		return 0;
+	if (deflated) {
+		stream.write((CHAR *)stored.data(), stored.size());
 	} else {
-		return 1;
+		stream.write((CHAR *)data_.data(), size_);
 	}
+
+	return stream.good() ? 0 : 1;
 }
 
-int block::load_from_filesystem() {
-	if (code_.layers() != 256) {
-		return -1;
+int block::write_reference(ostream &stream, size_t stored_size, bool deflated) const {
+	UINT16 flags = DDSN_BLOCK_FLAG_EXTERNAL;
+
+	if (deflated) {
+		flags |= DDSN_BLOCK_FLAG_DEFLATED;
 	}
 
-	ifstream file("blocks/" + code_.string('_'), ios::in | ios::binary | ios::ate);
+	return write_header(stream, flags, stored_size);
+}
 
-	if (file.is_open()) {
-		size_t data_size = (size_t)file.tellg();
+int block::write_header(ostream &stream, UINT16 flags, size_t stored_size) const {
+	if (name_.length() > 0xffff) {
+		return 1;
+	}
 
-		if (data_size == 0) {
-			return 3;
-		}
+	// flags and checksum, so a verified block can be trusted when it's read again
+	// the checksum is over the inflated data, so it doesn't depend on how the data is stored
 
-		file.seekg(0, ios::beg);
+	if (verified_) {
+		flags |= DDSN_BLOCK_FLAG_VERIFIED;
+	}
 
-		// code
+	if (merkle_) {
+		flags |= DDSN_BLOCK_FLAG_MERKLE;
+	}
 
-		BYTE code_bytes[32];
-		file.read((CHAR *)code_bytes, 32);
+	size_t header_size = DDSN_BLOCK_RECORD_HEADER_SIZE + signature_size() + name_.length() + 32;
+	BYTE *header = new BYTE[header_size];
+	memset(header, 0, DDSN_BLOCK_RECORD_HEADER_SIZE);
+
+	memcpy(header, DDSN_BLOCK_RECORD_MAGIC, 4);
+	put16(header + 4, DDSN_BLOCK_RECORD_VERSION);
+	put16(header + 6, flags);
+	memcpy(header + 8, code_.bytes(), 32);
+	put32(header + 40, occurrence_);
+	put16(header + 44, name_.length());
+	put16(header + 46, signature_size());
+	put16(header + 48, 32);
+	put16(header + 50, signature_type_);
+	put32(header + 52, size_);
+	put32(header + 56, stored_size);
+	put32(header + 60, record_checksum());
+
+	BYTE *p = header + DDSN_BLOCK_RECORD_HEADER_SIZE;
+	memcpy(p, signature_, signature_size());
+	p += signature_size();
+	memcpy(p, name_.data(), name_.length());
+	memcpy(p + name_.length(), owner_hash_, 32);
+
+	stream.write((CHAR *)header, header_size);
+
+	delete[] header;
+
+	return stream.good() ? 0 : 1;
+}
 
-		if (ddsn::code(256, code_bytes) != code_) {
-			cout << "Wrong block code in file" << endl;
-			return -2;
-		}
+int block::read(istream &stream) {
+	int ret_code = read_header(stream);
 
-		// occurrence
+	if (ret_code != 0) {
+		return ret_code;
+	}
 
-		file.read((CHAR *)&occurrence_, 4);
+	if (stored_external_) {
+		// the data is somewhere else, only the store that wrote the record knows where
+		return 1;
+	}
 
-		// signature
+	// data
 
-		file.read((CHAR *)signature_, 256);
+	shared_buffer stored(stored_size_);
 
-		// name
+	stream.read((CHAR *)stored.mutable_data(), stored_size_);
 
-		char c;
-		name_ = "";
+	if (!stream.good()) {
+		return 1;
+	}
 
-		while (file.good() && (c = file.get()) != '\0') {
-			name_ += c;
-		}
+	return set_stored_data(stored);
+}
 
-		// owner
-
-		std::string public_key = "";
-		std::string line = "";
-
-		while (true) {
-			line = "";
-			while (file.good() && (c = file.get()) != '\n') {
-				line += c;
-			}
-			if (line != "") {
-				public_key += line + "\n";
-			} else {
-				break;
-			}
-		}
+int block::read_header(istream &stream) {
+	BYTE fixed[DDSN_BLOCK_RECORD_HEADER_SIZE];
+	stream.read((CHAR *)fixed, DDSN_BLOCK_RECORD_HEADER_SIZE);
 
-		BIO *pub = BIO_new(BIO_s_mem());
+	if (!stream.good()) {
+		return 1;
+	}
 
-		BIO_write(pub, public_key.c_str(), public_key.length());
+	size_t header_size = record_header_size(fixed);
 
-		PEM_read_bio_RSAPublicKey(pub, &owner_, NULL, NULL);
+	if (header_size == 0) {
+		return 1;
+	}
 
-		// data size
+	BYTE *header = new BYTE[header_size];
+	memcpy(header, fixed, DDSN_BLOCK_RECORD_HEADER_SIZE);
+	stream.read((CHAR *)header + DDSN_BLOCK_RECORD_HEADER_SIZE, header_size - DDSN_BLOCK_RECORD_HEADER_SIZE);
 
-		file.read((CHAR *)&size_, 4);
+	int ret_code = stream.good() ? read_header(header, header_size) : 1;
 
-		// data
+	delete[] header;
 
-		if (data_ != nullptr) {
-			delete data_;
-		}
+	return ret_code;
+}
+
+size_t block::record_header_size(const BYTE *fixed) {
+	if (memcmp(fixed, DDSN_BLOCK_RECORD_MAGIC, 4) != 0) {
+		cout << "Not a block record" << endl;
+		return 0;
+	}
 
-		data_ = new BYTE[size_];
+	if (get16(fixed + 4) != DDSN_BLOCK_RECORD_VERSION) {
+		cout << "Unknown block record version " << get16(fixed + 4) << endl;
+		return 0;
+	}
 
-		file.read((CHAR *)data_, size_);
-		file.close();
+	return DDSN_BLOCK_RECORD_HEADER_SIZE + get16(fixed + 44) + get16(fixed + 46) + get16(fixed + 48);
+}
 
-		if (verify()) {
-			return 0;
-		} else {
-			return 2;
-		}
-	} else {
+int block::read_header(const BYTE *header, size_t size) {
+	if (size < DDSN_BLOCK_RECORD_HEADER_SIZE || record_header_size(header) != size) {
+		return 1;
+	}
+
+	if (ddsn::code(256, header + 8) != code_) {
+		cout << "Wrong block code in record" << endl;
+		return -2;
+	}
+
+	UINT16 flags = get16(header + 6);
+	UINT16 name_length = get16(header + 44);
+
+	UINT16 signature_type = get16(header + 50);
+	size_t signature_size = ddsn::signature_size(signature_type);
+
+	if (signature_size == 0 || get16(header + 46) != signature_size || get16(header + 48) != 32) {
+		cout << "Unsupported signature or owner reference in block record" << endl;
 		return 1;
 	}
+
+	// sizes of a damaged record mustn't make loading allocate gigabytes before the checksum
+	// is checked; blocks are never larger than a message chunk and deflated data is only
+	// kept if it's smaller
+	if (get32(header + 52) > DDSN_MESSAGE_CHUNK_MAX_SIZE || get32(header + 56) > get32(header + 52)) {
+		cout << "Wrong block size in record" << endl;
+		return 1;
+	}
+
+	occurrence_ = get32(header + 40);
+	size_ = get32(header + 52);
+	stored_size_ = get32(header + 56);
+	checksum_ = get32(header + 60);
+
+	verified_ = (flags & DDSN_BLOCK_FLAG_VERIFIED) != 0;
+	stored_deflated_ = (flags & DDSN_BLOCK_FLAG_DEFLATED) != 0;
+	stored_external_ = (flags & DDSN_BLOCK_FLAG_EXTERNAL) != 0;
+	merkle_ = (flags & DDSN_BLOCK_FLAG_MERKLE) != 0;
+	leaf_hashes_ = shared_buffer();
+	data_hash_set_ = false;
+
+	const BYTE *p = header + DDSN_BLOCK_RECORD_HEADER_SIZE;
+	signature_type_ = signature_type;
+	memcpy(signature_, p, signature_size);
+	p += signature_size;
+	name_.assign((const CHAR *)p, name_length);
+	memcpy(owner_hash_, p + name_length, 32);
+	owner_ = nullptr;
+
+	data_ = shared_buffer();
+	deflated_ = shared_buffer();
+	deflate_tried_ = false;
+
+	return 0;
 }
 
-int block::delete_from_filesystem() const {
-	int ret_code = std::remove(("blocks/" + code_.string('_')).c_str());
-	if (ret_code == 0) {
-		return 0;
+size_t block::stored_size() const {
+	return stored_size_;
+}
+
+bool block::stored_external() const {
+	return stored_external_;
+}
+
+int block::set_stored_data(const shared_buffer &stored) {
+	bool verified = verified_;
+
+	if (stored_deflated_) {
+		if (set_deflated_data(stored, size_) != 0) {
+			cout << "Could not inflate block data" << endl;
+			return 1;
+		}
 	} else {
-		return 1;
+		set_data(stored);
 	}
-}
\ No newline at end of file
+
+	verified_ = verified;
+
+	return 0;
+}
@@ -1,63 +1,178 @@
 #ifndef DDSN_BLOCK_H
 #define DDSN_BLOCK_H
 
+#include "buffer.h"
 #include "code.h"
 #include "definitions.h"
+#include "keys.h"
+#include "merkle.h"
+#include "sha256.h"
+#include "verify_cache.h"
 
-#include <openssl/rsa.h>
+#include <iosfwd>
 #include <string>
+#include <vector>
+
+#define DDSN_BLOCK_FLAG_VERIFIED 1
+#define DDSN_BLOCK_FLAG_DEFLATED 2
+#define DDSN_BLOCK_FLAG_EXTERNAL 4
+#define DDSN_BLOCK_FLAG_MERKLE   8
+
+#define DDSN_BLOCK_RECORD_MAGIC       "DDSB"
+#define DDSN_BLOCK_RECORD_VERSION     1
+#define DDSN_BLOCK_RECORD_HEADER_SIZE 64
 
 namespace ddsn {
 
+/*
+ * SHA-256 over block data fed in pieces as it arrives, finished with the
+ * name like seal and verify hash it (see block::set_data_hash).
+ */
+class data_hasher {
+public:
+	data_hasher();
+
+	void update(const BYTE *data, size_t size);
+	void finish(const std::string &name, BYTE data_hash[32]);
+private:
+	ddsn::sha256 sha256_;
+};
+
 class block {
 public:
 	static block copy_without_data(const block &block);
 
-	static code compute_code(const std::string name, BYTE owner_hash[32], UINT32 occurrence);
-	static code compute_code(const std::string name, RSA *owner, UINT32 occurrence);
+	static code compute_code(const std::string name, const BYTE owner_hash[32], UINT32 occurrence);
 
 	block();
 	block(const std::string &name);
 	block(const code &code);
 	block(const block &block);
+	block &operator=(const block &block);
 	~block();
 
 	const ddsn::code &code() const;
 	const BYTE *signature() const;
+	// DDSN_SIGNATURE_*, set by seal from the owner key
+	int signature_type() const;
+	size_t signature_size() const;
 	const std::string &name() const;
 	const BYTE *data() const;
+	const shared_buffer &data_buffer() const;
 	size_t size() const;
-	RSA *owner() const;
+	// deflated data, empty if it doesn't compress (see deflate_data)
+	// computed once and kept with the block
+	const shared_buffer &deflated() const;
+	size_t deflated_size() const;
+	// true once deflated() has something to return without deflating
+	bool deflate_tried() const;
+	// registered owner key, see key_registry
+	const public_key_pointer &owner() const;
 	const BYTE *owner_hash() const;
 	UINT32 occurrence() const;
+	// whether the signature covers the root of a Merkle tree over the data
+	// (see merkle_hasher) instead of a hash of the whole data
+	bool merkle() const;
+	// hashes of the data's chunks, computed once and kept with the block
+	// (Merkle blocks only)
+	const shared_buffer &leaf_hashes() const;
 
 	void set_code(const ddsn::code &code);
-	void set_signature(const BYTE signature[256]);
+	void set_signature(const BYTE *signature, int signature_type);
 	void set_name(const std::string &name);
+	// new data isn't verified, loads use set_stored_data to keep the record's flag
 	void set_data(const BYTE *data, size_t size);
+	void set_data(const shared_buffer &data);
+	// inflate the data (of size bytes) and keep the deflated form; returns 0 on success
+	int set_deflated_data(const shared_buffer &deflated, size_t size);
 	void set_size(size_t size);
-	void set_owner(RSA *owner);
+	void set_owner(const public_key_pointer &owner);
 	void set_owner_hash(const BYTE owner_hash[32]);
 	void set_occurrence(UINT32 occurrence);
+	// hash of the current data and name computed while the data arrived,
+	// seal and verify use it instead of hashing the data again
+	void set_data_hash(const BYTE data_hash[32]);
+	// before seal or verify, drops a data hash set before
+	void set_merkle(bool merkle);
+	// leaf hashes that are known to match the current data (hashed while it
+	// arrived or checked chunk by chunk), saves hashing the data again
+	void set_leaf_hashes(const shared_buffer &leaf_hashes);
 
 	// create code and signature from name and data
 	void seal();
 
+	// seal the block as occurrence 0 and append it and its other occurrences
+	// (up to occurrences - 1) to blocks; data and name are hashed and signed once
+	void seal(UINT32 occurrences, std::vector<block> &blocks);
+
 	// verify code/name and signature/data
-	bool verify();
+	// signatures found in the cache aren't verified again, new ones are added to it
+	bool verify(verify_cache *cache = nullptr);
+
+	// whether seal() or verify() succeeded, or the block was read from a
+	// record written after that
+	bool verified() const;
 
-	int load_from_filesystem();
-	int save_to_filesystem() const;
-	int delete_from_filesystem() const;
+	// checksum over the record's fields and data
+	UINT32 record_checksum() const;
+
+	// whether the checksum read with the record matches the block's contents
+	bool check_integrity() const;
+
+	// serialize the block record to a stream (no framing)
+	// the owner is only referenced by its hash
+	int write(std::ostream &stream, bool deflate = false) const;
+	// serialize the record without the data, which the store keeps elsewhere
+	// (stored_size bytes, deflated or not)
+	int write_reference(std::ostream &stream, size_t stored_size, bool deflated) const;
+	// read a block record from a stream (doesn't set the owner key or verify)
+	int read(std::istream &stream);
+	// read a block record up to the data, which starts at the stream's position
+	// afterwards and can be set separately (e.g. from a mapped file)
+	int read_header(std::istream &stream);
+	// the same from memory, size must be the record_header_size
+	int read_header(const BYTE *header, size_t size);
+	// length of the record header (everything before the data) from its first
+	// DDSN_BLOCK_RECORD_HEADER_SIZE bytes, 0 if they aren't a known block record
+	static size_t record_header_size(const BYTE *fixed);
+	// size of the data as stored in the record read by read_header
+	size_t stored_size() const;
+	// whether the record read by read_header was written by write_reference
+	bool stored_external() const;
+	// set the data as stored in the record, keeping the record's verified flag
+	int set_stored_data(const shared_buffer &stored);
 private:
+	// SHA-256 over data (or the Merkle root) and name, what the signature signs
+	void compute_data_hash(BYTE data_hash[32]) const;
+	int write_header(std::ostream &stream, UINT16 flags, size_t stored_size) const;
+
 	ddsn::code code_;
-	BYTE signature_[256];
+	BYTE signature_[DDSN_SIGNATURE_MAX_SIZE];
+	int signature_type_;
 	std::string name_;
-	BYTE *data_;
+	shared_buffer data_;
 	size_t size_;
-	RSA *owner_;
+	public_key_pointer owner_;
 	BYTE owner_hash_[32];
 	UINT32 occurrence_;
+	bool merkle_;
+
+	bool verified_;
+	UINT32 checksum_;
+
+	// set by set_data_hash, dropped with the data or name
+	BYTE data_hash_[32];
+	bool data_hash_set_;
+
+	mutable shared_buffer leaf_hashes_;
+
+	mutable shared_buffer deflated_;
+	mutable bool deflate_tried_;
+
+	// set by read_header
+	bool stored_deflated_;
+	bool stored_external_;
+	size_t stored_size_;
 };
 
 }
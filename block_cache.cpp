@@ -0,0 +1,123 @@
+#include "block_cache.h"
+
+using namespace ddsn;
+using namespace std;
+
+block_cache::block_cache(UINT64 capacity) :
+capacity_(capacity), probation_size_(0), protected_size_(0) {
+
+}
+
+block_cache::~block_cache() {
+
+}
+
+void block_cache::set_capacity(UINT64 capacity) {
+	capacity_ = capacity;
+	evict();
+}
+
+UINT64 block_cache::capacity() const {
+	return capacity_;
+}
+
+UINT64 block_cache::size() const {
+	return probation_size_ + protected_size_;
+}
+
+UINT64 block_cache::cost(const block &block) {
+	// data (and its deflated form) plus roughly what the block object itself takes
+	return block.size() + block.deflated_size() + block.name().length() + sizeof(ddsn::block) + 64;
+}
+
+bool block_cache::get(const ddsn::code &code, block &block) {
+	auto it = entries_.find(code);
+
+	if (it == entries_.end()) {
+		return false;
+	}
+
+	entry &e = it->second;
+
+	if (e.protected_segment) {
+		protected_.splice(protected_.begin(), protected_, e.it);
+	} else {
+		// second hit, promote to the protected segment
+		UINT64 c = cost(*e.it);
+
+		protected_.splice(protected_.begin(), probation_, e.it);
+		probation_size_ -= c;
+		protected_size_ += c;
+		e.protected_segment = true;
+
+		evict();
+	}
+
+	block = *e.it;
+
+	return true;
+}
+
+void block_cache::put(const block &block) {
+	UINT64 c = cost(block);
+
+	if (c > capacity_ / 2) {
+		// wouldn't leave room for anything else
+		return;
+	}
+
+	remove(block.code());
+
+	probation_.push_front(block);
+	probation_size_ += c;
+
+	entry e;
+	e.protected_segment = false;
+	e.it = probation_.begin();
+	entries_[block.code()] = e;
+
+	evict();
+}
+
+void block_cache::remove(const ddsn::code &code) {
+	auto it = entries_.find(code);
+
+	if (it == entries_.end()) {
+		return;
+	}
+
+	UINT64 c = cost(*it->second.it);
+
+	if (it->second.protected_segment) {
+		protected_.erase(it->second.it);
+		protected_size_ -= c;
+	} else {
+		probation_.erase(it->second.it);
+		probation_size_ -= c;
+	}
+
+	entries_.erase(it);
+}
+
+void block_cache::evict() {
+	UINT64 protected_capacity = capacity_ / 5 * 4;
+
+	// demote from the protected segment back to probation
+	while (protected_size_ > protected_capacity && !protected_.empty()) {
+		UINT64 c = cost(protected_.back());
+
+		entries_[protected_.back().code()].protected_segment = false;
+		probation_.splice(probation_.begin(), protected_, prev(protected_.end()));
+		protected_size_ -= c;
+		probation_size_ += c;
+	}
+
+	// evict from the probation segment
+	while (probation_size_ + protected_size_ > capacity_ && !probation_.empty()) {
+		UINT64 c = cost(probation_.back());
+
+		entries_.erase(probation_.back().code());
+		probation_.pop_back();
+		probation_size_ -= c;
+	}
+}
@@ -0,0 +1,54 @@
+#ifndef DDSN_BLOCK_CACHE_H
+#define DDSN_BLOCK_CACHE_H
+
+#include "block.h"
+#include "code.h"
+#include "definitions.h"
+
+#include <list>
+#include <unordered_map>
+
+namespace ddsn {
+
+/*
+ * In-memory cache of verified blocks, bounded in bytes.
+ * Segmented LRU: new blocks enter the probation segment and are only
+ * promoted to the protected segment (80% of the capacity) when they're hit
+ * again, so a scan over many blocks can't flush the popular ones.
+ */
+class block_cache {
+public:
+	block_cache(UINT64 capacity = 0);
+	~block_cache();
+
+	void set_capacity(UINT64 capacity);
+	UINT64 capacity() const;
+	UINT64 size() const;
+
+	// copies the cached block (sharing its data) if there is one
+	bool get(const code &code, block &block);
+	void put(const block &block);
+	void remove(const code &code);
+private:
+	struct entry {
+		bool protected_segment;
+		std::list<block>::iterator it;
+	};
+
+	static UINT64 cost(const block &block);
+
+	void evict();
+
+	UINT64 capacity_;
+	UINT64 probation_size_;
+	UINT64 protected_size_;
+
+	// most recently used at the front
+	std::list<block> probation_;
+	std::list<block> protected_;
+	std::unordered_map<code, entry> entries_;
+};
+
+}
+
+#endif
@@ -0,0 +1,178 @@
+#include "block_store.h"
+
+#include <boost/filesystem.hpp>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+using namespace ddsn;
+using namespace std;
+
+block_store::block_store() : mapped_reads_(false), deflate_(false), verify_cache_(nullptr) {
+
+}
+
+block_store::~block_store() {
+
+}
+
+void block_store::set_mapped_reads(bool mapped_reads) {
+	mapped_reads_ = mapped_reads;
+}
+
+void block_store::set_deflate(bool deflate) {
+	deflate_ = deflate;
+}
+
+void block_store::set_verify_cache(verify_cache *verify_cache) {
+	verify_cache_ = verify_cache;
+}
+
+void block_store::locate(const ddsn::code &code, manifest_entry &entry) {
+	entry.located = false;
+}
+
+int block_store::finish_load(block &block, key_table &keys) {
+	public_key_pointer owner = keys.get(block.owner_hash());
+
+	if (owner == nullptr) {
+		return 2;
+	}
+
+	block.set_owner(owner);
+
+	if (block.verified()) {
+		if (block.check_integrity()) {
+			return 0;
+		}
+
+		cout << "Block " << block.code().string('_') << " failed its integrity check" << endl;
+	}
+
+	if (block.verify(verify_cache_)) {
+		return 0;
+	} else {
+		return 2;
+	}
+}
+
+// FILE BLOCK STORE
+
+file_block_store::file_block_store(key_table &keys) : keys_(keys) {
+
+}
+
+file_block_store::~file_block_store() {
+
+}
+
+int file_block_store::open(const block_manifest &manifest) {
+	return 0;
+}
+
+string file_block_store::path(const ddsn::code &code) const {
+	return "blocks/" + code.string('_');
+}
+
+int file_block_store::save(const block &block) {
+	if (block.code().layers() != 256) {
+		return -1;
+	}
+
+	if (keys_.add(block.owner()) != 0) {
+		return 1;
+	}
+
+	// a new file replaces the old one, which may still be mapped by readers
+	string tmp_path = path(block.code()) + ".tmp";
+	ofstream file(tmp_path, ios::out | ios::binary | ios::trunc);
+
+	if (!file.is_open()) {
+		return 1;
+	}
+
+	int ret_code = block.write(file, deflate_);
+	file.close();
+
+	if (ret_code != 0 || !file.good() || std::rename(tmp_path.c_str(), path(block.code()).c_str()) != 0) {
+		std::remove(tmp_path.c_str());
+		return 1;
+	}
+
+	return 0;
+}
+
+int file_block_store::load(block &block) {
+	if (block.code().layers() != 256) {
+		return -1;
+	}
+
+	ifstream file(path(block.code()), ios::in | ios::binary | ios::ate);
+
+	if (file.is_open()) {
+		size_t data_size = (size_t)file.tellg();
+
+		if (data_size == 0) {
+			return 3;
+		}
+
+		file.seekg(0, ios::beg);
+
+		int ret_code;
+
+		if (mapped_reads_) {
+			ret_code = block.read_header(file);
+
+			if (ret_code == 0) {
+				UINT64 offset = (UINT64)file.tellg();
+				shared_buffer data = shared_buffer::map(mapped_file::open(path(block.code())), offset, block.stored_size());
+
+				if (data.empty() && block.stored_size() != 0) {
+					ret_code = 1;
+				} else {
+					// not set_data, which would drop the verified flag read_header read
+					ret_code = block.set_stored_data(data);
+				}
+			}
+		} else {
+			ret_code = block.read(file);
+		}
+
+		file.close();
+
+		if (ret_code != 0) {
+			return ret_code;
+		}
+
+		return finish_load(block, keys_);
+	} else {
+		return 1;
+	}
+}
+
+int file_block_store::remove(const ddsn::code &code) {
+	int ret_code = std::remove(path(code).c_str());
+	if (ret_code == 0) {
+		return 0;
+	} else {
+		return 1;
+	}
+}
+
+int file_block_store::list(vector<ddsn::code> &codes) {
+	boost::filesystem::directory_iterator end;
+
+	for (boost::filesystem::directory_iterator it("blocks/"); it != end; ++it) {
+		string name = it->path().filename().string();
+
+		if (name.length() == 64 && name.find_first_not_of("0123456789abcdef") == string::npos) {
+			codes.push_back(ddsn::code(name, '_'));
+		}
+	}
+
+	return 0;
+}
+
+public_key_pointer file_block_store::owner_key(const BYTE hash[32]) {
+	return keys_.get(hash);
+}
@@ -0,0 +1,83 @@
+#ifndef DDSN_BLOCK_STORE_H
+#define DDSN_BLOCK_STORE_H
+
+#include "block.h"
+#include "code.h"
+#include "key_table.h"
+#include "manifest.h"
+#include "verify_cache.h"
+
+#include <vector>
+
+namespace ddsn {
+
+/*
+ * Storage engine behind local_peer::store/load.
+ * All methods return 0 on success, like the block's filesystem methods.
+ */
+class block_store {
+public:
+	block_store();
+	virtual ~block_store();
+
+	// serve block data from memory-mapped files instead of reading it into memory
+	void set_mapped_reads(bool mapped_reads);
+	// deflate the data of blocks that compress (inflated again on load, even with mapped reads)
+	void set_deflate(bool deflate);
+
+	// remember verified signatures here (optional)
+	void set_verify_cache(verify_cache *verify_cache);
+
+	// prepare the store for use (e.g. rebuild indexes)
+	// the manifest lists the stored blocks, with locations if the store set them before
+	virtual int open(const block_manifest &manifest) = 0;
+
+	virtual int save(const block &block) = 0;
+	// load and verify the block with the code set in block
+	virtual int load(block &block) = 0;
+	virtual int remove(const code &code) = 0;
+
+	// codes of all stored blocks (slow, only used to rebuild the manifest)
+	virtual int list(std::vector<code> &codes) = 0;
+
+	// key of an owner of stored blocks, nullptr if there's none
+	virtual public_key_pointer owner_key(const BYTE hash[32]) = 0;
+
+	// set the location of a stored block in its manifest entry, if the store keeps locations
+	virtual void locate(const code &code, manifest_entry &entry);
+protected:
+	// set the owner key of a block read from disk and verify it
+	// blocks that were verified before they were saved are only checked against their record checksum
+	int finish_load(block &block, key_table &keys);
+
+	bool mapped_reads_;
+	bool deflate_;
+	verify_cache *verify_cache_;
+};
+
+/*
+ * One file per block under blocks/<code>.
+ */
+class file_block_store : public block_store {
+public:
+	file_block_store(key_table &keys);
+	~file_block_store();
+
+	int open(const block_manifest &manifest);
+
+	int save(const block &block);
+	int load(block &block);
+	int remove(const code &code);
+
+	int list(std::vector<code> &codes);
+
+	public_key_pointer owner_key(const BYTE hash[32]);
+private:
+	std::string path(const code &code) const;
+
+	key_table &keys_;
+};
+
+}
+
+#endif
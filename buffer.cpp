@@ -0,0 +1,191 @@
+#include "buffer.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace ddsn;
+using namespace std;
+
+// MAPPED FILE
+
+shared_ptr<mapped_file> mapped_file::open(const string &path) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return nullptr;
+	}
+
+	void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	// the mapping stays valid after closing the descriptor
+	::close(fd);
+
+	if (data == MAP_FAILED) {
+		return nullptr;
+	}
+
+	return shared_ptr<mapped_file>(new mapped_file(data, st.st_size));
+}
+
+mapped_file::mapped_file(void *data, size_t size) : data_(data), size_(size) {
+
+}
+
+mapped_file::~mapped_file() {
+	munmap(data_, size_);
+}
+
+const BYTE *mapped_file::data() const {
+	return (const BYTE *)data_;
+}
+
+size_t mapped_file::size() const {
+	return size_;
+}
+
+// SHARED BUFFER
+
+shared_buffer::shared_buffer() : data_(nullptr), size_(0) {
+
+}
+
+shared_buffer::shared_buffer(size_t size) : size_(size) {
+	shared_ptr<BYTE> storage(new BYTE[size], default_delete<BYTE[]>());
+	data_ = storage.get();
+	owner_ = storage;
+}
+
+shared_buffer::shared_buffer(const BYTE *data, size_t size) : size_(size) {
+	shared_ptr<BYTE> storage(new BYTE[size], default_delete<BYTE[]>());
+	memcpy(storage.get(), data, size);
+	data_ = storage.get();
+	owner_ = storage;
+}
+
+shared_buffer::shared_buffer(shared_ptr<const void> owner, const BYTE *data, size_t size) :
+owner_(owner), data_(data), size_(size) {
+
+}
+
+shared_buffer shared_buffer::map(shared_ptr<mapped_file> file, UINT64 offset, size_t size) {
+	if (!file || offset + size > file->size()) {
+		return shared_buffer();
+	}
+
+	return shared_buffer(file, file->data() + offset, size);
+}
+
+shared_buffer shared_buffer::slice(size_t offset, size_t size) const {
+	if (offset + size > size_) {
+		return shared_buffer();
+	}
+
+	return shared_buffer(owner_, data_ + offset, size);
+}
+
+const BYTE *shared_buffer::data() const {
+	return data_;
+}
+
+BYTE *shared_buffer::mutable_data() {
+	return (BYTE *)data_;
+}
+
+size_t shared_buffer::size() const {
+	return size_;
+}
+
+bool shared_buffer::empty() const {
+	return data_ == nullptr;
+}
+
+// SEND QUEUE
+
+send_queue::send_queue() : offset_(0), sealed_(0), tail_size_(0) {
+
+}
+
+void send_queue::push(const shared_buffer &buffer) {
+	if (buffer.size() < DDSN_SEND_COALESCE_SIZE) {
+		push(buffer.data(), buffer.size());
+		return;
+	}
+
+	fragments_.push_back(buffer);
+	tail_ = shared_buffer();
+}
+
+void send_queue::push(const BYTE *bytes, size_t size) {
+	if (size == 0) {
+		return;
+	}
+
+	if (size >= DDSN_SEND_COALESCE_SIZE) {
+		fragments_.push_back(shared_buffer(bytes, size));
+		tail_ = shared_buffer();
+		return;
+	}
+
+	// the tail can't grow while a write reads it
+	bool open = !tail_.empty() && fragments_.size() > sealed_ && tail_size_ + size <= tail_.size();
+
+	if (!open) {
+		tail_ = shared_buffer(DDSN_SEND_TAIL_SIZE);
+		tail_size_ = 0;
+		fragments_.push_back(shared_buffer());
+	}
+
+	memcpy(tail_.mutable_data() + tail_size_, bytes, size);
+	tail_size_ += size;
+
+	fragments_.back() = tail_.slice(0, tail_size_);
+}
+
+bool send_queue::empty() const {
+	return fragments_.empty();
+}
+
+vector<boost::asio::const_buffer> send_queue::buffers() {
+	vector<boost::asio::const_buffer> buffers;
+
+	for (auto it = fragments_.begin(); it != fragments_.end() && buffers.size() < DDSN_SEND_GATHER_MAX; ++it) {
+		size_t offset = buffers.empty() ? offset_ : 0;
+		buffers.push_back(boost::asio::buffer(it->data() + offset, it->size() - offset));
+	}
+
+	sealed_ = buffers.size();
+
+	return buffers;
+}
+
+void send_queue::consume(size_t size) {
+	while (size > 0 && !fragments_.empty()) {
+		size_t left = fragments_.front().size() - offset_;
+
+		if (size < left) {
+			offset_ += size;
+			break;
+		}
+
+		size -= left;
+		offset_ = 0;
+
+		if (fragments_.size() == 1) {
+			tail_ = shared_buffer();
+		}
+
+		fragments_.pop_front();
+	}
+
+	sealed_ = 0;
+}
@@ -0,0 +1,103 @@
+#ifndef DDSN_BUFFER_H
+#define DDSN_BUFFER_H
+
+#include "definitions.h"
+
+#include <boost/asio/buffer.hpp>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+// smaller buffers are copied together into one fragment when queued for sending
+#define DDSN_SEND_COALESCE_SIZE 4096
+// size of a fragment small buffers are copied into
+#define DDSN_SEND_TAIL_SIZE     16384
+// most fragments handed to one gathered write
+#define DDSN_SEND_GATHER_MAX    64
+
+namespace ddsn {
+
+/*
+ * Read-only memory mapping of a file.
+ */
+class mapped_file {
+public:
+	static std::shared_ptr<mapped_file> open(const std::string &path);
+
+	~mapped_file();
+
+	const BYTE *data() const;
+	size_t size() const;
+private:
+	mapped_file(void *data, size_t size);
+
+	void *data_;
+	size_t size_;
+};
+
+/*
+ * Refcounted view of immutable bytes.
+ * The bytes either live on the heap or in a mapped file; copying a
+ * shared_buffer only copies the reference, the storage is released
+ * together with the last view.
+ */
+class shared_buffer {
+public:
+	shared_buffer();
+	// allocate size bytes, to be filled through mutable_data()
+	shared_buffer(size_t size);
+	// copy size bytes from data
+	shared_buffer(const BYTE *data, size_t size);
+	// view on bytes kept alive by owner
+	shared_buffer(std::shared_ptr<const void> owner, const BYTE *data, size_t size);
+
+	static shared_buffer map(std::shared_ptr<mapped_file> file, UINT64 offset, size_t size);
+
+	// view on a part of this buffer, sharing its storage
+	shared_buffer slice(size_t offset, size_t size) const;
+
+	const BYTE *data() const;
+	BYTE *mutable_data();
+	size_t size() const;
+	bool empty() const;
+private:
+	std::shared_ptr<const void> owner_;
+	const BYTE *data_;
+	size_t size_;
+};
+
+/*
+ * Outgoing bytes of a connection, written with gathered writes.
+ * Large buffers (block data) are queued by reference, small ones (message
+ * headers, signatures) are copied together into a tail fragment, so a
+ * message goes out in few fragments without copying its payload.
+ */
+class send_queue {
+public:
+	send_queue();
+
+	void push(const shared_buffer &buffer);
+	void push(const BYTE *bytes, size_t size);
+
+	bool empty() const;
+
+	// the bytes to write next, up to DDSN_SEND_GATHER_MAX fragments; they
+	// aren't appended to until consume is called
+	std::vector<boost::asio::const_buffer> buffers();
+	// drop size written bytes from the front
+	void consume(size_t size);
+private:
+	std::deque<shared_buffer> fragments_;
+	// bytes of the first fragment written already
+	size_t offset_;
+	// fragments handed to the running write
+	size_t sealed_;
+	// storage of the last fragment while small buffers can be appended to it
+	shared_buffer tail_;
+	size_t tail_size_;
+};
+
+}
+
+#endif
@@ -0,0 +1,114 @@
+#include "code_index.h"
+
+using namespace ddsn;
+using namespace std;
+
+code_index::code_index() {
+
+}
+
+code_index::~code_index() {
+
+}
+
+code_index::key code_index::to_key(const ddsn::code &code) {
+	key k;
+	k.fill(0);
+
+	// layer i is bit i % 8 of byte i / 8 in a code, make it the most significant bit first
+	const BYTE *bytes = code.bytes();
+
+	for (int i = 0; i < 32 && (UINT32)i * 8 < code.layers(); i++) {
+		BYTE b = bytes[i];
+		b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+		b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+		b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+		k[i] = b;
+	}
+
+	return k;
+}
+
+code code_index::from_key(const key &k) {
+	BYTE bytes[32];
+
+	for (int i = 0; i < 32; i++) {
+		BYTE b = k[i];
+		b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+		b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+		b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+		bytes[i] = b;
+	}
+
+	return code(256, bytes);
+}
+
+void code_index::insert(const ddsn::code &code) {
+	keys_.insert(to_key(code));
+}
+
+void code_index::erase(const ddsn::code &code) {
+	keys_.erase(to_key(code));
+}
+
+bool code_index::exists(const ddsn::code &code) const {
+	return keys_.count(to_key(code)) > 0;
+}
+
+size_t code_index::size() const {
+	return keys_.size();
+}
+
+void code_index::clear() {
+	keys_.clear();
+}
+
+void code_index::list(vector<ddsn::code> &codes) const {
+	for (auto it = keys_.begin(); it != keys_.end(); ++it) {
+		codes.push_back(from_key(*it));
+	}
+}
+
+pair<set<code_index::key>::const_iterator, set<code_index::key>::const_iterator> code_index::range(const ddsn::code &prefix) const {
+	// lowest and highest key starting with the prefix
+	key low;
+	key high;
+	low.fill(0);
+	high.fill(0xFF);
+
+	for (UINT32 i = 0; i < prefix.layers() && i < 256; i++) {
+		BYTE bit = 0x80 >> (i % 8);
+
+		if (prefix.layer_code(i)) {
+			low[i / 8] |= bit;
+		} else {
+			high[i / 8] &= ~bit;
+		}
+	}
+
+	return make_pair(keys_.lower_bound(low), keys_.upper_bound(high));
+}
+
+void code_index::under(const ddsn::code &prefix, vector<ddsn::code> &codes) const {
+	auto r = range(prefix);
+
+	for (auto it = r.first; it != r.second; ++it) {
+		codes.push_back(from_key(*it));
+	}
+}
+
+bool code_index::first_outside(const ddsn::code &prefix, ddsn::code &code) const {
+	auto r = range(prefix);
+
+	if (r.first != keys_.begin()) {
+		code = from_key(*keys_.begin());
+		return true;
+	}
+
+	if (r.second != keys_.end()) {
+		code = from_key(*r.second);
+		return true;
+	}
+
+	return false;
+}
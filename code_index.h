@@ -0,0 +1,52 @@
+#ifndef DDSN_CODE_INDEX_H
+#define DDSN_CODE_INDEX_H
+
+#include "code.h"
+#include "definitions.h"
+
+#include <array>
+#include <set>
+#include <vector>
+
+namespace ddsn {
+
+/*
+ * Ordered set of block codes (256 layers).
+ * Codes are ordered layer by layer, so all codes under a peer code form one
+ * contiguous range that is found in O(log n) and enumerated in O(k).
+ */
+class code_index {
+public:
+	code_index();
+	~code_index();
+
+	void insert(const code &code);
+	void erase(const code &code);
+	bool exists(const code &code) const;
+	size_t size() const;
+	void clear();
+
+	// all codes in order
+	void list(std::vector<code> &codes) const;
+
+	// codes under the prefix, in order
+	void under(const code &prefix, std::vector<code> &codes) const;
+
+	// first code that is not under the prefix, false if there's none
+	bool first_outside(const code &prefix, code &code) const;
+private:
+	// the code's layers as big-endian bits
+	typedef std::array<BYTE, 32> key;
+
+	static key to_key(const code &code);
+	static code from_key(const key &key);
+
+	// the keys under the prefix are [first, second)
+	std::pair<std::set<key>::const_iterator, std::set<key>::const_iterator> range(const code &prefix) const;
+
+	std::set<key> keys_;
+};
+
+}
+
+#endif
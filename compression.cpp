@@ -0,0 +1,83 @@
+#include "compression.h"
+
+#include <zlib.h>
+#include <algorithm>
+
+using namespace ddsn;
+using namespace std;
+
+// deflated size in bytes or 0 if it doesn't fit into out
+static size_t deflate_into(const BYTE *data, size_t size, BYTE *out, size_t out_size) {
+	z_stream stream;
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+
+	if (deflateInit(&stream, DDSN_DEFLATE_LEVEL) != Z_OK) {
+		return 0;
+	}
+
+	stream.next_in = (Bytef *)data;
+	stream.avail_in = size;
+	stream.next_out = out;
+	stream.avail_out = out_size;
+
+	int ret = deflate(&stream, Z_FINISH);
+	size_t deflated_size = stream.total_out;
+
+	deflateEnd(&stream);
+
+	return ret == Z_STREAM_END ? deflated_size : 0;
+}
+
+shared_buffer ddsn::deflate_data(const BYTE *data, size_t size) {
+	if (size < DDSN_DEFLATE_MIN_SIZE) {
+		return shared_buffer();
+	}
+
+	// worth keeping only if at least this small
+	size_t limit = size - size * DDSN_DEFLATE_MIN_SAVING / 100;
+
+	if (size > DDSN_DEFLATE_SAMPLE_SIZE) {
+		size_t sample_size = DDSN_DEFLATE_SAMPLE_SIZE;
+		size_t sample_limit = sample_size - sample_size * DDSN_DEFLATE_MIN_SAVING / 100;
+
+		shared_buffer sample(sample_limit);
+
+		if (deflate_into(data, sample_size, sample.mutable_data(), sample_limit) == 0) {
+			return shared_buffer();
+		}
+	}
+
+	shared_buffer out(limit);
+	size_t deflated_size = deflate_into(data, size, out.mutable_data(), limit);
+
+	if (deflated_size == 0) {
+		return shared_buffer();
+	}
+
+	return out.slice(0, deflated_size);
+}
+
+int ddsn::inflate_data(const BYTE *data, size_t deflated_size, BYTE *out, size_t size) {
+	z_stream stream;
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+	stream.next_in = (Bytef *)data;
+	stream.avail_in = deflated_size;
+
+	if (inflateInit(&stream) != Z_OK) {
+		return 1;
+	}
+
+	stream.next_out = out;
+	stream.avail_out = size;
+
+	int ret = inflate(&stream, Z_FINISH);
+	size_t inflated_size = stream.total_out;
+
+	inflateEnd(&stream);
+
+	return ret == Z_STREAM_END && inflated_size == size ? 0 : 1;
+}
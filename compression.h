@@ -0,0 +1,22 @@
+#ifndef DDSN_COMPRESSION_H
+#define DDSN_COMPRESSION_H
+
+#include "buffer.h"
+#include "definitions.h"
+
+namespace ddsn {
+
+/*
+ * Deflate the data if it's worth it. A sample from the start is compressed
+ * first so incompressible data (media, archives, encrypted files) costs
+ * little; data that doesn't shrink by DDSN_DEFLATE_MIN_SAVING percent isn't
+ * deflated either. Returns an empty buffer in both cases.
+ */
+shared_buffer deflate_data(const BYTE *data, size_t size);
+
+// inflate into exactly size bytes; returns 0 on success
+int inflate_data(const BYTE *data, size_t deflated_size, BYTE *out, size_t size);
+
+}
+
+#endif
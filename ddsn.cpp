@@ -1,11 +1,18 @@
 #include "api_server.h"
+#include "io_ring.h"
 #include "local_peer.h"
 #include "peer_server.h"
+#include "segment_store.h"
+#include "sha256.h"
+#include "utilities.h"
+#include "worker_pool.h"
 
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
+#include <algorithm>
 #include <iostream>
+#include <thread>
 
 using namespace ddsn;
 using namespace std;
@@ -24,7 +31,18 @@ int main(int argc, char *argv[]) {
 		("api-password", po::value<string>()->default_value(""), "set api password")
 		("integrated", "start as peer of a new network")
 		("capacity", po::value<int>()->default_value(5), "maximum number of blocks to store")
+		("storage", po::value<string>()->default_value("segment"), "block storage engine (segment, file)")
+		("mmap", "serve block data from memory-mapped files")
+		("io", po::value<string>()->default_value("fstream"), "segment file I/O (fstream, uring)")
+		("compress", "deflate compressible blocks on disk and, if the other peer agrees, on the wire")
+		("merkle", "sign files larger than 64 KiB over a Merkle tree of their chunks, so peers check them chunk by chunk")
+		("cache-size", po::value<string>()->default_value("64M"), "size of the in-memory block cache (e.g. 512M, 2G)")
+		("disk-threads", po::value<int>()->default_value(4), "number of threads doing block store I/O")
+		("crypto-threads", po::value<int>()->default_value(0), "number of threads checking signatures (0: one per core)")
 		("new-identity", "don't load keys but generate a new identity")
+		("key-type", po::value<string>()->default_value("rsa"), "signature scheme of a new identity (rsa, ed25519)")
+		("sha256-kernel", po::value<string>()->default_value("openssl"), "SHA-256 kernel (openssl, sha-ni), only switch if make bench shows it's faster")
+		("sha256-lanes", "hash short messages in the AVX2 lanes, only if make bench shows it's faster")
 		;
 
 	po::variables_map vm;
@@ -53,6 +71,59 @@ int main(int argc, char *argv[]) {
 		boost::filesystem::create_directory("blocks");
 	}
 
+	if (!sha256::use_kernel(vm["sha256-kernel"].as<string>())) {
+		cout << "SHA-256 kernel " << vm["sha256-kernel"].as<string>() << " is not available" << endl;
+		return 1;
+	}
+
+	sha256::set_multi_buffer(vm.count("sha256-lanes") > 0);
+
+	// open block store
+
+	key_table owner_keys;
+
+	if (owner_keys.open() != 0) {
+		cout << "Could not open owner key table" << endl;
+		return 1;
+	}
+
+	verify_cache verified_signatures;
+
+	io_ring *ring = nullptr;
+
+	if (vm["io"].as<string>() == "uring") {
+		ring = io_ring::create();
+
+		if (ring == nullptr) {
+			cout << "io_uring is not available, falling back to fstream" << endl;
+		}
+	} else if (vm["io"].as<string>() != "fstream") {
+		cout << "Unknown I/O backend " << vm["io"].as<string>() << endl;
+		return 1;
+	}
+
+	block_store *store;
+
+	if (vm["storage"].as<string>() == "file") {
+		if (ring != nullptr) {
+			cout << "io_uring is only used by the segment storage engine" << endl;
+		}
+
+		store = new file_block_store(owner_keys);
+	} else if (vm["storage"].as<string>() == "segment") {
+		segment_block_store *segments = new segment_block_store(owner_keys);
+		segments->set_ring(ring);
+
+		store = segments;
+	} else {
+		cout << "Unknown storage engine " << vm["storage"].as<string>() << endl;
+		return 1;
+	}
+
+	store->set_mapped_reads(vm.count("mmap") > 0);
+	store->set_deflate(vm.count("compress") > 0);
+	store->set_verify_cache(&verified_signatures);
+
 	boost::asio::io_service io_service;
 
 	local_peer my_peer(io_service, vm["peer-host"].as<string>(), vm["peer-port"].as<int>());
@@ -61,6 +132,15 @@ int main(int argc, char *argv[]) {
 	api_server api_server(my_peer, io_service, vm["api-password"].as<string>());
 
 	my_peer.set_api_server(&api_server);
+	my_peer.set_block_store(store);
+	my_peer.set_deflate(vm.count("compress") > 0);
+	my_peer.set_merkle(vm.count("merkle") > 0);
+	my_peer.set_verify_cache(&verified_signatures);
+
+	if (my_peer.load_blocks() != 0) {
+		cout << "Could not load block manifest" << endl;
+		return 1;
+	}
 
 	peer_server.set_port(vm["peer-port"].as<int>());
 	api_server.set_port(vm["api-port"].as<int>());
@@ -69,9 +149,16 @@ int main(int argc, char *argv[]) {
 		my_peer.set_integrated(true);
 	}
 
+	int key_type = signature_type(vm["key-type"].as<string>());
+
+	if (key_type == -1) {
+		cout << "Unknown key type " << vm["key-type"].as<string>() << endl;
+		return 1;
+	}
+
 	if (my_peer.load_key() != 0 || vm.count("new-identity")) {
-		cout << "Generate peer key" << endl;
-		my_peer.generate_key();
+		cout << "Generate " << signature_name(key_type) << " peer key" << endl;
+		my_peer.generate_key(key_type);
 		my_peer.save_key();
 	} else {
 		cout << "Loaded peer key" << endl;
@@ -79,6 +166,32 @@ int main(int argc, char *argv[]) {
 
 	my_peer.set_capacity(vm["capacity"].as<int>());
 
+	UINT64 cache_size;
+
+	if (!parse_size(vm["cache-size"].as<string>(), cache_size)) {
+		cout << "Invalid cache size " << vm["cache-size"].as<string>() << endl;
+		return 1;
+	}
+
+	my_peer.set_cache_size(cache_size);
+
+	if (vm["disk-threads"].as<int>() < 1) {
+		cout << "Need at least one disk thread" << endl;
+		return 1;
+	}
+
+	worker_pool disk_pool(vm["disk-threads"].as<int>());
+	my_peer.set_disk_pool(&disk_pool);
+
+	int crypto_threads = vm["crypto-threads"].as<int>();
+
+	if (crypto_threads < 1) {
+		crypto_threads = max(1u, thread::hardware_concurrency());
+	}
+
+	worker_pool crypto_pool(crypto_threads, DDSN_CRYPTO_QUEUE_SIZE);
+	my_peer.set_crypto_pool(&crypto_pool);
+
 	cout << "Your id is " << my_peer.id().short_string() << endl;
 
 	srand((UINT32)time(nullptr));
@@ -88,5 +201,10 @@ int main(int argc, char *argv[]) {
 
 	io_service.run();
 
+	crypto_pool.stop();
+	disk_pool.stop();
+	delete store;
+	delete ring;
+
 	return 0;
 }
\ No newline at end of file
@@ -15,8 +15,27 @@ typedef unsigned long long UINT64;
 #define DDSN_MESSAGE_TYPE_BYTES  2
 #define DDSN_MESSAGE_TYPE_CLOSE  3
 #define DDSN_MESSAGE_TYPE_ERROR	 4
+// the message continues later on its own by calling resume on its connection
+#define DDSN_MESSAGE_TYPE_WAIT   5
+// the connection waits for the header and fields of a binary frame (see frame.h)
+#define DDSN_MESSAGE_TYPE_FRAME  6
 
 #define DDSN_MESSAGE_CHUNK_MAX_SIZE    8 * 1024 * 1024
 #define DDSN_MESSAGE_STRING_MAX_LENGTH 1024
 
+#define DDSN_SEGMENT_MAX_SIZE 256 * 1024 * 1024
+
+// waits for owner keys per connection (see GET KEY), most of them received blocks
+// holding their data, and seconds until a key that didn't come is given up
+#define DDSN_KEY_WAITS_MAX    64
+#define DDSN_KEY_WAIT_TIMEOUT 30
+
+// signature checks waiting for a crypto thread, more wait in local_peer's crypto backlog
+#define DDSN_CRYPTO_QUEUE_SIZE 256
+
+#define DDSN_DEFLATE_LEVEL       3
+#define DDSN_DEFLATE_MIN_SIZE    512
+#define DDSN_DEFLATE_SAMPLE_SIZE 64 * 1024
+#define DDSN_DEFLATE_MIN_SAVING  10
+
 #endif
\ No newline at end of file
@@ -1,11 +1,9 @@
 #include "foreign_peer.h"
 
-#include <openssl/pem.h>
-
 using namespace ddsn;
 using namespace std;
 
-foreign_peer::foreign_peer() : public_key_(nullptr), in_layer_(-1), out_layer_(-1), host_(""), port_(-1), integrated_(false), identity_verified_(false), queued_(false) {
+foreign_peer::foreign_peer() : in_layer_(-1), out_layer_(-1), host_(""), port_(-1), integrated_(false), identity_verified_(false), queued_(false) {
 
 }
 
@@ -31,7 +29,7 @@ const std::string &foreign_peer::public_key_str() const {
 	return public_key_str_;
 }
 
-RSA *foreign_peer::public_key() const {
+const public_key_pointer &foreign_peer::public_key() const {
 	return public_key_;
 }
 
@@ -84,11 +82,7 @@ void foreign_peer::set_port(int port) {
 void foreign_peer::set_public_key_str(const std::string &public_key) {
 	public_key_str_ = public_key;
 
-	BIO *pub = BIO_new(BIO_s_mem());
-
-	BIO_write(pub, public_key_str_.c_str(), public_key_str_.length());
-
-	PEM_read_bio_RSAPublicKey(pub, &public_key_, NULL, NULL);
+	public_key_ = key_registry::from_pem(public_key_str_);
 }
 
 void foreign_peer::set_integrated(bool integrated) {
@@ -2,10 +2,10 @@
 #define DDSN_FOREIGN_H
 
 #include "code.h"
+#include "keys.h"
 #include "peer_connection.h"
 #include "peer_id.h"
 
-#include <openssl/rsa.h>
 #include <memory>
 #include <string>
 
@@ -22,7 +22,7 @@ public:
 	const std::string &host() const;
 	INT32 port() const;
 	const std::string &public_key_str() const;
-	RSA *public_key() const;
+	const public_key_pointer &public_key() const;
 
 	bool integrated() const;
 	bool identity_verified() const;
@@ -55,7 +55,7 @@ private:
 	std::string host_;
 	INT32 port_;
 	std::string public_key_str_;
-	RSA *public_key_;
+	public_key_pointer public_key_;
 
 	bool integrated_;
 	bool identity_verified_;
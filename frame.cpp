@@ -0,0 +1,189 @@
+#include "frame.h"
+
+#include <cstring>
+
+using namespace ddsn;
+using namespace std;
+
+// frame_writer
+
+frame_writer::frame_writer(UINT32 type) : type_(type) {
+	fields_.reserve(128);
+}
+
+void frame_writer::add(UINT32 field, const void *value, size_t size) {
+	put_varint(field);
+	put_varint(size);
+
+	fields_.insert(fields_.end(), (const BYTE *)value, (const BYTE *)value + size);
+}
+
+void frame_writer::add(UINT32 field, const string &value) {
+	add(field, value.data(), value.length());
+}
+
+void frame_writer::add_number(UINT32 field, UINT64 number) {
+	BYTE value[10];
+
+	add(field, value, varint(number, value));
+}
+
+void frame_writer::add_code(UINT32 field, const code &code) {
+	BYTE value[10 + 32];
+	size_t size = varint(code.layers(), value);
+
+	size_t bytes = code.layers() == 0 ? 0 : (code.layers() - 1) / 8 + 1;
+
+	if (bytes > 32) {
+		// only block codes go into frames
+		bytes = 32;
+	}
+
+	memcpy(value + size, code.bytes(), bytes);
+
+	add(field, value, size + bytes);
+}
+
+shared_buffer frame_writer::finish(size_t body_size) const {
+	if (fields_.size() > 0xffff) {
+		// the header has 16 bits for the size of the fields
+		return shared_buffer();
+	}
+
+	shared_buffer frame(DDSN_FRAME_HEADER_SIZE + fields_.size());
+	BYTE *p = frame.mutable_data();
+
+	p[0] = DDSN_FRAME_MARK | type_;
+	p[1] = 0;
+	p[2] = fields_.size() & 0xff;
+	p[3] = (fields_.size() >> 8) & 0xff;
+
+	for (int i = 0; i < 4; i++) {
+		p[4 + i] = (body_size >> (8 * i)) & 0xff;
+	}
+
+	if (!fields_.empty()) {
+		memcpy(p + DDSN_FRAME_HEADER_SIZE, fields_.data(), fields_.size());
+	}
+
+	return frame;
+}
+
+size_t frame_writer::varint(UINT64 number, BYTE *p) {
+	size_t size = 0;
+
+	do {
+		p[size++] = (number & 0x7f) | (number >= 0x80 ? 0x80 : 0);
+		number >>= 7;
+	} while (number != 0);
+
+	return size;
+}
+
+void frame_writer::put_varint(UINT64 number) {
+	BYTE bytes[10];
+
+	fields_.insert(fields_.end(), bytes, bytes + varint(number, bytes));
+}
+
+// frame_reader
+
+bool frame_reader::is_frame(BYTE first) {
+	return (first & DDSN_FRAME_MARK) != 0;
+}
+
+bool frame_reader::header(const BYTE header[DDSN_FRAME_HEADER_SIZE], UINT32 &type, size_t &fields_size, size_t &body_size) {
+	if (!is_frame(header[0]) || header[1] != 0) {
+		return false;
+	}
+
+	type = header[0] & ~DDSN_FRAME_MARK;
+	fields_size = header[2] | (header[3] << 8);
+	body_size = 0;
+
+	for (int i = 0; i < 4; i++) {
+		body_size |= (size_t)header[4 + i] << (8 * i);
+	}
+
+	return true;
+}
+
+bool frame_reader::number(const BYTE *value, size_t size, UINT64 &number) {
+	const BYTE *end = value + size;
+
+	return get_varint(value, end, number) && value == end;
+}
+
+bool frame_reader::code(const BYTE *value, size_t size, ddsn::code &code) {
+	const BYTE *end = value + size;
+	UINT64 layers;
+
+	if (!get_varint(value, end, layers) || layers == 0 || layers > 256) {
+		return false;
+	}
+
+	if ((size_t)(end - value) != (layers - 1) / 8 + 1) {
+		return false;
+	}
+
+	code = ddsn::code(layers, value);
+
+	return true;
+}
+
+frame_reader::frame_reader(UINT32 type, const BYTE *fields, size_t fields_size, size_t body_size) :
+type_(type), p_(fields), end_(fields + fields_size), body_size_(body_size), valid_(true) {
+
+}
+
+UINT32 frame_reader::type() const {
+	return type_;
+}
+
+size_t frame_reader::body_size() const {
+	return body_size_;
+}
+
+bool frame_reader::next(UINT32 &field, const BYTE *&value, size_t &size) {
+	if (p_ == end_ || !valid_) {
+		return false;
+	}
+
+	UINT64 id, length;
+
+	if (!get_varint(p_, end_, id) || !get_varint(p_, end_, length) || length > (UINT64)(end_ - p_)) {
+		valid_ = false;
+		return false;
+	}
+
+	field = id;
+	value = p_;
+	size = length;
+
+	p_ += length;
+
+	return true;
+}
+
+bool frame_reader::valid() const {
+	return valid_;
+}
+
+bool frame_reader::get_varint(const BYTE *&p, const BYTE *end, UINT64 &number) {
+	number = 0;
+
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (p == end) {
+			return false;
+		}
+
+		BYTE b = *p++;
+		number |= (UINT64)(b & 0x7f) << shift;
+
+		if ((b & 0x80) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,100 @@
+#ifndef DDSN_FRAME_H
+#define DDSN_FRAME_H
+
+#include "buffer.h"
+#include "code.h"
+#include "definitions.h"
+
+#include <string>
+#include <vector>
+
+// set in the first byte of a frame, text messages start with a letter
+#define DDSN_FRAME_MARK        0x80
+#define DDSN_FRAME_HEADER_SIZE 8
+
+// frame types
+#define DDSN_FRAME_STORE_BLOCK   1
+#define DDSN_FRAME_LOAD_BLOCK    2
+#define DDSN_FRAME_STORED_BLOCK  3
+#define DDSN_FRAME_DELIVER_BLOCK 4
+
+// fields, numbers are varints
+#define DDSN_FIELD_CODE           1  // varint layers, code bytes
+#define DDSN_FIELD_NAME           2
+#define DDSN_FIELD_OCCURRENCE     3
+#define DDSN_FIELD_SIZE           4
+#define DDSN_FIELD_SIGNATURE_TYPE 5  // DDSN_SIGNATURE_*
+#define DDSN_FIELD_SIGNATURE      6
+#define DDSN_FIELD_OWNER          7  // owner hash (see GET KEY)
+#define DDSN_FIELD_OWNER_KEY      8  // owner key, DER
+#define DDSN_FIELD_ENCODED_SIZE   9  // deflated body
+#define DDSN_FIELD_LEAF_HASHES    10 // Merkle blocks
+#define DDSN_FIELD_SUCCESS        11
+
+namespace ddsn {
+
+/*
+ * Binary framing of the block messages (see "Framing: binary" in HELLO),
+ * the other messages stay text. A frame starts with a fixed header:
+ *
+ *  0  mark | frame type    1
+ *  1  reserved             1
+ *  2  fields size          2
+ *  4  body size            4
+ *
+ * followed by the fields, each a varint id, a varint size and the value,
+ * then the body (block data). Integers in the header are little endian.
+ * Unknown fields are skipped.
+ */
+class frame_writer {
+public:
+	frame_writer(UINT32 type);
+
+	void add(UINT32 field, const void *value, size_t size);
+	void add(UINT32 field, const std::string &value);
+	void add_number(UINT32 field, UINT64 number);
+	void add_code(UINT32 field, const code &code);
+
+	// header and fields of a frame with body_size bytes of body, empty if the
+	// fields do not fit in the 16 bit size
+	shared_buffer finish(size_t body_size) const;
+private:
+	// writes up to 10 bytes, returns how many
+	static size_t varint(UINT64 number, BYTE *p);
+	void put_varint(UINT64 number);
+
+	UINT32 type_;
+	std::vector<BYTE> fields_;
+};
+
+class frame_reader {
+public:
+	static bool is_frame(BYTE first);
+	// false if the header is malformed
+	static bool header(const BYTE header[DDSN_FRAME_HEADER_SIZE], UINT32 &type, size_t &fields_size, size_t &body_size);
+
+	static bool number(const BYTE *value, size_t size, UINT64 &number);
+	static bool code(const BYTE *value, size_t size, ddsn::code &code);
+
+	// reads the fields in place, they have to stay around meanwhile
+	frame_reader(UINT32 type, const BYTE *fields, size_t fields_size, size_t body_size);
+
+	UINT32 type() const;
+	size_t body_size() const;
+
+	// the next field, false after the last one or a malformed one (see valid)
+	bool next(UINT32 &field, const BYTE *&value, size_t &size);
+	bool valid() const;
+private:
+	static bool get_varint(const BYTE *&p, const BYTE *end, UINT64 &number);
+
+	UINT32 type_;
+	const BYTE *p_;
+	const BYTE *end_;
+	size_t body_size_;
+	bool valid_;
+};
+
+}
+
+#endif
@@ -0,0 +1,392 @@
+#include "io_ring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+using namespace ddsn;
+using namespace std;
+
+io_ring *io_ring::create(unsigned entries) {
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	int fd = syscall(__NR_io_uring_setup, entries, &params);
+
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	io_ring *ring = new io_ring(fd);
+
+	if (ring->map(params) != 0) {
+		delete ring;
+		return nullptr;
+	}
+
+	ring->register_buffers();
+
+	return ring;
+}
+
+io_ring::io_ring(int fd) :
+fd_(fd), sq_ring_(MAP_FAILED), sq_ring_size_(0), cq_ring_(MAP_FAILED), cq_ring_size_(0), sqes_((io_uring_sqe *)MAP_FAILED), sqes_size_(0),
+entries_(0), in_flight_(0), unsubmitted_(0), submitting_(false), broken_(false), buffers_(nullptr) {
+
+}
+
+io_ring::~io_ring() {
+	if (buffers_ != nullptr) {
+		munmap(buffers_, DDSN_RING_BUFFERS * DDSN_RING_BUFFER_SIZE);
+	}
+
+	if (sqes_ != MAP_FAILED) {
+		munmap(sqes_, sqes_size_);
+	}
+
+	if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+		munmap(cq_ring_, cq_ring_size_);
+	}
+
+	if (sq_ring_ != MAP_FAILED) {
+		munmap(sq_ring_, sq_ring_size_);
+	}
+
+	close(fd_);
+}
+
+int io_ring::map(const io_uring_params &params) {
+	sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+	if (single_mmap) {
+		sq_ring_size_ = cq_ring_size_ = max(sq_ring_size_, cq_ring_size_);
+	}
+
+	sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+
+	if (sq_ring_ == MAP_FAILED) {
+		return 1;
+	}
+
+	if (single_mmap) {
+		cq_ring_ = sq_ring_;
+	} else {
+		cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+
+		if (cq_ring_ == MAP_FAILED) {
+			return 1;
+		}
+	}
+
+	sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+	sqes_ = (io_uring_sqe *)mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+
+	if (sqes_ == MAP_FAILED) {
+		return 1;
+	}
+
+	BYTE *sq = (BYTE *)sq_ring_;
+	BYTE *cq = (BYTE *)cq_ring_;
+
+	sq_tail_ = (unsigned *)(sq + params.sq_off.tail);
+	sq_mask_ = (unsigned *)(sq + params.sq_off.ring_mask);
+	sq_array_ = (unsigned *)(sq + params.sq_off.array);
+	cq_head_ = (unsigned *)(cq + params.cq_off.head);
+	cq_tail_ = (unsigned *)(cq + params.cq_off.tail);
+	cq_mask_ = (unsigned *)(cq + params.cq_off.ring_mask);
+	cqes_ = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	// the completion queue is at least as large, so it can't overflow
+	entries_ = params.sq_entries;
+
+	return 0;
+}
+
+void io_ring::register_buffers() {
+	void *buffers = mmap(nullptr, DDSN_RING_BUFFERS * DDSN_RING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (buffers == MAP_FAILED) {
+		return;
+	}
+
+	struct iovec iov[DDSN_RING_BUFFERS];
+
+	for (int i = 0; i < DDSN_RING_BUFFERS; i++) {
+		iov[i].iov_base = (BYTE *)buffers + i * DDSN_RING_BUFFER_SIZE;
+		iov[i].iov_len = DDSN_RING_BUFFER_SIZE;
+	}
+
+	if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, iov, DDSN_RING_BUFFERS) != 0) {
+		// most likely RLIMIT_MEMLOCK, everything still works without them
+		cout << "Could not register io_uring buffers: " << strerror(errno) << endl;
+		munmap(buffers, DDSN_RING_BUFFERS * DDSN_RING_BUFFER_SIZE);
+		return;
+	}
+
+	buffers_ = (BYTE *)buffers;
+
+	for (int i = 0; i < DDSN_RING_BUFFERS; i++) {
+		free_buffers_.push_back(i);
+	}
+}
+
+int io_ring::acquire_buffer(size_t size) {
+	if (size > DDSN_RING_BUFFER_SIZE) {
+		return -1;
+	}
+
+	lock_guard<mutex> lock(mutex_);
+
+	if (free_buffers_.empty()) {
+		return -1;
+	}
+
+	int buffer = free_buffers_.back();
+	free_buffers_.pop_back();
+
+	return buffer;
+}
+
+void io_ring::release_buffer(int buffer) {
+	lock_guard<mutex> lock(mutex_);
+	free_buffers_.push_back(buffer);
+}
+
+BYTE *io_ring::buffer_data(int buffer) const {
+	return buffers_ + buffer * DDSN_RING_BUFFER_SIZE;
+}
+
+ssize_t io_ring::read(int fd, void *data, size_t size, UINT64 offset) {
+	size_t done = 0;
+
+	while (done < size) {
+		io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+
+		sqe.fd = fd;
+		sqe.off = offset + done;
+
+		struct iovec iov;
+		int buffer = acquire_buffer(size - done);
+
+		if (buffer >= 0) {
+			sqe.opcode = IORING_OP_READ_FIXED;
+			sqe.addr = (UINT64)buffer_data(buffer);
+			sqe.len = size - done;
+			sqe.buf_index = buffer;
+		} else {
+			iov.iov_base = (BYTE *)data + done;
+			iov.iov_len = size - done;
+
+			sqe.opcode = IORING_OP_READV;
+			sqe.addr = (UINT64)&iov;
+			sqe.len = 1;
+		}
+
+		ssize_t ret = submit(sqe);
+
+		if (buffer >= 0) {
+			if (ret > 0) {
+				memcpy((BYTE *)data + done, buffer_data(buffer), ret);
+			}
+			release_buffer(buffer);
+		}
+
+		if (ret < 0) {
+			return ret;
+		}
+
+		if (ret == 0) {
+			// end of file
+			break;
+		}
+
+		done += ret;
+	}
+
+	return done;
+}
+
+ssize_t io_ring::writev(int fd, const struct iovec *iov, int count, UINT64 offset) {
+	vector<struct iovec> rest(iov, iov + count);
+	size_t size = 0;
+
+	for (int i = 0; i < count; i++) {
+		size += iov[i].iov_len;
+	}
+
+	size_t done = 0;
+
+	while (done < size) {
+		io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+
+		sqe.fd = fd;
+		sqe.off = offset + done;
+
+		int buffer = acquire_buffer(size - done);
+
+		if (buffer >= 0) {
+			// gather into the registered buffer
+			BYTE *p = buffer_data(buffer);
+
+			for (auto it = rest.begin(); it != rest.end(); ++it) {
+				memcpy(p, it->iov_base, it->iov_len);
+				p += it->iov_len;
+			}
+
+			sqe.opcode = IORING_OP_WRITE_FIXED;
+			sqe.addr = (UINT64)buffer_data(buffer);
+			sqe.len = size - done;
+			sqe.buf_index = buffer;
+		} else {
+			sqe.opcode = IORING_OP_WRITEV;
+			sqe.addr = (UINT64)rest.data();
+			sqe.len = rest.size();
+		}
+
+		ssize_t ret = submit(sqe);
+
+		if (buffer >= 0) {
+			release_buffer(buffer);
+		}
+
+		if (ret < 0) {
+			return ret;
+		}
+
+		if (ret == 0) {
+			return -EIO;
+		}
+
+		done += ret;
+
+		// skip what was written
+		size_t skip = ret;
+
+		while (!rest.empty() && skip >= rest.front().iov_len) {
+			skip -= rest.front().iov_len;
+			rest.erase(rest.begin());
+		}
+
+		if (skip > 0) {
+			rest.front().iov_base = (BYTE *)rest.front().iov_base + skip;
+			rest.front().iov_len -= skip;
+		}
+	}
+
+	return done;
+}
+
+ssize_t io_ring::submit(io_uring_sqe &sqe) {
+	request req;
+	req.result = 0;
+	req.done = false;
+
+	unique_lock<mutex> lock(mutex_);
+
+	while (in_flight_ >= entries_ && !broken_) {
+		cond_.wait(lock);
+	}
+
+	if (broken_) {
+		return -EIO;
+	}
+
+	// queue the entry, the tail is only ever written under the lock
+	unsigned tail = *sq_tail_;
+	unsigned index = tail & *sq_mask_;
+
+	sqe.user_data = (UINT64)&req;
+	sqes_[index] = sqe;
+	sq_array_[index] = index;
+
+	__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+	in_flight_++;
+	unsubmitted_++;
+
+	while (!req.done) {
+		if (broken_) {
+			// our entry never made it to the kernel (the others were drained)
+			return -EIO;
+		}
+
+		if (submitting_) {
+			// someone else submits our entry with theirs
+			cond_.wait(lock);
+			continue;
+		}
+
+		submitting_ = true;
+
+		unsigned to_submit = unsubmitted_;
+		unsubmitted_ = 0;
+
+		lock.unlock();
+		int ret = syscall(__NR_io_uring_enter, fd_, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		int error = errno;
+		lock.lock();
+
+		if (ret < 0) {
+			unsubmitted_ += to_submit;
+
+			if (error != EINTR && error != EAGAIN && error != EBUSY) {
+				cout << "io_uring_enter failed: " << strerror(error) << endl;
+
+				// the kernel still completes into requests and buffers of waiting
+				// threads, they may only return once it's done with them
+				drain(lock);
+				broken_ = true;
+			}
+		} else if ((unsigned)ret < to_submit) {
+			unsubmitted_ += to_submit - ret;
+		}
+
+		reap();
+
+		submitting_ = false;
+		cond_.notify_all();
+	}
+
+	return req.result;
+}
+
+void io_ring::drain(unique_lock<mutex> &lock) {
+	while (in_flight_ > unsubmitted_) {
+		lock.unlock();
+
+		if (syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+			// can't wait in the kernel, poll the completion queue
+			usleep(1000);
+		}
+
+		lock.lock();
+
+		reap();
+	}
+}
+
+void io_ring::reap() {
+	unsigned head = *cq_head_;
+	unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+
+		request *req = (request *)cqe.user_data;
+		req->result = cqe.res;
+		req->done = true;
+
+		head++;
+		in_flight_--;
+	}
+
+	__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
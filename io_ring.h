@@ -0,0 +1,89 @@
+#ifndef DDSN_IO_RING_H
+#define DDSN_IO_RING_H
+
+#include "definitions.h"
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#define DDSN_RING_ENTRIES     256
+#define DDSN_RING_BUFFERS     64
+#define DDSN_RING_BUFFER_SIZE 64 * 1024
+
+namespace ddsn {
+
+/*
+ * File reads and writes through io_uring, without liburing.
+ * Calls block the calling thread, but the requests of all threads waiting
+ * at the same time are submitted and reaped with a single io_uring_enter:
+ * whoever finds no submission in progress submits everything queued so far.
+ * Requests that fit are copied through registered buffers.
+ * All methods return the number of bytes transferred or -errno.
+ */
+class io_ring {
+public:
+	// nullptr if io_uring isn't available (old kernel, seccomp, ...)
+	static io_ring *create(unsigned entries = DDSN_RING_ENTRIES);
+
+	~io_ring();
+
+	ssize_t read(int fd, void *data, size_t size, UINT64 offset);
+	ssize_t writev(int fd, const struct iovec *iov, int count, UINT64 offset);
+private:
+	struct request {
+		ssize_t result;
+		bool done;
+	};
+
+	io_ring(int fd);
+
+	int map(const io_uring_params &params);
+	void register_buffers();
+
+	int acquire_buffer(size_t size);
+	void release_buffer(int buffer);
+	BYTE *buffer_data(int buffer) const;
+
+	// queue the entry and wait for its completion
+	ssize_t submit(io_uring_sqe &sqe);
+	void reap();
+	// wait for all entries the kernel took, called with the lock held
+	// before the ring is given up on
+	void drain(std::unique_lock<std::mutex> &lock);
+
+	int fd_;
+
+	void *sq_ring_;
+	size_t sq_ring_size_;
+	void *cq_ring_;
+	size_t cq_ring_size_;
+	io_uring_sqe *sqes_;
+	size_t sqes_size_;
+
+	unsigned *sq_tail_;
+	unsigned *sq_mask_;
+	unsigned *sq_array_;
+	unsigned *cq_head_;
+	unsigned *cq_tail_;
+	unsigned *cq_mask_;
+	io_uring_cqe *cqes_;
+
+	unsigned entries_;
+	unsigned in_flight_;
+	unsigned unsubmitted_;
+	bool submitting_;
+	bool broken_;
+
+	BYTE *buffers_;
+	std::vector<int> free_buffers_;
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+};
+
+}
+
+#endif
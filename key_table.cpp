@@ -0,0 +1,141 @@
+#include "key_table.h"
+
+#include <boost/filesystem.hpp>
+#include <cstring>
+#include <iostream>
+
+using namespace ddsn;
+using namespace std;
+
+key_table::key_table(const string &directory) : directory_(directory) {
+
+}
+
+key_table::~key_table() {
+
+}
+
+int key_table::open() {
+	string path = directory_ + "owners";
+
+	ifstream file(path, ios::in | ios::binary | ios::ate);
+
+	UINT64 valid_size = 0;
+
+	if (file.is_open()) {
+		size_t size = (size_t)file.tellg();
+		string contents(size, '\0');
+
+		file.seekg(0, ios::beg);
+		file.read(&contents[0], size);
+		file.close();
+
+		// entries: hash (32 bytes), DER length (4 bytes), DER
+		const BYTE *p = (const BYTE *)contents.data();
+		const BYTE *end = p + size;
+
+		while (p + 36 <= end) {
+			UINT32 der_len;
+			memcpy(&der_len, p + 32, 4);
+
+			if (p + 36 + der_len > end) {
+				break;
+			}
+
+			keys_[peer_id(p)].assign((const CHAR *)p + 36, der_len);
+
+			p += 36 + der_len;
+		}
+
+		valid_size = p - (const BYTE *)contents.data();
+
+		cout << "Loaded " << keys_.size() << " owner keys" << endl;
+	}
+
+	if (boost::filesystem::exists(path) && boost::filesystem::file_size(path) != valid_size) {
+		// cut off a torn entry
+		boost::filesystem::resize_file(path, valid_size);
+	}
+
+	file_.open(path, ios::out | ios::binary | ios::app);
+
+	return file_.is_open() ? 0 : 1;
+}
+
+int key_table::add(const public_key_pointer &key) {
+	peer_id id(key->hash());
+
+	lock_guard<mutex> lock(mutex_);
+
+	if (keys_.find(id) != keys_.end()) {
+		return 0;
+	}
+
+	const string &der = key->der();
+
+	if (der.empty()) {
+		return 1;
+	}
+
+	UINT32 len = der.length();
+	streamoff size = file_.tellp();
+
+	if (size < 0) {
+		return 1;
+	}
+
+	file_.write((const CHAR *)key->hash(), 32);
+	file_.write((const CHAR *)&len, 4);
+	file_.write(der.data(), len);
+	file_.flush();
+
+	if (!file_.good()) {
+		// cut off what made it to the file, a torn entry hides the ones after it
+		string path = directory_ + "owners";
+		boost::system::error_code error;
+
+		file_.close();
+		boost::filesystem::resize_file(path, size, error);
+
+		file_.clear();
+		file_.open(path, ios::out | ios::binary | ios::app);
+
+		return 1;
+	}
+
+	// only known once it's on disk, otherwise blocks of the owner are saved without it
+	keys_[id] = der;
+
+	return 0;
+}
+
+public_key_pointer key_table::get(const BYTE hash[32]) {
+	public_key_pointer key = key_registry::get(hash);
+
+	if (key != nullptr) {
+		return key;
+	}
+
+	string der;
+
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		auto it = keys_.find(peer_id(hash));
+
+		if (it == keys_.end()) {
+			return nullptr;
+		}
+
+		der = it->second;
+	}
+
+	key = key_registry::from_der(der);
+
+	if (key == nullptr || memcmp(key->hash(), hash, 32) != 0) {
+		// a damaged entry
+		return nullptr;
+	}
+
+	return key;
+}
@@ -0,0 +1,45 @@
+#ifndef DDSN_KEY_TABLE_H
+#define DDSN_KEY_TABLE_H
+
+#include "definitions.h"
+#include "keys.h"
+#include "peer_id.h"
+
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace ddsn {
+
+/*
+ * Deduplicated table of block owner public keys, keyed by owner hash.
+ * Block records only reference their owner by hash. The keys are kept
+ * DER encoded in blocks/owners and registered with the key_registry
+ * when a block of the owner is loaded.
+ */
+class key_table {
+public:
+	key_table(const std::string &directory = "blocks/");
+	~key_table();
+
+	int open();
+
+	// store the key if it isn't known yet
+	int add(const public_key_pointer &key);
+
+	// registered key for the owner hash or nullptr if unknown
+	public_key_pointer get(const BYTE hash[32]);
+private:
+	std::string directory_;
+	// DER encoded keys
+	std::unordered_map<peer_id, std::string> keys_;
+	std::ofstream file_;
+
+	// add and get are called from the disk threads
+	std::mutex mutex_;
+};
+
+}
+
+#endif
@@ -0,0 +1,491 @@
+#include "keys.h"
+
+#include "sha256.h"
+
+#include <openssl/err.h>
+#include <openssl/objects.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <cstring>
+
+using namespace ddsn;
+using namespace std;
+
+EVP_PKEY *ddsn::generate_key(int signature_type) {
+	EVP_PKEY *key = nullptr;
+
+	if (signature_type == DDSN_SIGNATURE_RSA) {
+		key = EVP_PKEY_new();
+		EVP_PKEY_assign_RSA(key, RSA_generate_key(2048, 3, NULL, NULL));
+	} else if (signature_type == DDSN_SIGNATURE_ED25519) {
+		EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, nullptr);
+
+		if (EVP_PKEY_keygen_init(ctx) != 1 || EVP_PKEY_keygen(ctx, &key) != 1) {
+			key = nullptr;
+		}
+
+		EVP_PKEY_CTX_free(ctx);
+	}
+
+	return key;
+}
+
+int ddsn::key_signature_type(EVP_PKEY *key) {
+	if (key == nullptr) {
+		return -1;
+	}
+
+	switch (EVP_PKEY_get_base_id(key)) {
+	case EVP_PKEY_RSA:
+		return EVP_PKEY_get_bits(key) == 2048 ? DDSN_SIGNATURE_RSA : -1;
+	case EVP_PKEY_ED25519:
+		return DDSN_SIGNATURE_ED25519;
+	default:
+		return -1;
+	}
+}
+
+size_t ddsn::signature_size(int signature_type) {
+	switch (signature_type) {
+	case DDSN_SIGNATURE_RSA:
+		return 256;
+	case DDSN_SIGNATURE_ED25519:
+		return 64;
+	default:
+		return 0;
+	}
+}
+
+string ddsn::signature_name(int signature_type) {
+	switch (signature_type) {
+	case DDSN_SIGNATURE_RSA:
+		return "rsa";
+	case DDSN_SIGNATURE_ED25519:
+		return "ed25519";
+	default:
+		return "";
+	}
+}
+
+int ddsn::signature_type(const string &name) {
+	if (name == "rsa") {
+		return DDSN_SIGNATURE_RSA;
+	} else if (name == "ed25519") {
+		return DDSN_SIGNATURE_ED25519;
+	}
+
+	return -1;
+}
+
+bool ddsn::sign_hash(EVP_PKEY *key, const BYTE hash[32], BYTE signature[DDSN_SIGNATURE_MAX_SIZE]) {
+	int type = key_signature_type(key);
+
+	if (type == DDSN_SIGNATURE_RSA) {
+		// PKCS #1 v1.5 over the SHA-256 hash, the hash is already computed
+		EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, nullptr);
+		size_t siglen = DDSN_SIGNATURE_MAX_SIZE;
+
+		bool success = ctx != nullptr &&
+			EVP_PKEY_sign_init(ctx) == 1 &&
+			EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) == 1 &&
+			EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) == 1 &&
+			EVP_PKEY_sign(ctx, signature, &siglen, hash, 32) == 1;
+
+		EVP_PKEY_CTX_free(ctx);
+
+		return success;
+	} else if (type == DDSN_SIGNATURE_ED25519) {
+		// Ed25519 hashes internally, it signs the 32 byte hash as its message
+		EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+		size_t siglen = 64;
+
+		bool success = EVP_DigestSignInit(ctx, nullptr, nullptr, nullptr, key) == 1 &&
+			EVP_DigestSign(ctx, signature, &siglen, hash, 32) == 1;
+
+		EVP_MD_CTX_free(ctx);
+
+		return success;
+	}
+
+	return false;
+}
+
+bool ddsn::verify_hash(EVP_PKEY *key, const BYTE hash[32], const BYTE *signature, size_t size) {
+	int type = key_signature_type(key);
+
+	if (type == -1 || size != signature_size(type)) {
+		return false;
+	}
+
+	if (type == DDSN_SIGNATURE_RSA) {
+		EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, nullptr);
+
+		bool success = ctx != nullptr &&
+			EVP_PKEY_verify_init(ctx) == 1 &&
+			EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) == 1 &&
+			EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) == 1 &&
+			EVP_PKEY_verify(ctx, signature, size, hash, 32) == 1;
+
+		EVP_PKEY_CTX_free(ctx);
+
+		return success;
+	}
+
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+	bool success = EVP_DigestVerifyInit(ctx, nullptr, nullptr, nullptr, key) == 1 &&
+		EVP_DigestVerify(ctx, signature, size, hash, 32) == 1;
+
+	EVP_MD_CTX_free(ctx);
+
+	return success;
+}
+
+EVP_PKEY *ddsn::generate_exchange_key() {
+	EVP_PKEY *key = nullptr;
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr);
+
+	if (EVP_PKEY_keygen_init(ctx) != 1 || EVP_PKEY_keygen(ctx, &key) != 1) {
+		key = nullptr;
+	}
+
+	EVP_PKEY_CTX_free(ctx);
+
+	return key;
+}
+
+bool ddsn::exchange_public_key(EVP_PKEY *key, BYTE public_key[32]) {
+	size_t size = 32;
+
+	return key != nullptr && EVP_PKEY_get_raw_public_key(key, public_key, &size) == 1 && size == 32;
+}
+
+bool ddsn::exchange_secret(EVP_PKEY *key, const BYTE peer_public_key[32], BYTE secret[32]) {
+	EVP_PKEY *peer_key = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr, peer_public_key, 32);
+
+	if (key == nullptr || peer_key == nullptr) {
+		EVP_PKEY_free(peer_key);
+		return false;
+	}
+
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, nullptr);
+	size_t size = 32;
+
+	// fails for low order points, which would give away the secret
+	bool success = EVP_PKEY_derive_init(ctx) == 1 &&
+		EVP_PKEY_derive_set_peer(ctx, peer_key) == 1 &&
+		EVP_PKEY_derive(ctx, secret, &size) == 1 && size == 32;
+
+	EVP_PKEY_CTX_free(ctx);
+	EVP_PKEY_free(peer_key);
+
+	return success;
+}
+
+static string bio_string(BIO *bio) {
+	string contents(BIO_pending(bio), '\0');
+
+	if (!contents.empty()) {
+		BIO_read(bio, &contents[0], contents.length());
+	}
+
+	BIO_free(bio);
+
+	return contents;
+}
+
+string ddsn::public_key_to_pem(EVP_PKEY *key) {
+	BIO *pub = BIO_new(BIO_s_mem());
+
+	if (key_signature_type(key) == DDSN_SIGNATURE_RSA) {
+		PEM_write_bio_RSAPublicKey(pub, EVP_PKEY_get0_RSA(key));
+	} else {
+		PEM_write_bio_PUBKEY(pub, key);
+	}
+
+	return bio_string(pub);
+}
+
+string ddsn::public_key_to_der(EVP_PKEY *key) {
+	bool rsa = key_signature_type(key) == DDSN_SIGNATURE_RSA;
+	int len = rsa ? i2d_RSAPublicKey(EVP_PKEY_get0_RSA(key), nullptr) : i2d_PUBKEY(key, nullptr);
+
+	if (len <= 0) {
+		return "";
+	}
+
+	string der(len, '\0');
+	BYTE *p = (BYTE *)&der[0];
+
+	if (rsa) {
+		i2d_RSAPublicKey(EVP_PKEY_get0_RSA(key), &p);
+	} else {
+		i2d_PUBKEY(key, &p);
+	}
+
+	return der;
+}
+
+string ddsn::private_key_to_pem(EVP_PKEY *key) {
+	BIO *pri = BIO_new(BIO_s_mem());
+
+	if (key_signature_type(key) == DDSN_SIGNATURE_RSA) {
+		// "RSA PRIVATE KEY" like the key files written so far
+		PEM_write_bio_RSAPrivateKey(pri, EVP_PKEY_get0_RSA(key), NULL, NULL, 0, NULL, NULL);
+	} else {
+		PEM_write_bio_PrivateKey(pri, key, NULL, NULL, 0, NULL, NULL);
+	}
+
+	return bio_string(pri);
+}
+
+static EVP_PKEY *rsa_key(RSA *rsa) {
+	if (rsa == nullptr) {
+		return nullptr;
+	}
+
+	EVP_PKEY *key = EVP_PKEY_new();
+	EVP_PKEY_assign_RSA(key, rsa);
+
+	return key;
+}
+
+static EVP_PKEY *checked_key(EVP_PKEY *key) {
+	if (key != nullptr && ddsn::key_signature_type(key) == -1) {
+		EVP_PKEY_free(key);
+		return nullptr;
+	}
+
+	return key;
+}
+
+EVP_PKEY *ddsn::public_key_from_pem(const string &pem) {
+	BIO *pub = BIO_new_mem_buf(pem.data(), pem.length());
+	EVP_PKEY *key;
+
+	if (pem.compare(0, 30, "-----BEGIN RSA PUBLIC KEY-----") == 0) {
+		key = rsa_key(PEM_read_bio_RSAPublicKey(pub, NULL, NULL, NULL));
+	} else {
+		key = PEM_read_bio_PUBKEY(pub, NULL, NULL, NULL);
+	}
+
+	BIO_free(pub);
+
+	return checked_key(key);
+}
+
+EVP_PKEY *ddsn::public_key_from_der(const string &der) {
+	const BYTE *p = (const BYTE *)der.data();
+
+	// a PKCS#1 RSA key isn't a valid SubjectPublicKeyInfo and vice versa
+	EVP_PKEY *key = d2i_PUBKEY(nullptr, &p, der.length());
+
+	if (key == nullptr) {
+		ERR_clear_error();
+
+		p = (const BYTE *)der.data();
+		key = rsa_key(d2i_RSAPublicKey(nullptr, &p, der.length()));
+	}
+
+	return checked_key(key);
+}
+
+EVP_PKEY *ddsn::private_key_from_pem(const string &pem) {
+	BIO *pri = BIO_new_mem_buf(pem.data(), pem.length());
+
+	// reads both "RSA PRIVATE KEY" and PKCS#8 "PRIVATE KEY"
+	EVP_PKEY *key = PEM_read_bio_PrivateKey(pri, NULL, NULL, NULL);
+
+	BIO_free(pri);
+
+	return checked_key(key);
+}
+
+// public_key
+
+public_key::public_key(EVP_PKEY *key) : key_(key), signature_type_(key_signature_type(key)) {
+	der_ = public_key_to_der(key);
+	pem_ = public_key_to_pem(key);
+	sha256::hash(der_.data(), der_.length(), hash_);
+}
+
+public_key::~public_key() {
+	EVP_PKEY_free(key_);
+}
+
+EVP_PKEY *public_key::key() const {
+	return key_;
+}
+
+int public_key::signature_type() const {
+	return signature_type_;
+}
+
+const BYTE *public_key::hash() const {
+	return hash_;
+}
+
+const string &public_key::der() const {
+	return der_;
+}
+
+const string &public_key::pem() const {
+	return pem_;
+}
+
+// key_registry
+
+mutex key_registry::mutex_;
+unordered_map<peer_id, weak_ptr<const public_key>> key_registry::by_hash_;
+unordered_map<string, weak_ptr<const public_key>> key_registry::by_pem_;
+unordered_map<string, weak_ptr<const public_key>> key_registry::by_der_;
+size_t key_registry::sweep_size_ = DDSN_KEY_REGISTRY_SWEEP_SIZE;
+
+public_key_pointer key_registry::get(const BYTE hash[32]) {
+	lock_guard<mutex> lock(mutex_);
+
+	auto it = by_hash_.find(peer_id(hash));
+
+	return it != by_hash_.end() ? it->second.lock() : nullptr;
+}
+
+public_key_pointer key_registry::from_pem(const string &pem) {
+	public_key_pointer parsed = parse_pem(pem);
+
+	if (parsed == nullptr) {
+		return nullptr;
+	}
+
+	lock_guard<mutex> lock(mutex_);
+
+	public_key_pointer registered = add_locked(parsed, false);
+
+	// the same key may come with differently wrapped PEM
+	by_pem_[pem] = registered;
+
+	return registered;
+}
+
+public_key_pointer key_registry::from_der(const string &der) {
+	public_key_pointer parsed = parse_der(der);
+
+	if (parsed == nullptr) {
+		return nullptr;
+	}
+
+	lock_guard<mutex> lock(mutex_);
+
+	return add_locked(parsed, false);
+}
+
+public_key_pointer key_registry::parse_pem(const string &pem) {
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		auto it = by_pem_.find(pem);
+
+		if (it != by_pem_.end()) {
+			public_key_pointer registered = it->second.lock();
+
+			if (registered != nullptr) {
+				return registered;
+			}
+		}
+	}
+
+	// parse outside the lock, another thread may register the key meanwhile
+	EVP_PKEY *key = public_key_from_pem(pem);
+
+	if (key == nullptr) {
+		return nullptr;
+	}
+
+	return make_shared<public_key>(key);
+}
+
+public_key_pointer key_registry::parse_der(const string &der) {
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		auto it = by_der_.find(der);
+
+		if (it != by_der_.end()) {
+			public_key_pointer registered = it->second.lock();
+
+			if (registered != nullptr) {
+				return registered;
+			}
+		}
+	}
+
+	EVP_PKEY *key = public_key_from_der(der);
+
+	if (key == nullptr) {
+		return nullptr;
+	}
+
+	return make_shared<public_key>(key);
+}
+
+public_key_pointer key_registry::add(EVP_PKEY *key, bool replace) {
+	public_key_pointer added = make_shared<public_key>(key);
+
+	lock_guard<mutex> lock(mutex_);
+
+	return add_locked(added, replace);
+}
+
+public_key_pointer key_registry::add(const public_key_pointer &key) {
+	lock_guard<mutex> lock(mutex_);
+
+	return add_locked(key, false);
+}
+
+size_t key_registry::size() {
+	lock_guard<mutex> lock(mutex_);
+	return by_hash_.size();
+}
+
+public_key_pointer key_registry::add_locked(public_key_pointer key, bool replace) {
+	peer_id id(key->hash());
+
+	auto it = by_hash_.find(id);
+
+	if (it != by_hash_.end() && !replace) {
+		public_key_pointer registered = it->second.lock();
+
+		if (registered != nullptr) {
+			return registered;
+		}
+	}
+
+	by_hash_[id] = key;
+	by_pem_[key->pem()] = key;
+	by_der_[key->der()] = key;
+
+	sweep_locked();
+
+	return key;
+}
+
+void key_registry::sweep_locked() {
+	if (by_hash_.size() + by_pem_.size() + by_der_.size() < sweep_size_) {
+		return;
+	}
+
+	for (auto it = by_hash_.begin(); it != by_hash_.end();) {
+		it = it->second.expired() ? by_hash_.erase(it) : ++it;
+	}
+
+	for (auto it = by_pem_.begin(); it != by_pem_.end();) {
+		it = it->second.expired() ? by_pem_.erase(it) : ++it;
+	}
+
+	for (auto it = by_der_.begin(); it != by_der_.end();) {
+		it = it->second.expired() ? by_der_.erase(it) : ++it;
+	}
+
+	// sweeping again only after the table doubled keeps adding O(1) on average
+	sweep_size_ = max((size_t)DDSN_KEY_REGISTRY_SWEEP_SIZE, 2 * (by_hash_.size() + by_pem_.size() + by_der_.size()));
+}
@@ -0,0 +1,139 @@
+#ifndef DDSN_KEYS_H
+#define DDSN_KEYS_H
+
+#include "definitions.h"
+#include "peer_id.h"
+
+#include <openssl/evp.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// signature types, as recorded in block records and named on the wire
+#define DDSN_SIGNATURE_RSA     0
+#define DDSN_SIGNATURE_ED25519 1
+
+#define DDSN_SIGNATURE_MAX_SIZE 256
+
+// the key registry is swept once it has this many entries, at least
+#define DDSN_KEY_REGISTRY_SWEEP_SIZE 256
+
+namespace ddsn {
+
+/*
+ * Peer and block owner keys, RSA-2048 or Ed25519.
+ * Both sign the SHA-256 hash of what they sign (block data and name, the
+ * identity challenge). RSA keys are encoded as before (PKCS#1), so peer ids
+ * and owner hashes of RSA keys don't change; Ed25519 keys are encoded as
+ * SubjectPublicKeyInfo ("PUBLIC KEY" in PEM).
+ */
+
+EVP_PKEY *generate_key(int signature_type);
+
+// DDSN_SIGNATURE_* of the key, -1 if it's neither
+int key_signature_type(EVP_PKEY *key);
+
+// 0 for unknown types
+size_t signature_size(int signature_type);
+std::string signature_name(int signature_type);
+// -1 for unknown names
+int signature_type(const std::string &name);
+
+// writes signature_size(key_signature_type(key)) bytes
+bool sign_hash(EVP_PKEY *key, const BYTE hash[32], BYTE signature[DDSN_SIGNATURE_MAX_SIZE]);
+bool verify_hash(EVP_PKEY *key, const BYTE hash[32], const BYTE *signature, size_t size);
+
+std::string public_key_to_pem(EVP_PKEY *key);
+std::string public_key_to_der(EVP_PKEY *key);
+std::string private_key_to_pem(EVP_PKEY *key);
+
+// X25519 keys for agreeing on a secret with a peer (see session tickets in HELLO)
+EVP_PKEY *generate_exchange_key();
+bool exchange_public_key(EVP_PKEY *key, BYTE public_key[32]);
+bool exchange_secret(EVP_PKEY *key, const BYTE peer_public_key[32], BYTE secret[32]);
+
+// nullptr if the key can't be parsed
+EVP_PKEY *public_key_from_pem(const std::string &pem);
+EVP_PKEY *public_key_from_der(const std::string &der);
+EVP_PKEY *private_key_from_pem(const std::string &pem);
+
+/*
+ * A parsed public key with its DER and PEM encodings and its hash (the
+ * SHA-256 of the DER, i.e. the peer id or owner hash), computed once when
+ * the key is registered.
+ * Handed out by key_registry, shared by blocks, peers and messages.
+ * The local peer's key also holds the private key.
+ */
+class public_key {
+public:
+	// takes ownership of key
+	public_key(EVP_PKEY *key);
+	~public_key();
+
+	EVP_PKEY *key() const;
+	int signature_type() const;
+	const BYTE *hash() const;
+	const std::string &der() const;
+	const std::string &pem() const;
+private:
+	public_key(const public_key &) = delete;
+	public_key &operator=(const public_key &) = delete;
+
+	EVP_PKEY *key_;
+	int signature_type_;
+	BYTE hash_[32];
+	std::string der_;
+	std::string pem_;
+};
+
+typedef std::shared_ptr<const public_key> public_key_pointer;
+
+/*
+ * Process-wide table of the public keys in use, keyed by hash and by the
+ * encodings they arrived in. A key that comes again (every block of an
+ * owner carries its PEM) is found by a lookup instead of being parsed,
+ * encoded and hashed again. The table only holds the keys weakly: a key
+ * is registered as long as a block, peer or message holds it, and gone
+ * entries are swept out as the table grows.
+ * Keys from the wire are only registered once they proved themselves
+ * (a block they signed verified, or they match the hash asked for), so
+ * peers can't fill the table with keys of bogus blocks.
+ * Used from the network, disk and crypto threads.
+ */
+class key_registry {
+public:
+	// the key with this hash, nullptr if it wasn't registered
+	static public_key_pointer get(const BYTE hash[32]);
+
+	// the registered key or a newly parsed and registered one, nullptr if
+	// it can't be parsed (for keys we trust, like the ones on disk)
+	static public_key_pointer from_pem(const std::string &pem);
+	static public_key_pointer from_der(const std::string &der);
+
+	// the registered key or a newly parsed one that isn't registered (see
+	// add), nullptr if it can't be parsed (for keys from the wire)
+	static public_key_pointer parse_pem(const std::string &pem);
+	static public_key_pointer parse_der(const std::string &der);
+
+	// register a key (takes ownership), returns the key registered before
+	// if there's one with the same hash (unless it replaces it, see local peer)
+	static public_key_pointer add(EVP_PKEY *key, bool replace = false);
+	static public_key_pointer add(const public_key_pointer &key);
+
+	static size_t size();
+private:
+	static public_key_pointer add_locked(public_key_pointer key, bool replace);
+	// drop the entries of keys nobody holds any more, once the table doubled
+	static void sweep_locked();
+
+	static std::mutex mutex_;
+	static std::unordered_map<peer_id, std::weak_ptr<const public_key>> by_hash_;
+	static std::unordered_map<std::string, std::weak_ptr<const public_key>> by_pem_;
+	static std::unordered_map<std::string, std::weak_ptr<const public_key>> by_der_;
+	static size_t sweep_size_;
+};
+
+}
+
+#endif
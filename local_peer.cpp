@@ -5,11 +5,11 @@
 #include "peer_messages.h"
 #include "utilities.h"
 
-#include <openssl/pem.h>
 #include <openssl/sha.h>
 #include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 
@@ -17,8 +17,8 @@ using namespace ddsn;
 using namespace std;
 using boost::asio::ip::tcp;
 
-local_peer::local_peer(io_service &io_service, string host, int port) :
-io_service_(io_service), integrated_(false), keypair_(nullptr), host_(host), port_(port) {
+local_peer::local_peer(boost::asio::io_service &io_service, string host, int port) :
+io_service_(io_service), block_store_(nullptr), disk_pool_(nullptr), crypto_pool_(nullptr), deflate_(false), merkle_(false), verify_cache_(nullptr), integrated_(false), host_(host), port_(port) {
 
 }
 
@@ -34,6 +34,14 @@ api_server * local_peer::api_server() const {
 	return api_server_;
 }
 
+void local_peer::set_block_store(ddsn::block_store *block_store) {
+	block_store_ = block_store;
+}
+
+block_store *local_peer::block_store() const {
+	return block_store_;
+}
+
 const peer_id &local_peer::id() const {
 	return id_;
 }
@@ -57,136 +65,262 @@ int local_peer::port() const {
 // keys
 
 int local_peer::load_key() {
-	BIO *pri = BIO_new(BIO_s_mem());
-
 	ifstream pri_file("keys/local.pem", ios::in | ios::binary | ios::ate);
 
 	if (pri_file.is_open()) {
 		size_t pri_len = (size_t)pri_file.tellg();
 
-		char *pri_key = new char[pri_len];
+		string pri_key(pri_len, '\0');
 
 		pri_file.seekg(0, ios::beg);
-		pri_file.read(pri_key, pri_len);
+		pri_file.read(&pri_key[0], pri_len);
 		pri_file.close();
 
-		BIO_write(pri, pri_key, pri_len);
+		EVP_PKEY *key = private_key_from_pem(pri_key);
 
-		PEM_read_bio_RSAPrivateKey(pri, &keypair_, NULL, NULL);
+		if (key == nullptr) {
+			return 1;
+		}
 
-		delete[] pri_key;
+		// replaces the public part a block record may have registered already
+		keypair_ = key_registry::add(key, true);
 	} else {
 		return 1;
 	}
 
-	BYTE hash[32];
-	hash_from_rsa(keypair_, hash);
-	id_.set_id(hash);
+	id_.set_id(keypair_->hash());
 
 	return 0;
 }
 
 int local_peer::save_key() {
-	BIO *pri = BIO_new(BIO_s_mem());
-
-	PEM_write_bio_RSAPrivateKey(pri, keypair_, NULL, NULL, 0, NULL, NULL);
-
-	size_t pri_len = BIO_pending(pri);
-
-	char *pri_key = new char[pri_len];
-
-	BIO_read(pri, pri_key, pri_len);
+	string pri_key = private_key_to_pem(keypair_->key());
 
 	ofstream pri_file("keys/local.pem", ios::out | ios::binary);
 
 	if (pri_file.is_open()) {
-		pri_file.write(pri_key, pri_len);
+		pri_file.write(pri_key.c_str(), pri_key.length());
 		pri_file.close();
 	} else {
 		return 1;
 	}
 
-	delete[] pri_key;
-
 	return 0;
 }
 
-void local_peer::generate_key() {
-	keypair_ = RSA_generate_key(2048, 3, NULL, NULL);
+void local_peer::generate_key(int signature_type) {
+	keypair_ = key_registry::add(ddsn::generate_key(signature_type), true);
 
-	BYTE hash[32];
-	hash_from_rsa(keypair_, hash);
-	id_.set_id(hash);
+	id_.set_id(keypair_->hash());
 }
 
 void local_peer::load_area_keys() {
 
 }
 
-RSA *local_peer::keypair() {
+const public_key_pointer &local_peer::keypair() const {
 	return keypair_;
 }
 
 // blocks
 
-void local_peer::store(const block &block, boost::function<void(const ddsn::block &, bool)> action) {
-	if (!integrated_) {
-		return;
+int local_peer::load_blocks() {
+	int ret_code = manifest_.load();
+
+	if (ret_code < 0) {
+		return 1;
 	}
 
-	if (code_.contains(block.code())) {
-		cout << "Save " << block.code().string('_') << " to filesystem" << endl;
-		if (block.save_to_filesystem() == 0) {
-			action(block, true);
+	if (block_store_->open(manifest_) != 0) {
+		cout << "Could not open block store" << endl;
+		return 1;
+	}
 
-			stored_blocks_.insert(block.code());
+	if (ret_code == 1) {
+		// no manifest yet, build it once from what's in the block store
+		cout << "Rebuilding block manifest" << endl;
 
-			if (stored_blocks_.size() > capacity_ && !splitting_) {
-				// we have too many blocks and we are not splitting right now (i.e. nothing's be done about that yet)
-				cout << "Capacity exhausted (" << stored_blocks_.size() << " blocks stored, capacity: " << capacity_ << ")" << endl;
+		vector<ddsn::code> codes;
+		block_store_->list(codes);
 
-				shared_ptr<foreign_peer> peer = connected_queued_peer();
-				if (peer) {
-					peer->set_queued(false);
-					splitting_ = true;
+		for (auto it = codes.begin(); it != codes.end(); ++it) {
+			block block(*it);
 
-					// generate new peer code with a trailing 1
-					ddsn::code new_code = code_;
-					int layers = new_code.layers();
-					new_code.resize_layers(layers + 1);
-					new_code.set_layer_code(layers, 1);
+			if (block_store_->load(block) == 0) {
+				manifest_entry entry;
+				entry.code = block.code();
+				entry.size = block.size();
+				memcpy(entry.owner_hash, block.owner_hash(), 32);
+				block_store_->locate(block.code(), entry);
 
-					peer_set_code(*this, peer->connection(), new_code).send();
-				}
+				manifest_.add(entry);
 			}
-		} else {
-			action(block, false);
 		}
+	} else {
+		// locations the manifest doesn't have yet, or that changed when the store was opened
+		vector<manifest_entry> moved;
+
+		for (auto it = manifest_.entries().begin(); it != manifest_.entries().end(); ++it) {
+			manifest_entry entry = it->second;
+			block_store_->locate(entry.code, entry);
+
+			if (!same_location(entry, it->second)) {
+				moved.push_back(entry);
+			}
+		}
+
+		for (auto it = moved.begin(); it != moved.end(); ++it) {
+			manifest_.add(*it);
+		}
+	}
+
+	stored_blocks_.clear();
+
+	for (auto it = manifest_.entries().begin(); it != manifest_.entries().end(); ++it) {
+		stored_blocks_.insert(it->first);
+	}
+
+	cout << "Loaded manifest with " << stored_blocks_.size() << " blocks" << endl;
+
+	return 0;
+}
+
+void local_peer::store(const block &block, boost::function<void(const ddsn::block &, bool)> action) {
+	if (!integrated_) {
+		return;
+	}
+
+	if (code_.contains(block.code())) {
+		cout << "Save " << block.code().string('_') << " to block store" << endl;
+
+		disk_post(block.code(), boost::bind(&local_peer::disk_save, this, block, action));
 	} else {
 		int layer = code_.differing_layer(block.code());
 		auto peer = out_peer(layer, true);
 
+		if (!peer->connection()->accepts_signature(block.signature_type())) {
+			cout << "Peer " << peer->id().short_string() << " doesn't verify " << signature_name(block.signature_type()) << " signatures" << endl;
+			action(block, false);
+			return;
+		}
+
+		if (block.merkle() && !peer->connection()->merkle()) {
+			cout << "Peer " << peer->id().short_string() << " doesn't take Merkle blocks" << endl;
+			action(block, false);
+			return;
+		}
+
+		if (peer->connection()->deflate() && !block.deflate_tried()) {
+			// deflate on the disk pool, not on the network thread, and come back to send it
+			deflate_block(block, boost::bind(&local_peer::store, this, _1, action));
+			return;
+		}
+
 		store_actions_.push_back(std::pair<ddsn::code, boost::function<void(const ddsn::block &, bool)>>(block.code(), action));
 
 		peer_store_block(*this, peer->connection(), block).send();
 	}
 }
 
+void local_peer::disk_post(const ddsn::code &code, boost::function<void()> task) {
+	auto &queue = disk_queues_[code];
+
+	queue.push_back(task);
+
+	if (queue.size() == 1) {
+		disk_pool_->post(boost::bind(&local_peer::disk_run, this, code, task));
+	}
+}
+
+void local_peer::disk_run(const ddsn::code &code, boost::function<void()> task) {
+	task();
+
+	// posted after the task's own result, so that is handled first
+	io_service_.post(boost::bind(&local_peer::disk_done, this, code));
+}
+
+void local_peer::disk_done(const ddsn::code &code) {
+	auto queue = disk_queues_.find(code);
+
+	queue->second.pop_front();
+
+	if (queue->second.empty()) {
+		disk_queues_.erase(queue);
+	} else {
+		disk_pool_->post(boost::bind(&local_peer::disk_run, this, code, queue->second.front()));
+	}
+}
+
+void local_peer::disk_save(const block &block, boost::function<void(const ddsn::block &, bool)> action) {
+	bool success = block_store_->save(block) == 0;
+
+	if (success) {
+		manifest_entry entry;
+		entry.code = block.code();
+		entry.size = block.size();
+		memcpy(entry.owner_hash, block.owner_hash(), 32);
+		block_store_->locate(block.code(), entry);
+
+		// a block missing from the manifest is gone after a restart
+		if (manifest_.add(entry) != 0) {
+			cout << "Could not add " << block.code().string('_') << " to the block manifest" << endl;
+			success = false;
+		}
+	}
+
+	io_service_.post(boost::bind(&local_peer::saved, this, block, action, success));
+}
+
+void local_peer::saved(const block &block, boost::function<void(const ddsn::block &, bool)> action, bool success) {
+	// an older version of the block may be cached, also by loads queued before the save
+	cache_.remove(block.code());
+
+	if (!success) {
+		action(block, false);
+		return;
+	}
+
+	action(block, true);
+
+	stored_blocks_.insert(block.code());
+
+	if (stored_blocks_.size() > capacity_ && !splitting_) {
+		// we have too many blocks and we are not splitting right now (i.e. nothing's be done about that yet)
+		cout << "Capacity exhausted (" << stored_blocks_.size() << " blocks stored, capacity: " << capacity_ << ")" << endl;
+
+		shared_ptr<foreign_peer> peer = connected_queued_peer();
+		if (peer) {
+			peer->set_queued(false);
+			splitting_ = true;
+
+			// generate new peer code with a trailing 1
+			ddsn::code new_code = code_;
+			int layers = new_code.layers();
+			new_code.resize_layers(layers + 1);
+			new_code.set_layer_code(layers, 1);
+
+			peer_set_code(*this, peer->connection(), new_code).send();
+		}
+	}
+}
+
 void local_peer::load(const ddsn::code &block_code, boost::function<void(const block &, bool)> action) {
 	if (!integrated_) {
 		return;
 	}
 
 	if (code_.contains(block_code)) {
-		cout << "Load " << block_code.string('_') << " from filesystem" << endl;
-		
 		block block(block_code);
-		
-		if (block.load_from_filesystem() == 0) {
+
+		if (cache_.get(block_code, block)) {
+			cout << "Load " << block_code.string('_') << " from cache" << endl;
 			action(block, true);
-		} else {
-			action(block, false);
+			return;
 		}
+
+		cout << "Load " << block_code.string('_') << " from block store" << endl;
+
+		disk_post(block_code, boost::bind(&local_peer::disk_load, this, block_code, action));
 	} else {
 		int layer = code_.differing_layer(block_code);
 		auto peer = out_peer(layer, true);
@@ -197,11 +331,47 @@ void local_peer::load(const ddsn::code &block_code, boost::function<void(const b
 	}
 }
 
+void local_peer::disk_load(const ddsn::code &block_code, boost::function<void(const block &, bool)> action) {
+	block block(block_code);
+
+	bool success = block_store_->load(block) == 0;
+
+	if (success && block.merkle()) {
+		// hash the chunks here, not on the network thread when the block is sent
+		block.leaf_hashes();
+	}
+
+	io_service_.post(boost::bind(&local_peer::loaded, this, block, action, success));
+}
+
+void local_peer::loaded(const block &block, boost::function<void(const ddsn::block &, bool)> action, bool success) {
+	if (success) {
+		cache_.put(block);
+	}
+
+	action(block, success);
+}
+
+void local_peer::deflate_block(const block &block, boost::function<void(const ddsn::block &)> done) {
+	disk_post(block.code(), boost::bind(&local_peer::disk_deflate, this, block, done));
+}
+
+void local_peer::disk_deflate(const block &block, boost::function<void(const ddsn::block &)> done) {
+	block.deflated();
+
+	io_service_.post(boost::bind(done, block));
+}
+
+void local_peer::disk_remove(const ddsn::code &block_code) {
+	block_store_->remove(block_code);
+	manifest_.remove(block_code);
+}
+
 int local_peer::blocks() const {
 	return stored_blocks_.size();
 }
 
-std::unordered_set<ddsn::code> local_peer::stored_blocks() const {
+const code_index &local_peer::stored_blocks() const {
 	return stored_blocks_;
 }
 
@@ -213,27 +383,114 @@ void local_peer::set_capacity(int capacity) {
 	capacity_ = capacity;
 }
 
+void local_peer::set_cache_size(UINT64 cache_size) {
+	cache_.set_capacity(cache_size);
+}
+
+worker_pool *local_peer::disk_pool() const {
+	return disk_pool_;
+}
+
+void local_peer::set_disk_pool(worker_pool *disk_pool) {
+	disk_pool_ = disk_pool;
+}
+
+worker_pool *local_peer::crypto_pool() const {
+	return crypto_pool_;
+}
+
+void local_peer::set_crypto_pool(worker_pool *crypto_pool) {
+	crypto_pool_ = crypto_pool;
+}
+
+void local_peer::post_crypto(boost::function<void()> task) {
+	if (crypto_pool_ == nullptr) {
+		task();
+		return;
+	}
+
+	// nothing overtakes the tasks waiting already
+	if (!crypto_backlog_.empty() || !crypto_pool_->try_post(task)) {
+		crypto_backlog_.push_back(task);
+	}
+}
+
+void local_peer::crypto_finished() {
+	while (!crypto_backlog_.empty() && crypto_pool_->try_post(crypto_backlog_.front())) {
+		crypto_backlog_.pop_front();
+	}
+}
+
+size_t local_peer::crypto_backlog() const {
+	return crypto_backlog_.size();
+}
+
+boost::asio::io_service &local_peer::io_service() {
+	return io_service_;
+}
+
+bool local_peer::deflate() const {
+	return deflate_;
+}
+
+void local_peer::set_deflate(bool deflate) {
+	deflate_ = deflate;
+}
+
+bool local_peer::merkle() const {
+	return merkle_;
+}
+
+void local_peer::set_merkle(bool merkle) {
+	merkle_ = merkle;
+}
+
+verify_cache *local_peer::verify_cache() const {
+	return verify_cache_;
+}
+
+void local_peer::set_verify_cache(ddsn::verify_cache *verify_cache) {
+	verify_cache_ = verify_cache;
+}
+
+ticket_cache &local_peer::tickets() {
+	return tickets_;
+}
+
 void ddsn::action_peer_stored_block(local_peer &local_peer, const block &block, bool success) {
 	if (success) {
-		block.delete_from_filesystem();
+		local_peer.disk_post(block.code(), boost::bind(&local_peer::disk_remove, &local_peer, block.code()));
+		local_peer.cache_.remove(block.code());
 		local_peer.stored_blocks_.erase(block.code());
 		local_peer.redistribute_block();
 	}
 }
 
 void local_peer::redistribute_block() {
-	for (auto it = stored_blocks_.begin(); it != stored_blocks_.end(); ++it) {
-		if (!code_.contains(*it)) {
-			block block(*it);
-			block.load_from_filesystem();
+	// blocks under our code are one range of the index, anything outside it moves
+	ddsn::code code;
 
-			store(block, boost::bind(&action_peer_stored_block, boost::ref(*this), _1, _2));
-			return;
-		}
+	if (stored_blocks_.first_outside(code_, code)) {
+		disk_post(code, boost::bind(&local_peer::disk_load, this, code, boost::function<void(const block &, bool)>(boost::bind(&local_peer::redistribute_loaded, this, _1, _2))));
+		return;
 	}
+
 	splitting_ = false;
 }
 
+void local_peer::redistribute_loaded(const block &block, bool success) {
+	if (success) {
+		store(block, boost::bind(&action_peer_stored_block, boost::ref(*this), _1, _2));
+	} else {
+		// can't be handed over now (the error may pass), go on with the next one
+		// but keep it on disk and in the manifest, only a stored copy removes it
+		cout << "Could not load " << block.code().string('_') << " for redistribution" << endl;
+
+		stored_blocks_.erase(block.code());
+		redistribute_block();
+	}
+}
+
 void local_peer::do_load_actions(const block &block, bool success) {
 	for (auto it = load_actions_.begin(); it != load_actions_.end();) {
 		if (it->first == block.code()) {
@@ -2,16 +2,22 @@
 #define DDSN_LOCAL_H
 
 #include "block.h"
+#include "block_cache.h"
+#include "block_store.h"
 #include "code.h"
+#include "code_index.h"
 #include "foreign_peer.h"
+#include "keys.h"
+#include "manifest.h"
 #include "peer_id.h"
+#include "ticket_cache.h"
+#include "worker_pool.h"
 
-#include <openssl/rsa.h>
 #include <boost/asio.hpp>
 #include <boost/function.hpp>
+#include <deque>
 #include <list>
 #include <unordered_map>
-#include <unordered_set>
 
 namespace ddsn {
 
@@ -29,6 +35,8 @@ public:
 
 	void set_api_server(ddsn::api_server *api_server);
 	ddsn::api_server *api_server() const;
+	void set_block_store(ddsn::block_store *block_store);
+	ddsn::block_store *block_store() const;
 
 	// general
 	const peer_id &id() const;
@@ -40,20 +48,48 @@ public:
 	// keys
 	int load_key();
 	int save_key();
-	void generate_key();
-	RSA *keypair();
+	// DDSN_SIGNATURE_RSA or DDSN_SIGNATURE_ED25519
+	void generate_key(int signature_type = DDSN_SIGNATURE_RSA);
+	// registered with the key_registry, holds the private key too
+	const public_key_pointer &keypair() const;
 	void load_area_keys();
 
 	// blocks
+	int load_blocks();
 	void store(const block &block, boost::function<void(const ddsn::block &, bool)> action);
 	void load(const ddsn::code &code, boost::function<void(const block &, bool)> action);
+	// deflate the block for a peer that takes deflated transfers on the disk pool,
+	// done gets it back on the network thread
+	void deflate_block(const block &block, boost::function<void(const ddsn::block &)> done);
 	bool exists(const ddsn::code &code);
 	void redistribute_block();
 
 	int capacity() const;
 	int blocks() const;
-	std::unordered_set<ddsn::code> stored_blocks() const;
+	const code_index &stored_blocks() const;
 	void set_capacity(int capactiy);
+	void set_cache_size(UINT64 cache_size);
+	worker_pool *disk_pool() const;
+	void set_disk_pool(worker_pool *disk_pool);
+	// signature checks of received messages run here (nullptr: on the network thread)
+	worker_pool *crypto_pool() const;
+	void set_crypto_pool(worker_pool *crypto_pool);
+	// run a task on the crypto pool, tasks it refuses wait until a task finished
+	void post_crypto(boost::function<void()> task);
+	// called on the network thread after each task of post_crypto
+	void crypto_finished();
+	size_t crypto_backlog() const;
+	boost::asio::io_service &io_service();
+	// offer deflated block transfers to peers
+	bool deflate() const;
+	void set_deflate(bool deflate);
+	// sign stored files larger than a Merkle leaf over their Merkle root
+	bool merkle() const;
+	void set_merkle(bool merkle);
+	ddsn::verify_cache *verify_cache() const;
+	void set_verify_cache(ddsn::verify_cache *verify_cache);
+	// secrets for resuming sessions with peers verified before
+	ticket_cache &tickets();
 
 	void do_load_actions(const block &block, bool success);
 	void do_store_actions(const block &block, bool success);
@@ -73,19 +109,44 @@ public:
 	std::shared_ptr<foreign_peer> connected_queued_peer() const;
 	std::shared_ptr<foreign_peer> out_peer(int layer, bool connected = true) const;
 private:
+	// block store access runs on the disk pool, the results are posted back
+	// tasks for the same code run one after another, in the order they were posted
+	void disk_post(const ddsn::code &code, boost::function<void()> task);
+	void disk_run(const ddsn::code &code, boost::function<void()> task);
+	void disk_done(const ddsn::code &code);
+	void disk_save(const block &block, boost::function<void(const ddsn::block &, bool)> action);
+	void disk_load(const ddsn::code &code, boost::function<void(const block &, bool)> action);
+	void disk_remove(const ddsn::code &code);
+	void disk_deflate(const block &block, boost::function<void(const ddsn::block &)> done);
+	void saved(const block &block, boost::function<void(const ddsn::block &, bool)> action, bool success);
+	void loaded(const block &block, boost::function<void(const ddsn::block &, bool)> action, bool success);
+	void redistribute_loaded(const block &block, bool success);
 
 	boost::asio::io_service &io_service_;
 	ddsn::api_server *api_server_;
+	ddsn::block_store *block_store_;
+	worker_pool *disk_pool_;
+	worker_pool *crypto_pool_;
 
 	peer_id id_;
 	ddsn::code code_;
 	std::string host_;
 	int port_;
 
-	RSA *keypair_;
+	public_key_pointer keypair_;
 
 	UINT32 capacity_;
-	std::unordered_set<ddsn::code> stored_blocks_;
+	block_manifest manifest_;
+	block_cache cache_;
+	bool deflate_;
+	bool merkle_;
+	ddsn::verify_cache *verify_cache_;
+	ticket_cache tickets_;
+	code_index stored_blocks_;
+	// crypto tasks waiting for room in the crypto pool
+	std::deque<boost::function<void()>> crypto_backlog_;
+	// disk tasks waiting for the one running for their code (the front)
+	std::unordered_map<ddsn::code, std::deque<boost::function<void()>>> disk_queues_;
 	std::list<std::pair<ddsn::code, boost::function<void(const block &, bool)>>> load_actions_;
 	std::list<std::pair<ddsn::code, boost::function<void(const block &, bool)>>> store_actions_;
 
@@ -0,0 +1,351 @@
+#include "manifest.h"
+
+#include <boost/filesystem.hpp>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+using namespace ddsn;
+using namespace std;
+
+static const CHAR manifest_magic[8] = { 'D', 'D', 'S', 'N', 'M', 'A', 'N', '2' };
+static const CHAR manifest_v1_magic[8] = { 'D', 'D', 'S', 'N', 'M', 'A', 'N', '1' };
+// journals of version 1 have no header
+static const CHAR journal_magic[8] = { 'D', 'D', 'S', 'N', 'J', 'R', 'N', '2' };
+
+static void location_to_bytes(const block_location &location, BYTE *bytes) {
+	memcpy(bytes, &location.segment, 4);
+	memcpy(bytes + 4, &location.offset, 8);
+	memcpy(bytes + 12, &location.length, 4);
+}
+
+static void location_from_bytes(const BYTE *bytes, block_location &location) {
+	memcpy(&location.segment, bytes, 4);
+	memcpy(&location.offset, bytes + 4, 8);
+	memcpy(&location.length, bytes + 12, 4);
+}
+
+static void entry_to_bytes(const manifest_entry &entry, BYTE *bytes) {
+	memcpy(bytes, entry.code.bytes(), 32);
+	memcpy(bytes + 32, &entry.size, 4);
+	memcpy(bytes + 36, entry.owner_hash, 32);
+
+	BYTE flags = 0;
+
+	if (entry.located) {
+		flags |= DDSN_MANIFEST_FLAG_LOCATED;
+	}
+
+	if (entry.payload.layers() == 256) {
+		flags |= DDSN_MANIFEST_FLAG_PAYLOAD;
+	}
+
+	if (entry.payload_deflated) {
+		flags |= DDSN_MANIFEST_FLAG_DEFLATED;
+	}
+
+	bytes[68] = flags;
+	location_to_bytes(entry.record, bytes + 69);
+
+	if (flags & DDSN_MANIFEST_FLAG_PAYLOAD) {
+		memcpy(bytes + 85, entry.payload.bytes(), 32);
+	} else {
+		memset(bytes + 85, 0, 32);
+	}
+
+	location_to_bytes(entry.payload_record, bytes + 117);
+}
+
+static void entry_from_bytes(const BYTE *bytes, size_t size, manifest_entry &entry) {
+	entry.code = code(256, bytes);
+	memcpy(&entry.size, bytes + 32, 4);
+	memcpy(entry.owner_hash, bytes + 36, 32);
+
+	if (size == DDSN_MANIFEST_ENTRY_V1_SIZE) {
+		return;
+	}
+
+	BYTE flags = bytes[68];
+
+	entry.located = (flags & DDSN_MANIFEST_FLAG_LOCATED) != 0;
+	location_from_bytes(bytes + 69, entry.record);
+
+	if (flags & DDSN_MANIFEST_FLAG_PAYLOAD) {
+		entry.payload = code(256, bytes + 85);
+	}
+
+	location_from_bytes(bytes + 117, entry.payload_record);
+	entry.payload_deflated = (flags & DDSN_MANIFEST_FLAG_DEFLATED) != 0;
+}
+
+// reads a whole file with one read
+static bool read_file(const string &path, string &contents) {
+	ifstream file(path, ios::in | ios::binary | ios::ate);
+
+	if (!file.is_open()) {
+		return false;
+	}
+
+	size_t size = (size_t)file.tellg();
+	contents.resize(size);
+
+	file.seekg(0, ios::beg);
+	file.read(&contents[0], size);
+
+	return true;
+}
+
+// flushes a file or directory to disk
+static bool sync_path(const string &path) {
+	int fd = open(path.c_str(), O_RDONLY);
+
+	if (fd < 0) {
+		return false;
+	}
+
+	bool synced = fsync(fd) == 0;
+	close(fd);
+
+	return synced;
+}
+
+static bool same_location(const block_location &a, const block_location &b) {
+	return a.segment == b.segment && a.offset == b.offset && a.length == b.length;
+}
+
+bool ddsn::same_location(const manifest_entry &a, const manifest_entry &b) {
+	if (!a.located || !b.located) {
+		return a.located == b.located;
+	}
+
+	return ::same_location(a.record, b.record) && a.payload == b.payload &&
+		(a.payload.layers() == 0 || (::same_location(a.payload_record, b.payload_record) && a.payload_deflated == b.payload_deflated));
+}
+
+manifest_entry::manifest_entry() :
+size(0), located(false), record(), payload_record(), payload_deflated(false) {
+
+}
+
+block_manifest::block_manifest(const string &directory) :
+directory_(directory), located_(false), journal_entries_(0) {
+
+}
+
+block_manifest::~block_manifest() {
+	if (journal_.is_open()) {
+		journal_.close();
+	}
+}
+
+int block_manifest::load() {
+	entries_.clear();
+	located_ = false;
+
+	bool found = false;
+	string contents;
+
+	// checkpoint
+
+	if (read_file(directory_ + "manifest", contents)) {
+		found = true;
+
+		if (contents.length() >= 12 && memcmp(contents.data(), manifest_magic, 8) == 0) {
+			located_ = true;
+		} else if (contents.length() < 12 || memcmp(contents.data(), manifest_v1_magic, 8) != 0) {
+			cout << "Manifest is corrupted" << endl;
+			return rebuild();
+		}
+
+		size_t entry_size = located_ ? DDSN_MANIFEST_ENTRY_SIZE : DDSN_MANIFEST_ENTRY_V1_SIZE;
+
+		UINT32 count;
+		memcpy(&count, contents.data() + 8, 4);
+
+		if (contents.length() < 12 + (size_t)count * entry_size) {
+			cout << "Manifest is truncated" << endl;
+			return rebuild();
+		}
+
+		const BYTE *p = (const BYTE *)contents.data() + 12;
+
+		for (UINT32 i = 0; i < count; i++, p += entry_size) {
+			manifest_entry entry;
+			entry_from_bytes(p, entry_size, entry);
+			entries_[entry.code] = entry;
+		}
+	}
+
+	// journal
+
+	if (read_file(directory_ + "manifest.journal", contents)) {
+		found = true;
+
+		const BYTE *p = (const BYTE *)contents.data();
+		const BYTE *end = p + contents.length();
+		size_t entry_size = DDSN_MANIFEST_ENTRY_V1_SIZE;
+
+		if (contents.length() >= 8 && memcmp(contents.data(), journal_magic, 8) == 0) {
+			entry_size = DDSN_MANIFEST_ENTRY_SIZE;
+			p += 8;
+		}
+
+		// a torn record at the end is simply dropped
+		for (; p + 1 + entry_size <= end; p += 1 + entry_size) {
+			manifest_entry entry;
+			entry_from_bytes(p + 1, entry_size, entry);
+
+			if (p[0] == DDSN_MANIFEST_JOURNAL_ADD) {
+				entries_[entry.code] = entry;
+			} else if (p[0] == DDSN_MANIFEST_JOURNAL_REMOVE) {
+				entries_.erase(entry.code);
+			}
+		}
+	}
+
+	// fold the journal into a fresh checkpoint and start a new journal
+	if (checkpoint() != 0) {
+		return -1;
+	}
+
+	return found ? 0 : 1;
+}
+
+int block_manifest::rebuild() {
+	// the journal only makes sense on top of its checkpoint
+	entries_.clear();
+	located_ = false;
+
+	if (checkpoint() != 0) {
+		return -1;
+	}
+
+	return 1;
+}
+
+int block_manifest::checkpoint() {
+	if (journal_.is_open()) {
+		journal_.close();
+	}
+
+	string tmp_path = directory_ + "manifest.tmp";
+
+	ofstream file(tmp_path, ios::out | ios::binary | ios::trunc);
+
+	if (!file.is_open()) {
+		// the old checkpoint and journal still hold everything, go on with them
+		open_journal(false);
+		return 1;
+	}
+
+	UINT32 count = entries_.size();
+
+	file.write(manifest_magic, 8);
+	file.write((CHAR *)&count, 4);
+
+	for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+		BYTE bytes[DDSN_MANIFEST_ENTRY_SIZE];
+		entry_to_bytes(it->second, bytes);
+		file.write((CHAR *)bytes, DDSN_MANIFEST_ENTRY_SIZE);
+	}
+
+	file.close();
+
+	// on disk before it replaces the old checkpoint, a power loss mustn't leave a short one
+	if (!file.good() || !sync_path(tmp_path) || std::rename(tmp_path.c_str(), (directory_ + "manifest").c_str()) != 0) {
+		std::remove(tmp_path.c_str());
+		open_journal(false);
+		return 1;
+	}
+
+	sync_path(directory_);
+
+	// the new checkpoint holds everything, replaying the old journal on it changes nothing,
+	// so appending to it is fine if a new one can't be started
+	if (open_journal(true) != 0) {
+		open_journal(false);
+		return 1;
+	}
+
+	return 0;
+}
+
+int block_manifest::open_journal(bool truncate) {
+	if (journal_.is_open()) {
+		journal_.close();
+	}
+
+	journal_.clear();
+	journal_.open(directory_ + "manifest.journal", ios::out | ios::binary | (truncate ? ios::trunc : ios::app));
+	journal_entries_ = 0;
+
+	if (!journal_.is_open()) {
+		return 1;
+	}
+
+	if (journal_.tellp() == 0) {
+		// an empty journal would be read as one of version 1
+		journal_.write(journal_magic, 8);
+		journal_.flush();
+	}
+
+	return journal_.good() ? 0 : 1;
+}
+
+int block_manifest::journal(BYTE op, const manifest_entry &entry) {
+	if (!journal_.is_open()) {
+		return 1;
+	}
+
+	BYTE bytes[1 + DDSN_MANIFEST_ENTRY_SIZE];
+	bytes[0] = op;
+	entry_to_bytes(entry, bytes + 1);
+
+	journal_.write((CHAR *)bytes, 1 + DDSN_MANIFEST_ENTRY_SIZE);
+	journal_.flush();
+
+	if (!journal_.good()) {
+		return 1;
+	}
+
+	journal_entries_++;
+
+	if (journal_entries_ > 1024 && journal_entries_ > entries_.size()) {
+		// the entry is in the journal already, which goes on if the checkpoint fails
+		checkpoint();
+	}
+
+	return 0;
+}
+
+int block_manifest::add(const manifest_entry &entry) {
+	lock_guard<mutex> lock(mutex_);
+
+	entries_[entry.code] = entry;
+	return journal(DDSN_MANIFEST_JOURNAL_ADD, entry);
+}
+
+int block_manifest::remove(const ddsn::code &code) {
+	lock_guard<mutex> lock(mutex_);
+
+	auto it = entries_.find(code);
+
+	if (it == entries_.end()) {
+		return 1;
+	}
+
+	manifest_entry entry = it->second;
+	entries_.erase(it);
+
+	return journal(DDSN_MANIFEST_JOURNAL_REMOVE, entry);
+}
+
+const unordered_map<code, manifest_entry> &block_manifest::entries() const {
+	return entries_;
+}
+
+bool block_manifest::located() const {
+	return located_;
+}
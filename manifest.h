@@ -0,0 +1,94 @@
+#ifndef DDSN_MANIFEST_H
+#define DDSN_MANIFEST_H
+
+#include "code.h"
+#include "definitions.h"
+
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#define DDSN_MANIFEST_ENTRY_SIZE     133
+// entries of manifests written before block locations were kept
+#define DDSN_MANIFEST_ENTRY_V1_SIZE  68
+#define DDSN_MANIFEST_JOURNAL_ADD    1
+#define DDSN_MANIFEST_JOURNAL_REMOVE 2
+
+#define DDSN_MANIFEST_FLAG_LOCATED   1
+#define DDSN_MANIFEST_FLAG_PAYLOAD   2
+#define DDSN_MANIFEST_FLAG_DEFLATED  4
+
+namespace ddsn {
+
+// where a storage engine keeps a record of a block
+struct block_location {
+	UINT32 segment;
+	UINT64 offset;
+	UINT32 length;
+};
+
+struct manifest_entry {
+	manifest_entry();
+
+	ddsn::code code;
+	UINT32 size;
+	BYTE owner_hash[32];
+
+	// set by storage engines that keep records at locations (see block_store::locate)
+	bool located;
+	block_location record;
+	// content hash of the shared payload of the block, no layers if it has none
+	ddsn::code payload;
+	block_location payload_record;
+	bool payload_deflated;
+};
+
+bool same_location(const manifest_entry &a, const manifest_entry &b);
+
+/*
+ * On-disk list of the blocks stored by this peer.
+ * A checkpoint (blocks/manifest) holds all entries, changes since then are
+ * appended to a journal (blocks/manifest.journal). Both are read with a single
+ * sequential read on start. The journal is folded into a new checkpoint once
+ * it grows larger than the checkpoint.
+ * Entries also hold the location of the block in the storage engine, so the
+ * engine can rebuild its index from the manifest instead of reading its data.
+ */
+class block_manifest {
+public:
+	block_manifest(const std::string &directory = "blocks/");
+	~block_manifest();
+
+	// returns 0 if loaded, 1 if there was no manifest yet or it was corrupted
+	// (rebuild it from the block store then)
+	int load();
+	int checkpoint();
+
+	int add(const manifest_entry &entry);
+	int remove(const code &code);
+
+	const std::unordered_map<code, manifest_entry> &entries() const;
+	// false if the manifest was just created or written before locations were kept
+	bool located() const;
+private:
+	int journal(BYTE op, const manifest_entry &entry);
+	// start a new journal, or append to the current one (adding the header if it's empty)
+	int open_journal(bool truncate);
+	// drop a corrupted checkpoint, returns load's result
+	int rebuild();
+
+	std::string directory_;
+	std::unordered_map<code, manifest_entry> entries_;
+	bool located_;
+
+	std::ofstream journal_;
+	size_t journal_entries_;
+
+	// add and remove are called from the disk threads
+	std::mutex mutex_;
+};
+
+}
+
+#endif
@@ -0,0 +1,123 @@
+#include "merkle.h"
+
+#include <cstring>
+
+using namespace ddsn;
+using namespace std;
+
+static const BYTE leaf_prefix = 0x00;
+static const BYTE node_prefix = 0x01;
+
+size_t merkle_hasher::leaves(size_t size) {
+	return size == 0 ? 1 : (size + DDSN_MERKLE_LEAF_SIZE - 1) / (DDSN_MERKLE_LEAF_SIZE);
+}
+
+void merkle_hasher::leaf(const BYTE *data, size_t size, BYTE hash[32]) {
+	ddsn::sha256 sha256;
+	sha256.update(&leaf_prefix, 1);
+	sha256.update(data, size);
+	sha256.finish(hash);
+}
+
+shared_buffer merkle_hasher::leaf_hashes(const BYTE *data, size_t size) {
+	size_t count = leaves(size);
+	shared_buffer hashes(count * 32);
+
+	for (size_t i = 0; i < count; i++) {
+		size_t offset = i * (DDSN_MERKLE_LEAF_SIZE);
+		size_t length = min(size - offset, (size_t)(DDSN_MERKLE_LEAF_SIZE));
+
+		leaf(data + offset, length, hashes.mutable_data() + i * 32);
+	}
+
+	return hashes;
+}
+
+void merkle_hasher::root(const BYTE *leaf_hashes, size_t count, BYTE root[32]) {
+	if (count == 0) {
+		leaf(nullptr, 0, root);
+		return;
+	}
+
+	vector<BYTE> level(leaf_hashes, leaf_hashes + count * 32);
+
+	while (count > 1) {
+		size_t parents = (count + 1) / 2;
+
+		for (size_t i = 0; i < count / 2; i++) {
+			ddsn::sha256 sha256;
+			sha256.update(&node_prefix, 1);
+			sha256.update(&level[2 * i * 32], 64);
+			sha256.finish(&level[i * 32]);
+		}
+
+		if (count % 2 == 1) {
+			memmove(&level[(parents - 1) * 32], &level[(count - 1) * 32], 32);
+		}
+
+		count = parents;
+	}
+
+	memcpy(root, level.data(), 32);
+}
+
+merkle_hasher::merkle_hasher() : leaf_bytes_(0), checked_(0) {
+	sha256_.update(&leaf_prefix, 1);
+}
+
+void merkle_hasher::update(const BYTE *data, size_t size) {
+	while (size > 0) {
+		size_t length = min(size, (size_t)(DDSN_MERKLE_LEAF_SIZE) - leaf_bytes_);
+
+		sha256_.update(data, length);
+		leaf_bytes_ += length;
+		data += length;
+		size -= length;
+
+		if (leaf_bytes_ == DDSN_MERKLE_LEAF_SIZE) {
+			finish_leaf();
+		}
+	}
+}
+
+size_t merkle_hasher::finished() const {
+	return leaf_hashes_.size() / 32;
+}
+
+const BYTE *merkle_hasher::leaf_hash(size_t leaf) const {
+	return &leaf_hashes_[leaf * 32];
+}
+
+bool merkle_hasher::check(const shared_buffer &leaf_hashes) {
+	size_t count = finished();
+
+	if (count * 32 > leaf_hashes.size()) {
+		return false;
+	}
+
+	if (memcmp(leaf_hashes.data() + checked_ * 32, leaf_hashes_.data() + checked_ * 32, (count - checked_) * 32) != 0) {
+		return false;
+	}
+
+	checked_ = count;
+
+	return true;
+}
+
+shared_buffer merkle_hasher::finish() {
+	// a partial last leaf, or the only leaf of empty data
+	if (leaf_bytes_ > 0 || leaf_hashes_.empty()) {
+		finish_leaf();
+	}
+
+	return shared_buffer(leaf_hashes_.data(), leaf_hashes_.size());
+}
+
+void merkle_hasher::finish_leaf() {
+	leaf_hashes_.resize(leaf_hashes_.size() + 32);
+	sha256_.finish(&leaf_hashes_[leaf_hashes_.size() - 32]);
+
+	sha256_ = ddsn::sha256();
+	sha256_.update(&leaf_prefix, 1);
+	leaf_bytes_ = 0;
+}
@@ -0,0 +1,53 @@
+#ifndef DDSN_MERKLE_H
+#define DDSN_MERKLE_H
+
+#include "buffer.h"
+#include "definitions.h"
+#include "sha256.h"
+
+#include <vector>
+
+#define DDSN_MERKLE_LEAF_SIZE 64 * 1024
+
+namespace ddsn {
+
+/*
+ * Merkle tree over DDSN_MERKLE_LEAF_SIZE chunks of block data.
+ * Leaves are SHA-256(0x00, chunk), inner nodes SHA-256(0x01, left, right),
+ * an odd node at the end of a level moves up unchanged. Data of any size
+ * (also empty data) has at least one leaf.
+ * With the leaf hashes known up front, every chunk can be checked on its
+ * own as soon as it's there; the root checks the leaf hashes.
+ */
+class merkle_hasher {
+public:
+	static size_t leaves(size_t size);
+	static void leaf(const BYTE *data, size_t size, BYTE hash[32]);
+	// hash each chunk of the data (leaves(size) * 32 bytes)
+	static shared_buffer leaf_hashes(const BYTE *data, size_t size);
+	static void root(const BYTE *leaf_hashes, size_t count, BYTE root[32]);
+
+	merkle_hasher();
+
+	// data fed in order, leaves are finished as soon as their chunk is complete
+	void update(const BYTE *data, size_t size);
+	// leaves finished so far
+	size_t finished() const;
+	const BYTE *leaf_hash(size_t leaf) const;
+	// compare the leaves finished since the last check with the same leaves
+	// of leaf_hashes (e.g. sent ahead of the data), false on the first mismatch
+	bool check(const shared_buffer &leaf_hashes);
+	// finish the last leaf, returns all leaf hashes
+	shared_buffer finish();
+private:
+	void finish_leaf();
+
+	ddsn::sha256 sha256_;
+	size_t leaf_bytes_;
+	std::vector<BYTE> leaf_hashes_;
+	size_t checked_;
+};
+
+}
+
+#endif
@@ -1,10 +1,13 @@
 #include "peer_connection.h"
 
 #include "peer_messages.h"
+#include "frame.h"
 #include "definitions.h"
 #include "utilities.h"
 
 #include <boost/bind.hpp>
+#include <openssl/rand.h>
+#include <cstring>
 
 using namespace ddsn;
 using namespace std;
@@ -14,21 +17,28 @@ using boost::asio::ip::tcp;
 int peer_connection::connections = 0;
 
 peer_connection::peer_connection(local_peer &local_peer, io_service &io_service) :
-local_peer_(local_peer), socket_(io_service), message_(nullptr), introduced_(false), got_welcome_(false),
-rcv_buffer_start_(0), rcv_buffer_end_(0), snd_buffer_start_(0), snd_buffer_end_(0) {
+local_peer_(local_peer), socket_(io_service), rcv_buffer_start_(0), rcv_buffer_end_(0), writing_(false), message_(nullptr), partial_bytes_(0),
+introduced_(false), got_welcome_(false), deflate_(false), signature_types_(1 << DDSN_SIGNATURE_RSA), key_reference_(false), merkle_(false), nonce_handshake_(false), peer_exchange_key_set_(false), ticket_offered_(false), binary_(false),
+key_wait_count_(0), key_timer_(io_service), key_timer_running_(false) {
 	id_ = connections++;
 
 	rcv_buffer_ = new BYTE[256];
 	rcv_buffer_size_ = 256;
 
-	snd_buffer_ = new BYTE[256];
-	snd_buffer_size_ = 256;
+	RAND_bytes(nonce_, 32);
+
+	exchange_key_ = generate_exchange_key();
+
+	if (!ddsn::exchange_public_key(exchange_key_, exchange_public_key_)) {
+		EVP_PKEY_free(exchange_key_);
+		exchange_key_ = nullptr;
+	}
 }
 
 peer_connection::~peer_connection() {
 	cout << "PEER#" << id_ << " DELETED" << endl;
 	delete[] rcv_buffer_;
-	delete[] snd_buffer_;
+	EVP_PKEY_free(exchange_key_);
 }
 
 bool peer_connection::introduced() const {
@@ -39,6 +49,50 @@ bool peer_connection::got_welcome() const {
 	return got_welcome_;
 }
 
+bool peer_connection::deflate() const {
+	return deflate_;
+}
+
+bool peer_connection::accepts_signature(int signature_type) const {
+	return signature_type >= 0 && (signature_types_ & (1 << signature_type)) != 0;
+}
+
+bool peer_connection::key_reference() const {
+	return key_reference_;
+}
+
+bool peer_connection::merkle() const {
+	return merkle_;
+}
+
+const BYTE *peer_connection::nonce() const {
+	return nonce_;
+}
+
+bool peer_connection::nonce_handshake() const {
+	return nonce_handshake_;
+}
+
+EVP_PKEY *peer_connection::exchange_key() const {
+	return exchange_key_;
+}
+
+const BYTE *peer_connection::exchange_public_key() const {
+	return exchange_key_ != nullptr ? exchange_public_key_ : nullptr;
+}
+
+const BYTE *peer_connection::peer_exchange_key() const {
+	return peer_exchange_key_set_ ? peer_exchange_key_ : nullptr;
+}
+
+bool peer_connection::ticket_offered() const {
+	return ticket_offered_;
+}
+
+bool peer_connection::binary() const {
+	return binary_;
+}
+
 std::shared_ptr<foreign_peer> peer_connection::foreign_peer() {
 	return foreign_peer_;
 }
@@ -56,6 +110,39 @@ void peer_connection::set_got_welcome(bool got_welcome) {
 	got_welcome_ = got_welcome;
 }
 
+void peer_connection::set_deflate(bool deflate) {
+	deflate_ = deflate;
+}
+
+void peer_connection::set_signature_types(UINT32 signature_types) {
+	signature_types_ = signature_types;
+}
+
+void peer_connection::set_key_reference(bool key_reference) {
+	key_reference_ = key_reference;
+}
+
+void peer_connection::set_merkle(bool merkle) {
+	merkle_ = merkle;
+}
+
+void peer_connection::set_nonce_handshake(bool nonce_handshake) {
+	nonce_handshake_ = nonce_handshake;
+}
+
+void peer_connection::set_peer_exchange_key(const BYTE peer_exchange_key[32]) {
+	memcpy(peer_exchange_key_, peer_exchange_key, 32);
+	peer_exchange_key_set_ = true;
+}
+
+void peer_connection::set_ticket_offered(bool ticket_offered) {
+	ticket_offered_ = ticket_offered;
+}
+
+void peer_connection::set_binary(bool binary) {
+	binary_ = binary;
+}
+
 tcp::socket &peer_connection::socket() {
 	return socket_;
 }
@@ -77,52 +164,36 @@ void peer_connection::send(const string &string) {
 }
 
 void peer_connection::send(const BYTE *bytes, size_t size) {
-	// data still to be sent
-	size_t buffer_data = snd_buffer_end_ - snd_buffer_start_;
-
-	// space at the end of the buffer
-	size_t buffer_space = snd_buffer_size_ - snd_buffer_end_;
+	snd_queue_.push(bytes, size);
 
-	if (buffer_data == 0) {
-		snd_buffer_start_ = 0;
-		snd_buffer_end_ = 0;
+	if (!writing_ && !snd_queue_.empty()) {
+		// only send when there's not already a send request in the queue
+		// otherwise handle_write will call write_next
+		// the write starts once the current handler is done, so the rest of
+		// the message is queued by then and goes out in the same write
+		writing_ = true;
+		local_peer_.io_service().post(boost::bind(&peer_connection::write_next, shared_from_this()));
 	}
+}
 
-	if (size > buffer_space) {
-		if (size <= snd_buffer_size_ - buffer_data) {
-			// shift to beginning to create space at the end (doesn't resize the buffer)
-			memmove(snd_buffer_, snd_buffer_ + snd_buffer_start_, buffer_data);
+void peer_connection::send(const shared_buffer &buffer) {
+	snd_queue_.push(buffer);
 
-			snd_buffer_start_ = 0;
-			snd_buffer_end_ = buffer_data;
-			//new_buffer_space = snd_buffer_size_ - buffer_data;
-		} else {
-			// enlarge buffer space for expected bytes to next power of 2
-			snd_buffer_size_ = next_power(buffer_data + size);
-			BYTE *new_buffer = new BYTE[snd_buffer_size_];
-			memcpy(new_buffer, snd_buffer_ + snd_buffer_start_, buffer_data);
-			delete[] snd_buffer_;
-			snd_buffer_ = new_buffer;
-
-			snd_buffer_start_ = 0;
-			snd_buffer_end_ = buffer_data;
-			//new_buffer_space = snd_buffer_size_ - buffer_data;
-		}
+	if (!writing_ && !snd_queue_.empty()) {
+		writing_ = true;
+		local_peer_.io_service().post(boost::bind(&peer_connection::write_next, shared_from_this()));
 	}
+}
 
-	// copy the data to the buffer
-	memcpy(snd_buffer_ + snd_buffer_end_, bytes, size);
-
-	snd_buffer_end_ += size;
-
-
-	if (buffer_data == 0) {
-		// only send when there's not already a send request in the queue
-		// if buffer_data != 0 handle_write will call async_write_some
-		socket_.async_write_some(boost::asio::buffer(snd_buffer_ + snd_buffer_start_, buffer_data + size), boost::bind(&peer_connection::handle_write, shared_from_this(),
-			boost::asio::placeholders::error,
-			boost::asio::placeholders::bytes_transferred));
+void peer_connection::write_next() {
+	if (!socket_.is_open()) {
+		return;
 	}
+
+	// everything queued (headers, signature, block data) in one gathered write
+	socket_.async_write_some(snd_queue_.buffers(), boost::bind(&peer_connection::handle_write, shared_from_this(),
+		boost::asio::placeholders::error,
+		boost::asio::placeholders::bytes_transferred));
 }
 
 void peer_connection::handle_write(const boost::system::error_code& error, size_t bytes_transferred) {
@@ -132,14 +203,12 @@ void peer_connection::handle_write(const boost::system::error_code& error, size_
 	}
 
 	if (bytes_transferred) {
-		snd_buffer_start_ += bytes_transferred;
+		snd_queue_.consume(bytes_transferred);
 
-		size_t buffer_data = snd_buffer_end_ - snd_buffer_start_;
-
-		if (buffer_data != 0) {
-			socket_.async_write_some(boost::asio::buffer(snd_buffer_ + snd_buffer_start_, buffer_data), boost::bind(&peer_connection::handle_write, shared_from_this(),
-				boost::asio::placeholders::error,
-				boost::asio::placeholders::bytes_transferred));
+		if (!snd_queue_.empty()) {
+			write_next();
+		} else {
+			writing_ = false;
 		}
 	} else {
 		cout << "An error occurred: no bytes transferred" << endl;
@@ -157,127 +226,291 @@ void peer_connection::handle_read(const boost::system::error_code& error, size_t
 	if (bytes_transferred) {
 		rcv_buffer_end_ += bytes_transferred;
 
-		bool comsumed;
-		size_t buffer_data;
+		process_buffer();
+	} else {
+		cout << "An error occurred: no bytes transferred" << endl;
+		close();
+	}
+}
 
-		do {
-			comsumed = false;
-			buffer_data = rcv_buffer_end_ - rcv_buffer_start_;
+void peer_connection::process_buffer() {
+	bool comsumed;
+	size_t buffer_data;
+
+	do {
+		comsumed = false;
+		buffer_data = rcv_buffer_end_ - rcv_buffer_start_;
+
+		if (message_ == nullptr && buffer_data > 0 && frame_reader::is_frame(rcv_buffer_[rcv_buffer_start_])) {
+			// a binary frame, its fields are handed to the message at once
+			if (!binary_) {
+				// frames only after both sides agreed on them in HELLO
+				cout << "PEER#" << id_ << " sent a frame without binary framing" << endl;
+				close();
+				return;
+			}
 
-			if (message_ == nullptr || read_type_ == DDSN_MESSAGE_TYPE_STRING || read_type_ == DDSN_MESSAGE_TYPE_END) {
-				int end_line = -1;
+			UINT32 frame_type;
+			size_t fields_size, body_size;
+			bool header_read = false;
 
-				for (UINT32 i = rcv_buffer_start_; i < rcv_buffer_end_; i++) {
-					if (rcv_buffer_[i] == '\n') {
-						end_line = i;
-						break;
-					}
+			read_type_ = DDSN_MESSAGE_TYPE_FRAME;
+			read_bytes_ = DDSN_FRAME_HEADER_SIZE;
+
+			if (buffer_data >= DDSN_FRAME_HEADER_SIZE) {
+				if (!frame_reader::header(rcv_buffer_ + rcv_buffer_start_, frame_type, fields_size, body_size) || body_size > DDSN_MESSAGE_CHUNK_MAX_SIZE) {
+					close();
+					return;
 				}
 
-				if (end_line != -1) {
-					std::string line((CHAR *)(rcv_buffer_ + rcv_buffer_start_), end_line - rcv_buffer_start_);
-					rcv_buffer_start_ = end_line + 1;
+				header_read = true;
+				read_bytes_ = DDSN_FRAME_HEADER_SIZE + fields_size;
+			}
 
-					if (message_ == nullptr) {
-						message_ = peer_message::create_message(local_peer_, shared_from_this(), line);
+			if (header_read && read_bytes_ <= buffer_data) {
+				message_ = peer_message::create_message(local_peer_, shared_from_this(), frame_type);
+
+				if (message_ == nullptr) {
+					close();
+					return;
+				}
 
-						if (message_ == nullptr) {
-							close();
-							return;
-						} else {
-							cout << "PEER#" << id_ << " message: " << line << endl;
+				frame_reader frame(frame_type, rcv_buffer_ + rcv_buffer_start_ + DDSN_FRAME_HEADER_SIZE, fields_size, body_size);
+				rcv_buffer_start_ += read_bytes_;
 
-							message_->first_action(read_type_, read_bytes_);
-						}
-					} else {
-						message_->feed(line, read_type_, read_bytes_);
-					}
+				message_->feed(frame, read_type_, read_bytes_);
 
-					comsumed = true;
-				}
-			} else {
-				if (read_bytes_ <= buffer_data) {
-					int tmp = read_bytes_;
-					message_->feed(rcv_buffer_ + rcv_buffer_start_, read_bytes_, read_type_, read_bytes_);
-					rcv_buffer_start_ += tmp;
+				comsumed = true;
+			}
+		} else if (message_ == nullptr || read_type_ == DDSN_MESSAGE_TYPE_STRING || read_type_ == DDSN_MESSAGE_TYPE_END) {
+			int end_line = -1;
 
-					comsumed = true;
+			for (UINT32 i = rcv_buffer_start_; i < rcv_buffer_end_; i++) {
+				if (rcv_buffer_[i] == '\n') {
+					end_line = i;
+					break;
 				}
 			}
 
-			if (comsumed) {
-				if (read_type_ == DDSN_MESSAGE_TYPE_CLOSE || read_type_ == DDSN_MESSAGE_TYPE_ERROR) {
-					delete message_;
-					close();
-					return;
-				} else if (read_type_ == DDSN_MESSAGE_TYPE_END) {
-					delete message_;
-					message_ = nullptr;
-					read_type_ = DDSN_MESSAGE_TYPE_STRING;
+			if (end_line != -1) {
+				std::string line((CHAR *)(rcv_buffer_ + rcv_buffer_start_), end_line - rcv_buffer_start_);
+				rcv_buffer_start_ = end_line + 1;
+
+				if (message_ == nullptr) {
+					message_ = peer_message::create_message(local_peer_, shared_from_this(), line);
+
+					if (message_ == nullptr) {
+						close();
+						return;
+					} else {
+						cout << "PEER#" << id_ << " message: " << line << endl;
+
+						message_->first_action(read_type_, read_bytes_);
+					}
+				} else {
+					message_->feed(line, read_type_, read_bytes_);
 				}
+
+				comsumed = true;
+			}
+		} else {
+			if (read_bytes_ <= buffer_data) {
+				int tmp = read_bytes_;
+				message_->feed(rcv_buffer_ + rcv_buffer_start_, read_bytes_, read_type_, read_bytes_);
+				rcv_buffer_start_ += tmp;
+				partial_bytes_ = 0;
+
+				comsumed = true;
+			}
+		}
+
+		if (comsumed) {
+			if (read_type_ == DDSN_MESSAGE_TYPE_CLOSE || read_type_ == DDSN_MESSAGE_TYPE_ERROR) {
+				delete message_;
+				close();
+				return;
+			} else if (read_type_ == DDSN_MESSAGE_TYPE_END) {
+				delete message_;
+				message_ = nullptr;
+				read_type_ = DDSN_MESSAGE_TYPE_STRING;
+			} else if (read_type_ == DDSN_MESSAGE_TYPE_WAIT) {
+				// don't read on until the message resumes
+				return;
 			}
+		}
 
-		} while (comsumed);
+	} while (comsumed);
 
-		if (read_type_ == DDSN_MESSAGE_TYPE_BYTES && read_bytes_ > DDSN_MESSAGE_CHUNK_MAX_SIZE) {
+	if (read_type_ == DDSN_MESSAGE_TYPE_BYTES && read_bytes_ > DDSN_MESSAGE_CHUNK_MAX_SIZE) {
+		delete message_;
+		close();
+		return;
+	}
+
+	if (read_type_ == DDSN_MESSAGE_TYPE_BYTES && buffer_data > partial_bytes_) {
+		// let the message work on what's there while the rest arrives
+		if (!message_->feed_partial(rcv_buffer_ + rcv_buffer_start_ + partial_bytes_, buffer_data - partial_bytes_)) {
 			delete message_;
 			close();
 			return;
 		}
 
-		// if there's nothing left in the buffer to be processes, we can start using the buffer from the beginning
-		if (buffer_data == 0) {
+		partial_bytes_ = buffer_data;
+	}
+
+	// if there's nothing left in the buffer to be processes, we can start using the buffer from the beginning
+	if (buffer_data == 0) {
+		rcv_buffer_start_ = 0;
+		rcv_buffer_end_ = 0;
+	}
+
+	size_t buffer_space = rcv_buffer_size_ - rcv_buffer_end_;
+	size_t bytes_to_read = read_bytes_ - buffer_data;
+
+	if (buffer_space < 16 || ((read_type_ == DDSN_MESSAGE_TYPE_BYTES || read_type_ == DDSN_MESSAGE_TYPE_FRAME) && bytes_to_read > buffer_space)) {
+		// we deem the buffer too small
+		if (read_type_ == DDSN_MESSAGE_TYPE_STRING && rcv_buffer_start_ == 0 && buffer_space == 0) {
+			// double buffer space because string seems to be too long for current buffer
+			BYTE *new_buffer = new BYTE[rcv_buffer_size_ * 2];
+			memcpy(new_buffer, rcv_buffer_, rcv_buffer_size_);
+			delete[] rcv_buffer_;
+			rcv_buffer_ = new_buffer;
+
+			buffer_space = rcv_buffer_size_;
+			rcv_buffer_size_ = rcv_buffer_size_ * 2;
+
+			if (rcv_buffer_size_ > DDSN_MESSAGE_STRING_MAX_LENGTH) {
+				// string simply too long
+				close();
+				return;
+			}
+		} else if (read_type_ == DDSN_MESSAGE_TYPE_STRING || read_bytes_ <= rcv_buffer_size_) {
+			// shift to beginning to create space at the end (doesn't resize the buffer)
+			memmove(rcv_buffer_, rcv_buffer_ + rcv_buffer_start_, buffer_data);
+
+			rcv_buffer_start_ = 0;
+			rcv_buffer_end_ = buffer_data;
+			buffer_space = rcv_buffer_size_ - buffer_data;
+		} else {
+			// enlarge buffer space for expected bytes to next power of 2
+			rcv_buffer_size_ = next_power(read_bytes_);
+			BYTE *new_buffer = new BYTE[rcv_buffer_size_];
+			memcpy(new_buffer, rcv_buffer_ + rcv_buffer_start_, buffer_data);
+			delete[] rcv_buffer_;
+			rcv_buffer_ = new_buffer;
+
 			rcv_buffer_start_ = 0;
-			rcv_buffer_end_ = 0;
+			rcv_buffer_end_ = buffer_data;
+			buffer_space = rcv_buffer_size_ - buffer_data;
 		}
+	}
+
+	socket_.async_read_some(boost::asio::buffer(rcv_buffer_ + rcv_buffer_end_, buffer_space), boost::bind(&peer_connection::handle_read, shared_from_this(),
+		boost::asio::placeholders::error,
+		boost::asio::placeholders::bytes_transferred));
+}
 
-		size_t buffer_space = rcv_buffer_size_ - rcv_buffer_end_;
-		size_t bytes_to_read = read_bytes_ - buffer_data;
+void peer_connection::resume(UINT32 type, size_t expected_size) {
+	// the message may hold the last reference to the connection
+	pointer self = shared_from_this();
 
-		if (buffer_space < 16 || (read_type_ == DDSN_MESSAGE_TYPE_BYTES && bytes_to_read > buffer_space)) {
-			// we deem the buffer too small
-			if (read_type_ == DDSN_MESSAGE_TYPE_STRING && rcv_buffer_start_ == 0 && buffer_space == 0) {
-				// double buffer space because string seems to be too long for current buffer
-				BYTE *new_buffer = new BYTE[rcv_buffer_size_ * 2];
-				memcpy(new_buffer, rcv_buffer_, rcv_buffer_size_);
-				delete[] rcv_buffer_;
-				rcv_buffer_ = new_buffer;
+	read_type_ = type;
+	read_bytes_ = expected_size;
 
-				buffer_space = rcv_buffer_size_;
-				rcv_buffer_size_ = rcv_buffer_size_ * 2;
+	if (read_type_ == DDSN_MESSAGE_TYPE_CLOSE || read_type_ == DDSN_MESSAGE_TYPE_ERROR || !socket_.is_open()) {
+		delete message_;
+		message_ = nullptr;
 
-				if (rcv_buffer_size_ > DDSN_MESSAGE_STRING_MAX_LENGTH) {
-					// string simply too long
-					close();
-					return;
-				}
-			} else if (read_type_ == DDSN_MESSAGE_TYPE_STRING || bytes_to_read <= rcv_buffer_size_) {
-				// shift to beginning to create space at the end (doesn't resize the buffer)
-				memmove(rcv_buffer_, rcv_buffer_ + rcv_buffer_start_, buffer_data);
-
-				rcv_buffer_start_ = 0;
-				rcv_buffer_end_ = buffer_data;
-				buffer_space = rcv_buffer_size_ - buffer_data;
-			} else {
-				// enlarge buffer space for expected bytes to next power of 2
-				rcv_buffer_size_ = next_power(read_bytes_);
-				BYTE *new_buffer = new BYTE[rcv_buffer_size_];
-				memcpy(new_buffer, rcv_buffer_ + rcv_buffer_start_, buffer_data);
-				delete[] rcv_buffer_;
-				rcv_buffer_ = new_buffer;
-
-				rcv_buffer_start_ = 0;
-				rcv_buffer_end_ = buffer_data;
-				buffer_space = rcv_buffer_size_ - buffer_data;
-			}
+		if (socket_.is_open()) {
+			close();
 		}
 
-		socket_.async_read_some(boost::asio::buffer(rcv_buffer_ + rcv_buffer_end_, buffer_space), boost::bind(&peer_connection::handle_read, shared_from_this(),
-			boost::asio::placeholders::error,
-			boost::asio::placeholders::bytes_transferred));
-	} else {
-		cout << "An error occurred: no bytes transferred" << endl;
-		close();
+		return;
+	} else if (read_type_ == DDSN_MESSAGE_TYPE_END) {
+		delete message_;
+		message_ = nullptr;
+		read_type_ = DDSN_MESSAGE_TYPE_STRING;
+	}
+
+	process_buffer();
+}
+
+bool peer_connection::await_key(const BYTE hash[32], boost::function<void(public_key_pointer)> done) {
+	auto &wait = key_waits_[peer_id(hash)];
+	bool first = wait.waits.empty();
+
+	if (first) {
+		wait.asked = std::chrono::steady_clock::now();
+	}
+
+	wait.waits.push_back(done);
+	key_wait_count_++;
+
+	if (!key_timer_running_) {
+		key_timer_running_ = true;
+		key_timer_.expires_from_now(boost::posix_time::seconds(DDSN_KEY_WAIT_TIMEOUT));
+		key_timer_.async_wait(boost::bind(&peer_connection::expire_keys, shared_from_this(), boost::asio::placeholders::error));
+	}
+
+	return first;
+}
+
+bool peer_connection::awaits_key(const BYTE hash[32]) const {
+	return key_waits_.find(peer_id(hash)) != key_waits_.end();
+}
+
+size_t peer_connection::key_waits() const {
+	return key_wait_count_;
+}
+
+void peer_connection::key_arrived(const BYTE hash[32], public_key_pointer key) {
+	auto it = key_waits_.find(peer_id(hash));
+
+	if (it == key_waits_.end()) {
+		return;
+	}
+
+	std::list<boost::function<void(public_key_pointer)>> waits;
+	waits.swap(it->second.waits);
+	key_waits_.erase(it);
+	key_wait_count_ -= waits.size();
+
+	for (auto wait = waits.begin(); wait != waits.end(); ++wait) {
+		(*wait)(key);
+	}
+}
+
+void peer_connection::expire_keys(const boost::system::error_code& error) {
+	key_timer_running_ = false;
+
+	if (error || !socket_.is_open()) {
+		return;
+	}
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point next = now + std::chrono::seconds(DDSN_KEY_WAIT_TIMEOUT);
+	std::list<peer_id> expired;
+
+	for (auto it = key_waits_.begin(); it != key_waits_.end(); ++it) {
+		if (now - it->second.asked >= std::chrono::seconds(DDSN_KEY_WAIT_TIMEOUT)) {
+			expired.push_back(it->first);
+		} else if (it->second.asked + std::chrono::seconds(DDSN_KEY_WAIT_TIMEOUT) < next) {
+			next = it->second.asked + std::chrono::seconds(DDSN_KEY_WAIT_TIMEOUT);
+		}
+	}
+
+	for (auto it = expired.begin(); it != expired.end(); ++it) {
+		cout << "PEER#" << id_ << " didn't send key " << it->short_string() << endl;
+
+		BYTE hash[32];
+		memcpy(hash, it->id(), 32);
+		key_arrived(hash, nullptr);
+	}
+
+	if (!key_waits_.empty() && !key_timer_running_) {
+		key_timer_running_ = true;
+		key_timer_.expires_from_now(boost::posix_time::milliseconds(std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count() + 1));
+		key_timer_.async_wait(boost::bind(&peer_connection::expire_keys, shared_from_this(), boost::asio::placeholders::error));
 	}
 }
 
@@ -285,4 +518,12 @@ void peer_connection::close() {
 	foreign_peer_->set_connection(nullptr);
 	cout << "PEER#" << id_ << " CLOSE" << endl;
 	socket_.close();
+	key_timer_.cancel();
+
+	// the keys won't come anymore
+	while (!key_waits_.empty()) {
+		BYTE hash[32];
+		memcpy(hash, key_waits_.begin()->first.id(), 32);
+		key_arrived(hash, nullptr);
+	}
 }
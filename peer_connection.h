@@ -1,12 +1,19 @@
 #ifndef DDSN_PEER_CONNECTION_H
 #define DDSN_PEER_CONNECTION_H
 
+#include "buffer.h"
 #include "definitions.h"
 #include "local_peer.h"
 #include "foreign_peer.h"
+#include "keys.h"
+#include "peer_id.h"
 
 #include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <chrono>
+#include <list>
 #include <memory>
+#include <unordered_map>
 
 namespace ddsn {
 
@@ -26,22 +33,75 @@ public:
 	std::shared_ptr<ddsn::foreign_peer> foreign_peer();
 	bool introduced() const;
 	bool got_welcome() const;
+	// whether block data may be sent deflated (see HELLO)
+	bool deflate() const;
+	// whether the peer verifies signatures of the DDSN_SIGNATURE_* type (see HELLO)
+	bool accepts_signature(int signature_type) const;
+	// whether blocks name their owner by hash instead of carrying the key (see HELLO)
+	bool key_reference() const;
+	// whether the peer takes blocks signed over a Merkle root (see HELLO)
+	bool merkle() const;
+	// random nonce sent with our HELLO, the peer proves its identity by signing it
+	const BYTE *nonce() const;
+	// whether the peer signs our nonce instead of a PROVE IDENTITY challenge
+	bool nonce_handshake() const;
+	// X25519 key sent with our HELLO for agreeing on a session ticket, and the
+	// peer's (nullptr if either is missing)
+	EVP_PKEY *exchange_key() const;
+	const BYTE *exchange_public_key() const;
+	const BYTE *peer_exchange_key() const;
+	// whether our HELLO named a ticket, so the peer may resume with it
+	bool ticket_offered() const;
+	// whether block messages go out as binary frames (see HELLO and frame.h)
+	bool binary() const;
 
 	void set_foreign_peer(std::shared_ptr<ddsn::foreign_peer> foreign_peer);
 	void set_introduced(bool introduced);
 	void set_got_welcome(bool got_welcome);
+	void set_deflate(bool deflate);
+	// bit 1 << DDSN_SIGNATURE_* for each type, only RSA until the peer names others
+	void set_signature_types(UINT32 signature_types);
+	void set_key_reference(bool key_reference);
+	void set_merkle(bool merkle);
+	void set_nonce_handshake(bool nonce_handshake);
+	void set_peer_exchange_key(const BYTE peer_exchange_key[32]);
+	void set_ticket_offered(bool ticket_offered);
+	void set_binary(bool binary);
 
 	boost::asio::ip::tcp::socket& socket();
 	UINT32 id();
 	void start();
 
+	// continue after the current message returned DDSN_MESSAGE_TYPE_WAIT
+	// type and expected_size are what the message's feed would have returned
+	void resume(UINT32 type, size_t expected_size);
+
+	// wait for an owner key the peer was asked for with GET KEY
+	// returns true for the first wait for the key, which has to send GET KEY
+	// waits end with nullptr if the key doesn't come within DDSN_KEY_WAIT_TIMEOUT
+	bool await_key(const BYTE hash[32], boost::function<void(public_key_pointer)> done);
+	bool awaits_key(const BYTE hash[32]) const;
+	// number of waits, a peer leaving more than DDSN_KEY_WAITS_MAX is dropped
+	size_t key_waits() const;
+	// call the waits for the key, which is nullptr if the peer didn't have it
+	// (the waits get nullptr too when the connection closes)
+	void key_arrived(const BYTE hash[32], public_key_pointer key);
+
 	void close();
 private:
 	void send(const std::string &string);
 	void send(const BYTE *bytes, size_t size);
+	// queues the buffer itself, its bytes aren't copied unless it's small
+	void send(const shared_buffer &buffer);
+
+	void write_next();
 
 	void handle_read(const boost::system::error_code& error, std::size_t bytes_transferred);
+	// feed the messages what has been received and read more
+	void process_buffer();
 	void handle_write(const boost::system::error_code& error, std::size_t bytes_transferred);
+	// end the waits for keys asked for longer than DDSN_KEY_WAIT_TIMEOUT ago
+	void expire_keys(const boost::system::error_code& error);
 
 	local_peer &local_peer_;
 	std::shared_ptr<ddsn::foreign_peer> foreign_peer_;
@@ -53,20 +113,43 @@ private:
 	size_t rcv_buffer_end_;
 	size_t rcv_buffer_size_;
 
-	BYTE *snd_buffer_;
-	size_t snd_buffer_start_;
-	size_t snd_buffer_end_;
-	size_t snd_buffer_size_;
+	send_queue snd_queue_;
+	// a write is running or about to start
+	bool writing_;
 
 	peer_message *message_;
 
 	UINT32 read_type_;
 	size_t read_bytes_;
+	// bytes of the expected byte array already passed to feed_partial
+	size_t partial_bytes_;
 
 	UINT32 id_;
 
 	bool introduced_;
 	bool got_welcome_;
+	bool deflate_;
+	UINT32 signature_types_;
+	bool key_reference_;
+	bool merkle_;
+	BYTE nonce_[32];
+	bool nonce_handshake_;
+	EVP_PKEY *exchange_key_;
+	BYTE exchange_public_key_[32];
+	BYTE peer_exchange_key_[32];
+	bool peer_exchange_key_set_;
+	bool ticket_offered_;
+	bool binary_;
+
+	struct key_wait {
+		std::chrono::steady_clock::time_point asked;
+		std::list<boost::function<void(public_key_pointer)>> waits;
+	};
+
+	std::unordered_map<peer_id, key_wait> key_waits_;
+	size_t key_wait_count_;
+	boost::asio::deadline_timer key_timer_;
+	bool key_timer_running_;
 
 	friend class ddsn::peer_message;
 };
@@ -9,10 +9,10 @@ using namespace ddsn;
 using namespace std;
 
 peer_id::peer_id() {
-
+	memset(id_, 0, 32);
 }
 
-peer_id::peer_id(BYTE id[32]) {
+peer_id::peer_id(const BYTE id[32]) {
 	memcpy(id_, id, 32);
 }
 
@@ -24,7 +24,7 @@ const BYTE *peer_id::id() const {
 	return id_;
 }
 
-void peer_id::set_id(BYTE id[32]) {
+void peer_id::set_id(const BYTE id[32]) {
 	memcpy(id_, id, 32);
 }
 
@@ -10,12 +10,12 @@ namespace ddsn {
 class peer_id {
 public:
 	peer_id();
-	peer_id(BYTE id[32]);
+	peer_id(const BYTE id[32]);
 	~peer_id();
 
 	const BYTE *id() const;
 
-	void set_id(BYTE id[32]);
+	void set_id(const BYTE id[32]);
 
 	peer_id &operator=(const peer_id &peer_id);
 	bool operator==(const peer_id &peer_id) const;
@@ -4,10 +4,9 @@
 #include "definitions.h"
 #include "utilities.h"
 
-#include <openssl/rsa.h>
-#include <openssl/pem.h>
 #include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <openssl/crypto.h>
 #include <cstring>
 
 using namespace ddsn;
@@ -20,6 +19,8 @@ peer_message *peer_message::create_message(local_peer &local_peer, peer_connecti
 		return new peer_prove_identity(local_peer, connection);
 	} else if (first_line == "VERIFY IDENTITY") {
 		return new peer_verify_identity(local_peer, connection);
+	} else if (first_line == "RESUME IDENTITY") {
+		return new peer_resume_identity(local_peer, connection);
 	} else if (first_line == "WELCOME") {
 		return new peer_welcome(local_peer, connection);
 	} else if (first_line == "SET CODE") {
@@ -40,12 +41,30 @@ peer_message *peer_message::create_message(local_peer &local_peer, peer_connecti
 		return new peer_stored_block(local_peer, connection);
 	} else if (first_line == "DELIVER BLOCK") {
 		return new peer_deliver_block(local_peer, connection);
+	} else if (first_line == "GET KEY") {
+		return new peer_get_key(local_peer, connection);
+	} else if (first_line == "KEY") {
+		return new peer_key(local_peer, connection);
+	}
+	return nullptr;
+}
+
+peer_message *peer_message::create_message(local_peer &local_peer, peer_connection::pointer connection, UINT32 frame_type) {
+	switch (frame_type) {
+	case DDSN_FRAME_STORE_BLOCK:
+		return new peer_store_block(local_peer, connection);
+	case DDSN_FRAME_LOAD_BLOCK:
+		return new peer_load_block(local_peer, connection);
+	case DDSN_FRAME_STORED_BLOCK:
+		return new peer_stored_block(local_peer, connection);
+	case DDSN_FRAME_DELIVER_BLOCK:
+		return new peer_deliver_block(local_peer, connection);
 	}
 	return nullptr;
 }
 
 peer_message::peer_message(local_peer &local_peer, peer_connection::pointer connection) :
-local_peer_(local_peer), connection_(connection) {
+local_peer_(local_peer), connection_(connection), detached_(false) {
 
 }
 
@@ -53,6 +72,15 @@ peer_message::~peer_message() {
 
 }
 
+bool peer_message::feed_partial(const BYTE *data, size_t size) {
+	return true;
+}
+
+void peer_message::feed(frame_reader &frame, UINT32 &type, size_t &expected_size) {
+	// only the block messages have a binary form
+	type = DDSN_MESSAGE_TYPE_ERROR;
+}
+
 void peer_message::send(const std::string &string) {
 	connection_->send(string);
 }
@@ -61,6 +89,89 @@ void peer_message::send(const BYTE *bytes, size_t size) {
 	connection_->send(bytes, size);
 }
 
+void peer_message::send(const shared_buffer &buffer) {
+	connection_->send(buffer);
+}
+
+static void crypto_job_done(local_peer *local_peer, boost::function<void(bool)> done, bool result) {
+	// the pool has room again
+	local_peer->crypto_finished();
+
+	done(result);
+}
+
+static void run_crypto_job(local_peer *local_peer, boost::function<bool()> job, boost::function<void(bool)> done) {
+	bool result = job();
+	local_peer->io_service().post(boost::bind(&crypto_job_done, local_peer, done, result));
+}
+
+void peer_message::run_crypto(boost::function<bool()> job, boost::function<void(bool)> done) {
+	local_peer_.post_crypto(boost::bind(&run_crypto_job, &local_peer_, job, done));
+}
+
+static void keep_key(std::shared_ptr<public_key_pointer> kept, public_key_pointer key) {
+	*kept = key;
+}
+
+void peer_message::fetch_key(const BYTE hash[32], std::shared_ptr<public_key_pointer> kept) {
+	if (key_registry::get(hash) != nullptr || connection_->key_waits() >= DDSN_KEY_WAITS_MAX) {
+		return;
+	}
+
+	if (connection_->await_key(hash, boost::bind(&keep_key, kept, _1))) {
+		peer_get_key(local_peer_, connection_, hash).send();
+	}
+}
+
+void peer_message::finish(UINT32 type) {
+	if (!detached_) {
+		connection_->resume(type, 0);
+		return;
+	}
+
+	if (type == DDSN_MESSAGE_TYPE_ERROR && connection_->socket().is_open()) {
+		connection_->close();
+	}
+
+	delete this;
+}
+
+shared_buffer peer_message::block_payload(const block &block, string &fields) {
+	if (connection_->deflate() && !block.deflated().empty()) {
+		fields = "Encoding: deflate\n"
+			"Encoded-size: " + boost::lexical_cast<string>(block.deflated().size()) + "\n";
+
+		return block.deflated();
+	}
+
+	fields = "";
+
+	return block.data_buffer();
+}
+
+void peer_message::add_block_fields(frame_writer &frame, const block &block, const shared_buffer &payload, bool encoded) {
+	frame.add_code(DDSN_FIELD_CODE, block.code());
+	frame.add(DDSN_FIELD_NAME, block.name());
+	frame.add_number(DDSN_FIELD_OCCURRENCE, block.occurrence());
+	frame.add_number(DDSN_FIELD_SIZE, block.size());
+	frame.add_number(DDSN_FIELD_SIGNATURE_TYPE, block.signature_type());
+	frame.add(DDSN_FIELD_SIGNATURE, block.signature(), block.signature_size());
+
+	if (connection_->key_reference()) {
+		frame.add(DDSN_FIELD_OWNER, block.owner_hash(), 32);
+	} else {
+		frame.add(DDSN_FIELD_OWNER_KEY, block.owner()->der());
+	}
+
+	if (encoded) {
+		frame.add_number(DDSN_FIELD_ENCODED_SIZE, payload.size());
+	}
+
+	if (block.merkle()) {
+		frame.add(DDSN_FIELD_LEAF_HASHES, block.leaf_hashes().data(), block.leaf_hashes().size());
+	}
+}
+
 // HELLO
 
 /* 
@@ -74,17 +185,22 @@ void peer_message::send(const BYTE *bytes, size_t size) {
  * Say hello to a new peer. Either queue up for getting part of the network (type == 'queued')
  * or otherwise tell your intention later (type != 'queued')
  * == Receiving perspective ==
- * As a response the connecting peer is requested to prove its identity by
- * delivering a message which has to be signed by the connecting peer. (see @peer_prove_identity)
+ * The hello carries a random nonce. Unless it did so already, the receiving
+ * peer says hello with its own nonce right away and signs the nonce it got
+ * (see @peer_verify_identity), so both peers prove their identity at the
+ * same time in one round trip.
+ * Peers that verified each other before name the secret they agreed on then
+ * (a session ticket) and prove their identity with it. (see @peer_resume_identity)
+ * Peers that don't send a nonce are asked to sign a message instead. (see @peer_prove_identity)
  */
 
 peer_hello::peer_hello(local_peer &local_peer, peer_connection::pointer connection) :
-peer_message(local_peer, connection), state_(0) {
+peer_message(local_peer, connection), state_(0), nonce_set_(false), ticket_set_(false) {
 
 }
 
 peer_hello::peer_hello(local_peer &local_peer, peer_connection::pointer connection, string type) :
-peer_message(local_peer, connection), type_(type), state_(0) {
+peer_message(local_peer, connection), type_(type), state_(0), nonce_set_(false), ticket_set_(false) {
 
 }
 
@@ -124,7 +240,7 @@ void peer_hello::feed(const std::string &line, UINT32 &type, size_t &expected_si
 					auto it = local_peer_.foreign_peers().find(foreign_id);
 					if (it != local_peer_.foreign_peers().end()) {
 						// already know you!
-						if (it->second->connected()) {
+						if (it->second->connected() && it->second->connection() != connection_) {
 							// and I'm already connected to you!
 							type = DDSN_MESSAGE_TYPE_ERROR;
 							return;
@@ -150,6 +266,65 @@ void peer_hello::feed(const std::string &line, UINT32 &type, size_t &expected_si
 					type = DDSN_MESSAGE_TYPE_ERROR;
 					return;
 				}
+			} else if (field_name == "Signatures") {
+				// the signature types the peer verifies, e.g. "rsa, ed25519"
+				UINT32 signature_types = 0;
+				size_t start = 0;
+
+				while (start <= field_value.length()) {
+					size_t end = field_value.find(", ", start);
+					int signature_type = ddsn::signature_type(field_value.substr(start, end == string::npos ? string::npos : end - start));
+
+					if (signature_type != -1) {
+						signature_types |= 1 << signature_type;
+					}
+
+					if (end == string::npos) {
+						break;
+					}
+
+					start = end + 2;
+				}
+
+				connection_->set_signature_types(signature_types);
+			} else if (field_name == "Keys") {
+				// blocks only name their owner if both sides can fetch keys with GET KEY
+				connection_->set_key_reference(field_value == "reference");
+			} else if (field_name == "Nonce") {
+				if (field_value.length() != 64) {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
+
+				hex_to_bytes(field_value, nonce_, 32);
+				nonce_set_ = true;
+			} else if (field_name == "Exchange") {
+				// X25519 key to agree on a session ticket
+				if (field_value.length() != 64) {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
+
+				BYTE exchange_key[32];
+				hex_to_bytes(field_value, exchange_key, 32);
+				connection_->set_peer_exchange_key(exchange_key);
+			} else if (field_name == "Ticket") {
+				if (field_value.length() != 64) {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
+
+				hex_to_bytes(field_value, ticket_id_, 32);
+				ticket_set_ = true;
+			} else if (field_name == "Hashes") {
+				// blocks may be signed over a Merkle root if the peer checks those
+				connection_->set_merkle(field_value == "merkle");
+			} else if (field_name == "Framing") {
+				// the block messages may come as binary frames (see frame.h)
+				connection_->set_binary(field_value == "binary");
+			} else if (field_name == "Compression") {
+				// we only send deflated blocks if both sides offer it
+				connection_->set_deflate(local_peer_.deflate() && field_value == "deflate");
 			} else if (field_name == "Type") {
 				if (field_value == "queued") {
 					connection_->foreign_peer()->set_queued(true);
@@ -160,47 +335,89 @@ void peer_hello::feed(const std::string &line, UINT32 &type, size_t &expected_si
 			}
 		}
 	} else if (state_ == 1) {
-		if (line != "-----BEGIN RSA PUBLIC KEY-----") {
+		// RSA keys come as "RSA PUBLIC KEY", Ed25519 keys as "PUBLIC KEY"
+		if (line != "-----BEGIN RSA PUBLIC KEY-----" && line != "-----BEGIN PUBLIC KEY-----") {
 			public_key_ += line + "\n";
 
 			type = DDSN_MESSAGE_TYPE_ERROR;
 			return;
 		} else {
-			public_key_ = "-----BEGIN RSA PUBLIC KEY-----\n";
+			public_key_ = line + "\n";
 
 			state_ = 2;
 			type = DDSN_MESSAGE_TYPE_STRING;
 		}
 	} else if (state_ == 2) {
-		if (line == "-----END RSA PUBLIC KEY-----") {
-			public_key_ += "-----END RSA PUBLIC KEY-----\n";
+		if (line == "-----END RSA PUBLIC KEY-----" || line == "-----END PUBLIC KEY-----") {
+			public_key_ += line + "\n";
 
 			connection_->foreign_peer()->set_public_key_str(public_key_);
 
-			// check if this matches the id
+			if (connection_->foreign_peer()->public_key() == nullptr) {
+				cout << "Peer sent an unsupported key" << endl;
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
 
-			BYTE hash[32];
-			hash_from_rsa(connection_->foreign_peer()->public_key(), hash);
+			// check if this matches the id
 
-			if (memcmp(hash, connection_->foreign_peer()->id().id(), 32) != 0) {
+			if (memcmp(connection_->foreign_peer()->public_key()->hash(), connection_->foreign_peer()->id().id(), 32) != 0) {
 				cout << "Peer appears to be a fraud" << endl;
 				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
 			}
 
-			connection_->foreign_peer()->set_verification_number(rand()); // TODO: make it random
-
-			cout << "PEER#" << connection_->id() << " random number: " << connection_->foreign_peer()->verification_number() << endl;
-
 			if (connection_->foreign_peer()->host() == "" || connection_->foreign_peer()->port() == -1) {
 				type = DDSN_MESSAGE_TYPE_ERROR;
 				return;
-			} else {
+			}
+
+			if (!nonce_set_) {
+				connection_->foreign_peer()->set_verification_number(rand()); // TODO: make it random
+
+				cout << "PEER#" << connection_->id() << " random number: " << connection_->foreign_peer()->verification_number() << endl;
+
 				peer_prove_identity(local_peer_, connection_).send();
 
 				type = DDSN_MESSAGE_TYPE_END;
+				return;
 			}
 
-			type = DDSN_MESSAGE_TYPE_END;
+			connection_->set_nonce_handshake(true);
+
+			// our nonce goes out before our signature, the peer needs nothing else from us
+
+			if (!connection_->introduced()) {
+				peer_hello(local_peer_, connection_, "?").send();
+				connection_->set_introduced(true);
+			}
+
+			// both of us hold the same ticket, resume without public key operations
+
+			BYTE secret[32];
+			BYTE ticket_id[32];
+
+			if (ticket_set_ && local_peer_.tickets().get(connection_->foreign_peer()->id(), secret)) {
+				ticket_cache::ticket_id(secret, ticket_id);
+
+				if (memcmp(ticket_id, ticket_id_, 32) == 0) {
+					string mac_message = peer_verify_identity::nonce_message(nonce_, connection_->foreign_peer()->id(), nullptr, nullptr);
+
+					BYTE mac[32];
+					sha256::hmac(secret, 32, mac_message.c_str(), mac_message.length(), mac);
+
+					peer_resume_identity(local_peer_, connection_, mac).send();
+
+					type = DDSN_MESSAGE_TYPE_END;
+					return;
+				}
+			}
+
+			string sign_message = peer_verify_identity::nonce_message(nonce_, connection_->foreign_peer()->id(), connection_->exchange_public_key(), connection_->peer_exchange_key());
+
+			run_crypto(boost::bind(&peer_verify_identity::sign, local_peer_.keypair()->key(), sign_message, signature_), boost::bind(&peer_hello::signed_nonce, this, _1));
+
+			type = DDSN_MESSAGE_TYPE_WAIT;
 		} else {
 			public_key_ += line + "\n";
 
@@ -213,32 +430,48 @@ void peer_hello::feed(const BYTE *data, size_t size, UINT32 &type, size_t &expec
 
 }
 
-void peer_hello::send() {
-	peer_message::send("HELLO\n"
-		"Id: " + bytes_to_hex(local_peer_.id().id(), 32) + "\n"
-		"Host: " + local_peer_.host() + "\n"
-		"Port: " + boost::lexical_cast<string>(local_peer_.port()) + "\n"
-		"Type: " + type_ + "\n"
-		"\n");
+void peer_hello::signed_nonce(bool success) {
+	if (success) {
+		peer_verify_identity(local_peer_, connection_, signature_).send();
+	}
 
-	// send public key in pem format
+	finish(success ? DDSN_MESSAGE_TYPE_END : DDSN_MESSAGE_TYPE_ERROR);
+}
 
-	BIO *pub = BIO_new(BIO_s_mem());
+void peer_hello::send() {
+	string exchange = connection_->exchange_public_key() != nullptr ? "Exchange: " + bytes_to_hex(connection_->exchange_public_key(), 32) + "\n" : "";
+	string ticket;
 
-	PEM_write_bio_RSAPublicKey(pub, local_peer_.keypair());
+	// offer the ticket we hold for the peer, if we know who it is already
 
-	size_t pub_len = BIO_pending(pub);
+	BYTE secret[32];
 
-	BYTE *pub_key = new BYTE[pub_len];
+	if (connection_->foreign_peer() && local_peer_.tickets().get(connection_->foreign_peer()->id(), secret)) {
+		BYTE ticket_id[32];
+		ticket_cache::ticket_id(secret, ticket_id);
 
-	BIO_read(pub, pub_key, pub_len);
+		ticket = "Ticket: " + bytes_to_hex(ticket_id, 32) + "\n";
+		connection_->set_ticket_offered(true);
+	}
 
-	BIO_free(pub);
+	peer_message::send("HELLO\n"
+		"Id: " + bytes_to_hex(local_peer_.id().id(), 32) + "\n"
+		"Nonce: " + bytes_to_hex(connection_->nonce(), 32) + "\n" +
+		exchange +
+		ticket +
+		"Host: " + local_peer_.host() + "\n"
+		"Port: " + boost::lexical_cast<string>(local_peer_.port()) + "\n"
+		"Type: " + type_ + "\n" +
+		(local_peer_.deflate() ? "Compression: deflate\n" : "") +
+		"Signatures: rsa, ed25519\n"
+		"Keys: reference\n"
+		"Hashes: merkle\n"
+		"Framing: binary\n"
+		"\n");
 
-	// actually a string, but we can use byte verion of send
-	peer_message::send(pub_key, pub_len);
+	// send public key in pem format
 
-	delete[] pub_key;
+	peer_message::send(local_peer_.keypair()->pem());
 }
 
 // PROVE IDENTITY
@@ -265,10 +498,9 @@ void peer_prove_identity::first_action(UINT32 &type, size_t &expected_size) {
 
 void peer_prove_identity::feed(const std::string &line, UINT32 &type, size_t &expected_size) {
 	if (line == "") {
-		peer_verify_identity message(local_peer_, connection_, message_);
-		message.send();
+		run_crypto(boost::bind(&peer_prove_identity::sign, this), boost::bind(&peer_prove_identity::signed_message, this, _1));
 
-		type = DDSN_MESSAGE_TYPE_END;
+		type = DDSN_MESSAGE_TYPE_WAIT;
 	} else {
 		message_ += line;
 
@@ -279,6 +511,18 @@ void peer_prove_identity::feed(const std::string &line, UINT32 &type, size_t &ex
 void peer_prove_identity::feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size) {
 }
 
+bool peer_prove_identity::sign() {
+	return peer_verify_identity::sign(local_peer_.keypair()->key(), message_, signature_);
+}
+
+void peer_prove_identity::signed_message(bool success) {
+	if (success) {
+		peer_verify_identity(local_peer_, connection_, signature_).send();
+	}
+
+	finish(success ? DDSN_MESSAGE_TYPE_END : DDSN_MESSAGE_TYPE_ERROR);
+}
+
 void peer_prove_identity::send() {
 	string sign_message = "Sign this random number: " + boost::lexical_cast<std::string>(connection_->foreign_peer()->verification_number());
 
@@ -289,17 +533,58 @@ void peer_prove_identity::send() {
 // VERIFY IDENTITY
 
 /*
- * 
+ * == Sending perspective ==
+ * The signature of the nonce from the peer's HELLO, or of the message from its
+ * PROVE IDENTITY. The nonce is signed together with the peer's id, so it can't
+ * be passed on to prove an identity to someone else.
+ * == Receiving perspective ==
+ * Checks the signature with the key from the peer's HELLO and welcomes the peer.
  */
 
-peer_verify_identity::peer_verify_identity(local_peer &local_peer, peer_connection::pointer connection) :
-peer_message(local_peer, connection) {
+bool peer_verify_identity::sign(EVP_PKEY *key, const string &message, BYTE signature[DDSN_SIGNATURE_MAX_SIZE]) {
+	BYTE message_hash[32];
+
+	sha256::hash(message.c_str(), message.length(), message_hash);
+
+	return sign_hash(key, message_hash, signature);
+}
+
+string peer_verify_identity::nonce_message(const BYTE nonce[32], const peer_id &verifier, const BYTE *prover_exchange_key, const BYTE *verifier_exchange_key) {
+	string message = "Sign this nonce: " + bytes_to_hex(nonce, 32) + " for " + bytes_to_hex(verifier.id(), 32);
+
+	// signing the keys keeps anyone in between from swapping them
+	if (prover_exchange_key != nullptr && verifier_exchange_key != nullptr) {
+		message += " with " + bytes_to_hex(prover_exchange_key, 32) + " and " + bytes_to_hex(verifier_exchange_key, 32);
+	}
+
+	return message;
+}
+
+void peer_verify_identity::welcome(local_peer &local_peer, peer_connection::pointer connection) {
+	connection->foreign_peer()->set_identity_verified(true);
+
+	cout << "PEER#" << connection->id() << " peer " << connection->foreign_peer()->id().short_string() << " is now verified" << endl;
 
+	if (connection->got_welcome()) {
+		local_peer.add_foreign_peer(connection->foreign_peer());
+	}
+
+	peer_welcome(local_peer, connection).send();
+
+	if (!connection->introduced()) {
+		peer_hello(local_peer, connection, "?").send();
+		connection->set_introduced(true);
+	}
 }
 
-peer_verify_identity::peer_verify_identity(local_peer &local_peer, peer_connection::pointer connection, const std::string &message) :
-peer_message(local_peer, connection), message_(message) {
+peer_verify_identity::peer_verify_identity(local_peer &local_peer, peer_connection::pointer connection) :
+peer_message(local_peer, connection), signature_size_(0), ticket_agreed_(false) {
+
+}
 
+peer_verify_identity::peer_verify_identity(local_peer &local_peer, peer_connection::pointer connection, const BYTE signature[DDSN_SIGNATURE_MAX_SIZE]) :
+peer_message(local_peer, connection), signature_size_(signature_size(local_peer.keypair()->signature_type())), ticket_agreed_(false) {
+	memcpy(signature_, signature, signature_size_);
 }
 
 peer_verify_identity::~peer_verify_identity() {
@@ -307,66 +592,151 @@ peer_verify_identity::~peer_verify_identity() {
 }
 
 void peer_verify_identity::first_action(UINT32 &type, size_t &expected_size) {
+	// the size depends on the key the peer sent with HELLO
+	public_key_pointer key = connection_->foreign_peer()->public_key();
+
+	if (key == nullptr) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	signature_size_ = signature_size(key->signature_type());
+
+	if (signature_size_ == 0) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
 	type = DDSN_MESSAGE_TYPE_BYTES;
-	expected_size = 256;
+	expected_size = signature_size_;
 }
 
 void peer_verify_identity::feed(const std::string &line, UINT32 &type, size_t &expected_size) {
 }
 
 void peer_verify_identity::feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size) {
-	string sign_message = "Sign this random number: " + boost::lexical_cast<std::string>(connection_->foreign_peer()->verification_number());
-	
-	BYTE message_hash[32];
+	string sign_message;
 
-	SHA256_CTX sha256;
-	SHA256_Init(&sha256);
-	SHA256_Update(&sha256, sign_message.c_str(), sign_message.length());
-	SHA256_Final(message_hash, &sha256);
+	if (connection_->nonce_handshake()) {
+		sign_message = nonce_message(connection_->nonce(), local_peer_.id(), connection_->peer_exchange_key(), connection_->exchange_public_key());
+	} else {
+		sign_message = "Sign this random number: " + boost::lexical_cast<std::string>(connection_->foreign_peer()->verification_number());
+	}
 
-	int ret = RSA_verify(NID_sha256, message_hash, 32,
-		(BYTE *)data, 256, connection_->foreign_peer()->public_key());
+	memcpy(signature_, data, signature_size_);
 
-	if (ret == 1) { // successful
-		connection_->foreign_peer()->set_identity_verified(true);
+	run_crypto(boost::bind(&peer_verify_identity::verify, this, connection_->foreign_peer()->public_key(), sign_message), boost::bind(&peer_verify_identity::verified, this, _1));
 
-		cout << "PEER#" << connection_->id() << " peer " << connection_->foreign_peer()->id().short_string() << " is now verified" << endl;
+	type = DDSN_MESSAGE_TYPE_WAIT;
+}
 
-		if (connection_->got_welcome()) {
-			local_peer_.add_foreign_peer(connection_->foreign_peer());
-		}
+bool peer_verify_identity::verify(public_key_pointer key, const string &sign_message) {
+	BYTE message_hash[32];
 
-		peer_welcome(local_peer_, connection_).send();
+	sha256::hash(sign_message.c_str(), sign_message.length(), message_hash);
 
-		if (!connection_->introduced()) {
-			peer_hello(local_peer_, connection_, "?").send();
-			connection_->set_introduced(true);
+	if (!verify_hash(key->key(), message_hash, signature_, signature_size_)) {
+		return false;
+	}
+
+	// the exchange keys were signed, so the secret is shared with this peer only
+	if (connection_->nonce_handshake() && connection_->exchange_key() != nullptr && connection_->peer_exchange_key() != nullptr) {
+		ticket_agreed_ = ticket_cache::agree(connection_->exchange_key(), connection_->exchange_public_key(), connection_->peer_exchange_key(), ticket_secret_);
+	}
+
+	return true;
+}
+
+void peer_verify_identity::verified(bool success) {
+	if (success) {
+		if (ticket_agreed_) {
+			local_peer_.tickets().put(connection_->foreign_peer()->id(), ticket_secret_);
 		}
 
-		type = DDSN_MESSAGE_TYPE_END;
+		welcome(local_peer_, connection_);
+
+		finish(DDSN_MESSAGE_TYPE_END);
 	} else {
 		cout << "PEER#" << connection_->id() << " peer claiming to be " << connection_->foreign_peer()->id().short_string() << " gave an invalid signature" << endl;
-		type = DDSN_MESSAGE_TYPE_ERROR;
+		finish(DDSN_MESSAGE_TYPE_ERROR);
 	}
 }
 
 void peer_verify_identity::send() {
-	BYTE *sigret = new BYTE[RSA_size(local_peer_.keypair())];
-	UINT32 siglen;
+	peer_message::send("VERIFY IDENTITY\n");
+	peer_message::send(signature_, signature_size_);
+}
 
-	BYTE message_hash[32];
+// RESUME IDENTITY
+
+/*
+ * == Sending perspective ==
+ * Instead of VERIFY IDENTITY, if the peer's HELLO named the session ticket we
+ * hold for it: the HMAC of its nonce and id, keyed with the ticket's secret.
+ * == Receiving perspective ==
+ * Checks the HMAC with our secret and welcomes the peer. Drops the ticket if
+ * it doesn't match, the next connection verifies signatures again.
+ */
 
-	SHA256_CTX sha256;
-	SHA256_Init(&sha256);
-	SHA256_Update(&sha256, message_.c_str(), message_.length());
-	SHA256_Final(message_hash, &sha256);
+peer_resume_identity::peer_resume_identity(local_peer &local_peer, peer_connection::pointer connection) :
+peer_message(local_peer, connection) {
 
-	RSA_sign(NID_sha256, message_hash, 32, sigret, &siglen, local_peer_.keypair());
+}
 
-	peer_message::send("VERIFY IDENTITY\n");
-	peer_message::send(sigret, 256);
+peer_resume_identity::peer_resume_identity(local_peer &local_peer, peer_connection::pointer connection, const BYTE mac[32]) :
+peer_message(local_peer, connection) {
+	memcpy(mac_, mac, 32);
+}
+
+peer_resume_identity::~peer_resume_identity() {
+
+}
+
+void peer_resume_identity::first_action(UINT32 &type, size_t &expected_size) {
+	// only if we offered a ticket with HELLO and the peer answered our nonce
+	if (!connection_->ticket_offered() || !connection_->nonce_handshake()) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	type = DDSN_MESSAGE_TYPE_BYTES;
+	expected_size = 32;
+}
+
+void peer_resume_identity::feed(const std::string &line, UINT32 &type, size_t &expected_size) {
+}
+
+void peer_resume_identity::feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size) {
+	const peer_id &id = connection_->foreign_peer()->id();
+	BYTE secret[32];
+
+	if (!local_peer_.tickets().get(id, secret)) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	string mac_message = peer_verify_identity::nonce_message(connection_->nonce(), local_peer_.id(), nullptr, nullptr);
 
-	delete[] sigret;
+	BYTE mac[32];
+	sha256::hmac(secret, 32, mac_message.c_str(), mac_message.length(), mac);
+
+	if (CRYPTO_memcmp(mac, data, 32) != 0) {
+		cout << "PEER#" << connection_->id() << " peer claiming to be " << id.short_string() << " gave an invalid ticket" << endl;
+		local_peer_.tickets().remove(id);
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	cout << "PEER#" << connection_->id() << " resumed session with " << id.short_string() << endl;
+
+	peer_verify_identity::welcome(local_peer_, connection_);
+
+	type = DDSN_MESSAGE_TYPE_END;
+}
+
+void peer_resume_identity::send() {
+	peer_message::send("RESUME IDENTITY\n");
+	peer_message::send(mac_, 32);
 }
 
 // WELCOME
@@ -741,12 +1111,12 @@ void peer_integrated::send() {
 // STORE BLOCK
 
 peer_store_block::peer_store_block(local_peer &local_peer, peer_connection::pointer connection) :
-peer_message(local_peer, connection), state_(0) {
+peer_message(local_peer, connection), state_(0), signature_type_(DDSN_SIGNATURE_RSA), key_reference_(false), fetched_owner_(new public_key_pointer()), encoded_size_(0), hashed_(0) {
 
 }
 
 peer_store_block::peer_store_block(local_peer &local_peer, peer_connection::pointer connection, const block &block) :
-peer_message(local_peer, connection), block_(block) {
+peer_message(local_peer, connection), block_(block), signature_type_(block.signature_type()), key_reference_(false), fetched_owner_(new public_key_pointer()), encoded_size_(0), hashed_(0) {
 
 }
 
@@ -762,7 +1132,7 @@ void peer_store_block::feed(const std::string &line, UINT32 &type, size_t &expec
 	if (state_ == 0) {
 		if (line == "") {
 			type = DDSN_MESSAGE_TYPE_BYTES;
-			expected_size = 256;
+			expected_size = signature_size(signature_type_);
 		} else {
 			size_t colon_pos = line.find(": ");
 			if (colon_pos == string::npos) {
@@ -783,6 +1153,44 @@ void peer_store_block::feed(const std::string &line, UINT32 &type, size_t &expec
 					type = DDSN_MESSAGE_TYPE_ERROR;
 					return;
 				}
+			} else if (field_name == "Owner") {
+				// the owner key isn't sent, look it up or fetch it (see GET KEY)
+				if (field_value.length() != 64) {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
+
+				hex_to_bytes(field_value, owner_hash_, 32);
+				key_reference_ = true;
+				fetch_key(owner_hash_, fetched_owner_);
+			} else if (field_name == "Signature") {
+				// absent for RSA signed blocks from older peers
+				signature_type_ = signature_type(field_value);
+
+				if (signature_type_ == -1) {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
+			} else if (field_name == "Hash") {
+				// signed over the Merkle root, the leaf hashes come before the data
+				if (field_value != "merkle") {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
+
+				block_.set_merkle(true);
+			} else if (field_name == "Encoding") {
+				if (field_value != "deflate") {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
+			} else if (field_name == "Encoded-size") {
+				try {
+					encoded_size_ = stoi(field_value);
+				} catch (...) {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
 			} else if (field_name == "Size") {
 				try {
 					block_.set_size(stoi(field_value));
@@ -798,8 +1206,7 @@ void peer_store_block::feed(const std::string &line, UINT32 &type, size_t &expec
 		// public key
 
 		if (line == "") {
-			type = DDSN_MESSAGE_TYPE_BYTES;
-			expected_size = block_.size();
+			expect_data(type, expected_size);
 		} else {
 			public_key_ += line + "\n";
 			type = DDSN_MESSAGE_TYPE_STRING;
@@ -807,85 +1214,328 @@ void peer_store_block::feed(const std::string &line, UINT32 &type, size_t &expec
 	}
 }
 
-static void action_peer_store_block(local_peer &local_peer, peer_connection::pointer connection, const block &block, bool success) {
-	peer_stored_block(local_peer, connection, block, success).send();
-}
-
-void peer_store_block::feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size) {
-	if (state_ == 0) {
-		// got signature
+void peer_store_block::feed(frame_reader &frame, UINT32 &type, size_t &expected_size) {
+	UINT32 field;
+	const BYTE *value;
+	size_t size;
+	UINT64 number;
+	const BYTE *signature = nullptr;
+	size_t signature_length = 0;
 
-		BYTE signature[256];
-		memcpy(signature, data, 256);
-		block_.set_signature(signature);
+	while (frame.next(field, value, size)) {
+		if (field == DDSN_FIELD_CODE) {
+			code block_code;
 
-		state_ = 1;
+			if (!frame_reader::code(value, size, block_code)) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
 
-		type = DDSN_MESSAGE_TYPE_STRING;
-	} else if (state_ == 1) {
-		// owner
+			block_.set_code(block_code);
+		} else if (field == DDSN_FIELD_NAME) {
+			block_.set_name(string((const CHAR *)value, size));
+		} else if (field == DDSN_FIELD_OCCURRENCE) {
+			if (!frame_reader::number(value, size, number)) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
 
-		BIO *pub = BIO_new(BIO_s_mem());
+			block_.set_occurrence(number);
+		} else if (field == DDSN_FIELD_SIZE) {
+			if (!frame_reader::number(value, size, number) || number > DDSN_MESSAGE_CHUNK_MAX_SIZE) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
 
-		BIO_write(pub, public_key_.c_str(), public_key_.length());
+			block_.set_size(number);
+		} else if (field == DDSN_FIELD_SIGNATURE_TYPE) {
+			if (!frame_reader::number(value, size, number) || (number != DDSN_SIGNATURE_RSA && number != DDSN_SIGNATURE_ED25519)) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
 
-		RSA *owner = nullptr;
-		PEM_read_bio_RSAPublicKey(pub, &owner, NULL, NULL);
+			signature_type_ = number;
+		} else if (field == DDSN_FIELD_SIGNATURE) {
+			signature = value;
+			signature_length = size;
+		} else if (field == DDSN_FIELD_OWNER) {
+			// the owner key isn't sent, look it up or fetch it (see GET KEY)
+			if (size != 32) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
 
-		BIO_free(pub);
+			memcpy(owner_hash_, value, 32);
+			key_reference_ = true;
+			fetch_key(owner_hash_, fetched_owner_);
+		} else if (field == DDSN_FIELD_OWNER_KEY) {
+			public_key_der_ = string((const CHAR *)value, size);
+		} else if (field == DDSN_FIELD_ENCODED_SIZE) {
+			if (!frame_reader::number(value, size, number) || number == 0) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
 
-		block_.set_owner(owner);
+			encoded_size_ = number;
+		} else if (field == DDSN_FIELD_LEAF_HASHES) {
+			// signed over the Merkle root, the leaf hashes come with the fields
+			block_.set_merkle(true);
+			leaf_hashes_ = shared_buffer(value, size);
+		}
+	}
+
+	if (!frame.valid()) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	if (signature == nullptr || signature_length != signature_size(signature_type_) || (!key_reference_ && public_key_der_.empty())) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	if (block_.merkle() && leaf_hashes_.size() != merkle_hasher::leaves(block_.size()) * 32) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	if (frame.body_size() != (encoded_size_ > 0 ? encoded_size_ : block_.size())) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	block_.set_signature(signature, signature_type_);
+
+	// the body is the data, read like after the text fields
+	expect_data(type, expected_size);
+}
+
+static void action_peer_store_block(local_peer &local_peer, peer_connection::pointer connection, const block &block, bool success) {
+	peer_stored_block(local_peer, connection, block, success).send();
+}
+
+void peer_store_block::feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size) {
+	if (state_ == 0) {
+		// got signature
+
+		block_.set_signature(data, signature_type_);
+
+		state_ = 1;
 
+		if (key_reference_) {
+			// no owner key, the data follows
+			expect_data(type, expected_size);
+		} else {
+			type = DDSN_MESSAGE_TYPE_STRING;
+		}
+	} else if (state_ == 2) {
+		// leaf hashes
+
+		leaf_hashes_ = shared_buffer(data, size);
+
+		expect_data(type, expected_size);
+	} else if (state_ == 1) {
 		// data
 
-		block_.set_data(data, size);
+		received_ = shared_buffer(data, size);
+
+		if (encoded_size_ == 0 && block_.merkle()) {
+			block_.set_data(received_);
 
-		if (!block_.verify()) {
-			cout << "Block is corrupted" << endl;
+			// most chunks were checked while they arrived
+			merkle_hasher_.update(data + hashed_, size - hashed_);
+			shared_buffer leaf_hashes = merkle_hasher_.finish();
+
+			if (leaf_hashes.size() != leaf_hashes_.size() || !merkle_hasher_.check(leaf_hashes_)) {
+				cout << "Block data doesn't match its leaf hashes" << endl;
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			block_.set_leaf_hashes(leaf_hashes);
+		} else if (encoded_size_ == 0) {
+			block_.set_data(received_);
+
+			// most of it was hashed while it arrived
+			BYTE data_hash[32];
+			hasher_.update(data + hashed_, size - hashed_);
+			hasher_.finish(block_.name(), data_hash);
+			block_.set_data_hash(data_hash);
+		}
+
+		// owner
+
+		public_key_pointer owner;
+
+		if (key_reference_) {
+			owner = key_registry::get(owner_hash_);
+		} else if (!public_key_der_.empty()) {
+			// registered once the block verifies
+			owner = key_registry::parse_der(public_key_der_);
+		} else {
+			owner = key_registry::parse_pem(public_key_);
+		}
+
+		if (owner == nullptr && key_reference_) {
+			if (connection_->key_waits() >= DDSN_KEY_WAITS_MAX) {
+				// each waiting copy holds its data
+				cout << "PEER#" << connection_->id() << " sent too many blocks with unknown owners" << endl;
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			// a copy waits for the key while the connection reads on
+			peer_store_block *waiting = new peer_store_block(*this);
+			waiting->detached_ = true;
+
+			if (connection_->await_key(owner_hash_, boost::bind(&peer_store_block::owner_arrived, waiting, _1))) {
+				peer_get_key(local_peer_, connection_, owner_hash_).send();
+			}
+
+			type = DDSN_MESSAGE_TYPE_END;
+			return;
+		}
+
+		if (owner == nullptr) {
 			type = DDSN_MESSAGE_TYPE_ERROR;
 			return;
 		}
 
-		local_peer_.store(block_, boost::bind(&action_peer_store_block, boost::ref(local_peer_), connection_, _1, _2));
+		block_.set_owner(owner);
+
+		run_crypto(boost::bind(&peer_store_block::check, this), boost::bind(&peer_store_block::checked, this, _1));
 
-		type = DDSN_MESSAGE_TYPE_END;
+		type = DDSN_MESSAGE_TYPE_WAIT;
 	}
 }
 
+void peer_store_block::owner_arrived(public_key_pointer owner) {
+	if (owner == nullptr) {
+		cout << "Owner key of " << block_.code().string('_') << " is unavailable" << endl;
+		finish(DDSN_MESSAGE_TYPE_ERROR);
+		return;
+	}
+
+	block_.set_owner(owner);
+
+	run_crypto(boost::bind(&peer_store_block::check, this), boost::bind(&peer_store_block::checked, this, _1));
+}
+
+void peer_store_block::expect_data(UINT32 &type, size_t &expected_size) {
+	type = DDSN_MESSAGE_TYPE_BYTES;
+
+	if (block_.merkle() && leaf_hashes_.empty()) {
+		state_ = 2;
+		expected_size = merkle_hasher::leaves(block_.size()) * 32;
+	} else {
+		state_ = 1;
+		expected_size = encoded_size_ > 0 ? encoded_size_ : block_.size();
+	}
+}
+
+bool peer_store_block::feed_partial(const BYTE *data, size_t size) {
+	if (state_ == 1 && encoded_size_ == 0 && block_.merkle()) {
+		merkle_hasher_.update(data, size);
+		hashed_ += size;
+
+		// drop a corrupted block at its first bad chunk, not after all of it arrived
+		if (!merkle_hasher_.check(leaf_hashes_)) {
+			cout << "Chunk " << merkle_hasher_.finished() - 1 << " of " << block_.code().string('_') << " doesn't match its leaf hash" << endl;
+			return false;
+		}
+	} else if (state_ == 1 && encoded_size_ == 0) {
+		hasher_.update(data, size);
+		hashed_ += size;
+	}
+
+	return true;
+}
+
+bool peer_store_block::check() {
+	if (encoded_size_ > 0) {
+		if (block_.size() > DDSN_MESSAGE_CHUNK_MAX_SIZE || block_.set_deflated_data(received_, block_.size()) != 0) {
+			cout << "Could not inflate block" << endl;
+			return false;
+		}
+	}
+
+	if (!block_.verify(local_peer_.verify_cache())) {
+		cout << "Block is corrupted" << endl;
+		return false;
+	}
+
+	if (local_peer_.deflate()) {
+		// it may be sent on, deflate it here rather than on the network thread
+		block_.deflated();
+	}
+
+	return true;
+}
+
+void peer_store_block::checked(bool valid) {
+	if (!valid) {
+		finish(DDSN_MESSAGE_TYPE_ERROR);
+		return;
+	}
+
+	// the key signed a valid block, others may look it up by hash now
+	key_registry::add(block_.owner());
+
+	local_peer_.store(block_, boost::bind(&action_peer_store_block, boost::ref(local_peer_), connection_, _1, _2));
+
+	finish(DDSN_MESSAGE_TYPE_END);
+}
+
 void peer_store_block::send() {
+	string encoding;
+	shared_buffer payload = block_payload(block_, encoding);
+
+	if (connection_->binary()) {
+		frame_writer frame(DDSN_FRAME_STORE_BLOCK);
+		add_block_fields(frame, block_, payload, !encoding.empty());
+
+		shared_buffer header = frame.finish(payload.size());
+
+		// the fields may not fit in a frame, the text form has no such limit
+		if (!header.empty()) {
+			peer_message::send(header);
+			peer_message::send(payload);
+			return;
+		}
+	}
+
+	string owner = connection_->key_reference() ? "Owner: " + bytes_to_hex(block_.owner_hash(), 32) + "\n" : "";
+	string hash = block_.merkle() ? "Hash: merkle\n" : "";
+
 	peer_message::send("STORE BLOCK\n"
 		"Code: " + block_.code().string('_') + "\n"
 		"Name: " + block_.name() + "\n"
 		"Occurrence: " + boost::lexical_cast<string>(block_.occurrence()) + "\n"
 		"Size: " + boost::lexical_cast<string>(block_.size()) + "\n"
+		"Signature: " + signature_name(block_.signature_type()) + "\n" +
+		owner +
+		hash +
+		encoding +
 		"\n");
 
 	// send signature
 
-	peer_message::send(block_.signature(), 256);
-
-	// send public key in pem format
-
-	BIO *pub = BIO_new(BIO_s_mem());
+	peer_message::send(block_.signature(), block_.signature_size());
 
-	PEM_write_bio_RSAPublicKey(pub, block_.owner());
+	// send public key in pem format, unless the peer looks it up by the owner hash
 
-	size_t pub_len = BIO_pending(pub);
-
-	BYTE *pub_key = new BYTE[pub_len];
-
-	BIO_read(pub, pub_key, pub_len);
-
-	BIO_free(pub);
+	if (owner.empty()) {
+		peer_message::send(block_.owner()->pem() + "\n");
+	}
 
-	// actually a string, but we can use byte verion of send
-	peer_message::send(pub_key, pub_len);
-	peer_message::send("\n");
+	// send the leaf hashes, so the peer can check each chunk as it arrives
 
-	delete[] pub_key;
+	if (block_.merkle()) {
+		peer_message::send(block_.leaf_hashes());
+	}
 
-	// send data
-	peer_message::send(block_.data(), block_.size());
+	// send data (shared with the block, not copied)
+	peer_message::send(payload);
 }
 
 // LOAD BLOCK
@@ -909,6 +1559,12 @@ void peer_load_block::first_action(UINT32 &type, size_t &expected_size) {
 }
 
 void action_peer_load_block(local_peer &local_peer, peer_connection::pointer connection, const block &block, bool success) {
+	if (success && connection->deflate() && !block.deflate_tried()) {
+		// only for peers that take it deflated, and not on the network thread
+		local_peer.deflate_block(block, boost::bind(&action_peer_load_block, boost::ref(local_peer), connection, _1, true));
+		return;
+	}
+
 	peer_deliver_block(local_peer, connection, block, success).send();
 }
 
@@ -938,7 +1594,37 @@ void peer_load_block::feed(const BYTE *data, size_t size, UINT32 &type, size_t &
 
 }
 
+void peer_load_block::feed(frame_reader &frame, UINT32 &type, size_t &expected_size) {
+	UINT32 field;
+	const BYTE *value;
+	size_t size;
+
+	while (frame.next(field, value, size)) {
+		if (field == DDSN_FIELD_CODE && !frame_reader::code(value, size, code_)) {
+			type = DDSN_MESSAGE_TYPE_ERROR;
+			return;
+		}
+	}
+
+	if (!frame.valid() || frame.body_size() != 0) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	local_peer_.load(code_, boost::bind(&action_peer_load_block, boost::ref(local_peer_), connection_, _1, _2));
+
+	type = DDSN_MESSAGE_TYPE_END;
+}
+
 void peer_load_block::send() {
+	if (connection_->binary()) {
+		frame_writer frame(DDSN_FRAME_LOAD_BLOCK);
+		frame.add_code(DDSN_FIELD_CODE, code_);
+
+		peer_message::send(frame.finish(0));
+		return;
+	}
+
 	peer_message::send("LOAD BLOCK\n"
 		"Code: " + code_.string('_') + "\n"
 		"\n");
@@ -1005,7 +1691,75 @@ void peer_stored_block::feed(const BYTE *data, size_t size, UINT32 &type, size_t
 
 }
 
+void peer_stored_block::feed(frame_reader &frame, UINT32 &type, size_t &expected_size) {
+	UINT32 field;
+	const BYTE *value;
+	size_t size;
+	UINT64 number;
+
+	while (frame.next(field, value, size)) {
+		if (field == DDSN_FIELD_CODE) {
+			code block_code;
+
+			if (!frame_reader::code(value, size, block_code)) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			block_.set_code(block_code);
+		} else if (field == DDSN_FIELD_NAME) {
+			block_.set_name(string((const CHAR *)value, size));
+		} else if (field == DDSN_FIELD_OCCURRENCE) {
+			if (!frame_reader::number(value, size, number)) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			block_.set_occurrence(number);
+		} else if (field == DDSN_FIELD_OWNER) {
+			if (size != 32) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			block_.set_owner_hash(value);
+		} else if (field == DDSN_FIELD_SUCCESS) {
+			if (!frame_reader::number(value, size, number)) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			success_ = number != 0;
+		}
+	}
+
+	if (!frame.valid() || frame.body_size() != 0) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	local_peer_.do_store_actions(boost::ref(block_), success_);
+
+	type = DDSN_MESSAGE_TYPE_END;
+}
+
 void peer_stored_block::send() {
+	if (connection_->binary()) {
+		frame_writer frame(DDSN_FRAME_STORED_BLOCK);
+		frame.add_code(DDSN_FIELD_CODE, block_.code());
+		frame.add(DDSN_FIELD_NAME, block_.name());
+		frame.add_number(DDSN_FIELD_OCCURRENCE, block_.occurrence());
+		frame.add(DDSN_FIELD_OWNER, block_.owner_hash(), 32);
+		frame.add_number(DDSN_FIELD_SUCCESS, success_ ? 1 : 0);
+
+		shared_buffer header = frame.finish(0);
+
+		if (!header.empty()) {
+			peer_message::send(header);
+			return;
+		}
+	}
+
 	peer_message::send("STORED BLOCK\n"
 		"Code: " + block_.code().string('_') + "\n"
 		"Name: " + block_.name() + "\n"
@@ -1018,12 +1772,12 @@ void peer_stored_block::send() {
 // DELIVER BLOCK
 
 peer_deliver_block::peer_deliver_block(local_peer &local_peer, peer_connection::pointer connection) :
-peer_message(local_peer, connection), state_(0) {
+peer_message(local_peer, connection), state_(0), signature_type_(DDSN_SIGNATURE_RSA), key_reference_(false), fetched_owner_(new public_key_pointer()), encoded_size_(0), hashed_(0) {
 
 }
 
 peer_deliver_block::peer_deliver_block(local_peer &local_peer, peer_connection::pointer connection, const block &block, bool success) :
-peer_message(local_peer, connection), block_(block), success_(success) {
+peer_message(local_peer, connection), block_(block), signature_type_(block.signature_type()), key_reference_(false), fetched_owner_(new public_key_pointer()), success_(success), encoded_size_(0), hashed_(0) {
 
 }
 
@@ -1043,7 +1797,7 @@ void peer_deliver_block::feed(const std::string &line, UINT32 &type, size_t &exp
 
 				type = DDSN_MESSAGE_TYPE_END;
 			} else {
-				expected_size = 256;
+				expected_size = signature_size(signature_type_);
 				type = DDSN_MESSAGE_TYPE_BYTES;
 			}
 		} else {
@@ -1066,6 +1820,44 @@ void peer_deliver_block::feed(const std::string &line, UINT32 &type, size_t &exp
 					type = DDSN_MESSAGE_TYPE_ERROR;
 					return;
 				}
+			} else if (field_name == "Owner") {
+				// the owner key isn't sent, look it up or fetch it (see GET KEY)
+				if (field_value.length() != 64) {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
+
+				hex_to_bytes(field_value, owner_hash_, 32);
+				key_reference_ = true;
+				fetch_key(owner_hash_, fetched_owner_);
+			} else if (field_name == "Signature") {
+				// absent for RSA signed blocks from older peers
+				signature_type_ = signature_type(field_value);
+
+				if (signature_type_ == -1) {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
+			} else if (field_name == "Hash") {
+				// signed over the Merkle root, the leaf hashes come before the data
+				if (field_value != "merkle") {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
+
+				block_.set_merkle(true);
+			} else if (field_name == "Encoding") {
+				if (field_value != "deflate") {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
+			} else if (field_name == "Encoded-size") {
+				try {
+					encoded_size_ = stoi(field_value);
+				} catch (...) {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
 			} else if (field_name == "Size") {
 				try {
 					block_.set_size(stoi(field_value));
@@ -1083,8 +1875,7 @@ void peer_deliver_block::feed(const std::string &line, UINT32 &type, size_t &exp
 		// public key
 
 		if (line == "") {
-			type = DDSN_MESSAGE_TYPE_BYTES;
-			expected_size = block_.size();
+			expect_data(type, expected_size);
 		} else {
 			public_key_ += line + "\n";
 			type = DDSN_MESSAGE_TYPE_STRING;
@@ -1092,87 +1883,548 @@ void peer_deliver_block::feed(const std::string &line, UINT32 &type, size_t &exp
 	}
 }
 
+void peer_deliver_block::feed(frame_reader &frame, UINT32 &type, size_t &expected_size) {
+	UINT32 field;
+	const BYTE *value;
+	size_t size;
+	UINT64 number;
+	const BYTE *signature = nullptr;
+	size_t signature_length = 0;
+
+	while (frame.next(field, value, size)) {
+		if (field == DDSN_FIELD_CODE) {
+			code block_code;
+
+			if (!frame_reader::code(value, size, block_code)) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			block_.set_code(block_code);
+		} else if (field == DDSN_FIELD_NAME) {
+			block_.set_name(string((const CHAR *)value, size));
+		} else if (field == DDSN_FIELD_OCCURRENCE) {
+			if (!frame_reader::number(value, size, number)) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			block_.set_occurrence(number);
+		} else if (field == DDSN_FIELD_SIZE) {
+			if (!frame_reader::number(value, size, number) || number > DDSN_MESSAGE_CHUNK_MAX_SIZE) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			block_.set_size(number);
+		} else if (field == DDSN_FIELD_SIGNATURE_TYPE) {
+			if (!frame_reader::number(value, size, number) || (number != DDSN_SIGNATURE_RSA && number != DDSN_SIGNATURE_ED25519)) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			signature_type_ = number;
+		} else if (field == DDSN_FIELD_SIGNATURE) {
+			signature = value;
+			signature_length = size;
+		} else if (field == DDSN_FIELD_OWNER) {
+			// the owner key isn't sent, look it up or fetch it (see GET KEY)
+			if (size != 32) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			memcpy(owner_hash_, value, 32);
+			key_reference_ = true;
+			fetch_key(owner_hash_, fetched_owner_);
+		} else if (field == DDSN_FIELD_OWNER_KEY) {
+			public_key_der_ = string((const CHAR *)value, size);
+		} else if (field == DDSN_FIELD_ENCODED_SIZE) {
+			if (!frame_reader::number(value, size, number) || number == 0) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			encoded_size_ = number;
+		} else if (field == DDSN_FIELD_LEAF_HASHES) {
+			// signed over the Merkle root, the leaf hashes come with the fields
+			block_.set_merkle(true);
+			leaf_hashes_ = shared_buffer(value, size);
+		} else if (field == DDSN_FIELD_SUCCESS) {
+			if (!frame_reader::number(value, size, number)) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			success_ = number != 0;
+		}
+	}
+
+	if (!frame.valid()) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	if (!success_) {
+		// a body nobody reads would be taken for the next message
+		if (frame.body_size() != 0) {
+			type = DDSN_MESSAGE_TYPE_ERROR;
+			return;
+		}
+
+		local_peer_.do_load_actions(block_, false);
+
+		type = DDSN_MESSAGE_TYPE_END;
+		return;
+	}
+
+	if (signature == nullptr || signature_length != signature_size(signature_type_) || (!key_reference_ && public_key_der_.empty())) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	if (block_.merkle() && leaf_hashes_.size() != merkle_hasher::leaves(block_.size()) * 32) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	if (frame.body_size() != (encoded_size_ > 0 ? encoded_size_ : block_.size())) {
+		type = DDSN_MESSAGE_TYPE_ERROR;
+		return;
+	}
+
+	block_.set_signature(signature, signature_type_);
+
+	// the body is the data, read like after the text fields
+	expect_data(type, expected_size);
+}
+
 void peer_deliver_block::feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size) {
 	if (state_ == 0) {
 		// got signature
 
-		BYTE signature[256];
-		memcpy(signature, data, 256);
-		block_.set_signature(signature);
+		block_.set_signature(data, signature_type_);
 
 		state_ = 1;
 
-		type = DDSN_MESSAGE_TYPE_STRING;
+		if (key_reference_) {
+			// no owner key, the data follows
+			expect_data(type, expected_size);
+		} else {
+			type = DDSN_MESSAGE_TYPE_STRING;
+		}
+	} else if (state_ == 2) {
+		// leaf hashes
+
+		leaf_hashes_ = shared_buffer(data, size);
+
+		expect_data(type, expected_size);
 	} else if (state_ == 1) {
-		// owner
+		// data
 
-		BIO *pub = BIO_new(BIO_s_mem());
+		received_ = shared_buffer(data, size);
 
-		BIO_write(pub, public_key_.c_str(), public_key_.length());
+		if (encoded_size_ == 0 && block_.merkle()) {
+			block_.set_data(received_);
 
-		RSA *owner = nullptr;
-		PEM_read_bio_RSAPublicKey(pub, &owner, NULL, NULL);
+			// most chunks were checked while they arrived
+			merkle_hasher_.update(data + hashed_, size - hashed_);
+			shared_buffer leaf_hashes = merkle_hasher_.finish();
 
-		BIO_free(pub);
+			if (leaf_hashes.size() != leaf_hashes_.size() || !merkle_hasher_.check(leaf_hashes_)) {
+				cout << "Block data doesn't match its leaf hashes" << endl;
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
 
-		block_.set_owner(owner);
+			block_.set_leaf_hashes(leaf_hashes);
+		} else if (encoded_size_ == 0) {
+			block_.set_data(received_);
 
-		// data
+			// most of it was hashed while it arrived
+			BYTE data_hash[32];
+			hasher_.update(data + hashed_, size - hashed_);
+			hasher_.finish(block_.name(), data_hash);
+			block_.set_data_hash(data_hash);
+		}
+
+		// owner
+
+		public_key_pointer owner;
+
+		if (key_reference_) {
+			owner = key_registry::get(owner_hash_);
+		} else if (!public_key_der_.empty()) {
+			// registered once the block verifies
+			owner = key_registry::parse_der(public_key_der_);
+		} else {
+			owner = key_registry::parse_pem(public_key_);
+		}
+
+		if (owner == nullptr && key_reference_) {
+			if (connection_->key_waits() >= DDSN_KEY_WAITS_MAX) {
+				// each waiting copy holds its data
+				cout << "PEER#" << connection_->id() << " sent too many blocks with unknown owners" << endl;
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			// a copy waits for the key while the connection reads on
+			peer_deliver_block *waiting = new peer_deliver_block(*this);
+			waiting->detached_ = true;
+
+			if (connection_->await_key(owner_hash_, boost::bind(&peer_deliver_block::owner_arrived, waiting, _1))) {
+				peer_get_key(local_peer_, connection_, owner_hash_).send();
+			}
 
-		block_.set_data(data, size);
+			type = DDSN_MESSAGE_TYPE_END;
+			return;
+		}
 
-		if (!block_.verify()) {
-			cout << "Block is corrupted" << endl;
+		if (owner == nullptr) {
 			type = DDSN_MESSAGE_TYPE_ERROR;
 			return;
 		}
 
-		local_peer_.do_load_actions(block_, true);
+		block_.set_owner(owner);
 
-		type = DDSN_MESSAGE_TYPE_END;
+		run_crypto(boost::bind(&peer_deliver_block::check, this), boost::bind(&peer_deliver_block::checked, this, _1));
+
+		type = DDSN_MESSAGE_TYPE_WAIT;
+	}
+}
+
+void peer_deliver_block::owner_arrived(public_key_pointer owner) {
+	if (owner == nullptr) {
+		cout << "Owner key of " << block_.code().string('_') << " is unavailable" << endl;
+		finish(DDSN_MESSAGE_TYPE_ERROR);
+		return;
+	}
+
+	block_.set_owner(owner);
+
+	run_crypto(boost::bind(&peer_deliver_block::check, this), boost::bind(&peer_deliver_block::checked, this, _1));
+}
+
+void peer_deliver_block::expect_data(UINT32 &type, size_t &expected_size) {
+	type = DDSN_MESSAGE_TYPE_BYTES;
+
+	if (block_.merkle() && leaf_hashes_.empty()) {
+		state_ = 2;
+		expected_size = merkle_hasher::leaves(block_.size()) * 32;
+	} else {
+		state_ = 1;
+		expected_size = encoded_size_ > 0 ? encoded_size_ : block_.size();
 	}
 }
 
+bool peer_deliver_block::feed_partial(const BYTE *data, size_t size) {
+	if (state_ == 1 && encoded_size_ == 0 && block_.merkle()) {
+		merkle_hasher_.update(data, size);
+		hashed_ += size;
+
+		// drop a corrupted block at its first bad chunk, not after all of it arrived
+		if (!merkle_hasher_.check(leaf_hashes_)) {
+			cout << "Chunk " << merkle_hasher_.finished() - 1 << " of " << block_.code().string('_') << " doesn't match its leaf hash" << endl;
+			return false;
+		}
+	} else if (state_ == 1 && encoded_size_ == 0) {
+		hasher_.update(data, size);
+		hashed_ += size;
+	}
+
+	return true;
+}
+
+bool peer_deliver_block::check() {
+	if (encoded_size_ > 0) {
+		if (block_.size() > DDSN_MESSAGE_CHUNK_MAX_SIZE || block_.set_deflated_data(received_, block_.size()) != 0) {
+			cout << "Could not inflate block" << endl;
+			return false;
+		}
+	}
+
+	if (!block_.verify(local_peer_.verify_cache())) {
+		cout << "Block is corrupted" << endl;
+		return false;
+	}
+
+	if (local_peer_.deflate()) {
+		// it may be sent on, deflate it here rather than on the network thread
+		block_.deflated();
+	}
+
+	return true;
+}
+
+void peer_deliver_block::checked(bool valid) {
+	if (!valid) {
+		finish(DDSN_MESSAGE_TYPE_ERROR);
+		return;
+	}
+
+	key_registry::add(block_.owner());
+
+	local_peer_.do_load_actions(block_, true);
+
+	finish(DDSN_MESSAGE_TYPE_END);
+}
+
 void peer_deliver_block::send() {
-	if (!success_) {
+	if (success_ && !connection_->accepts_signature(block_.signature_type())) {
+		cout << "PEER#" << connection_->id() << " doesn't verify " << signature_name(block_.signature_type()) << " signatures" << endl;
+		success_ = false;
+	}
+
+	if (success_ && block_.merkle() && !connection_->merkle()) {
+		cout << "PEER#" << connection_->id() << " doesn't take Merkle blocks" << endl;
+		success_ = false;
+	}
+
+	if (!success_ && connection_->binary()) {
+		frame_writer frame(DDSN_FRAME_DELIVER_BLOCK);
+		frame.add_code(DDSN_FIELD_CODE, block_.code());
+		frame.add_number(DDSN_FIELD_SUCCESS, 0);
+
+		peer_message::send(frame.finish(0));
+	} else if (!success_) {
 		peer_message::send("DELIVER BLOCK\n"
 			"Code: " + block_.code().string() + "\n"
 			"Success: no\n"
 			"\n");
 	} else {
+		string encoding;
+		shared_buffer payload = block_payload(block_, encoding);
+
+		if (connection_->binary()) {
+			frame_writer frame(DDSN_FRAME_DELIVER_BLOCK);
+			add_block_fields(frame, block_, payload, !encoding.empty());
+			frame.add_number(DDSN_FIELD_SUCCESS, 1);
+
+			shared_buffer header = frame.finish(payload.size());
+
+			if (!header.empty()) {
+				peer_message::send(header);
+				peer_message::send(payload);
+				return;
+			}
+		}
+
+		string owner = connection_->key_reference() ? "Owner: " + bytes_to_hex(block_.owner_hash(), 32) + "\n" : "";
+		string hash = block_.merkle() ? "Hash: merkle\n" : "";
+
 		peer_message::send("DELIVER BLOCK\n"
 			"Code: " + block_.code().string('_') + "\n"
 			"Name: " + block_.name() + "\n"
 			"Occurrence: " + boost::lexical_cast<string>(block_.occurrence()) + "\n"
 			"Size: " + boost::lexical_cast<string>(block_.size()) + "\n"
+			"Signature: " + signature_name(block_.signature_type()) + "\n" +
+			owner +
+			hash +
+			encoding +
 			"Success: yes\n"
 			"\n");
 
 		// send signature
 
-		peer_message::send(block_.signature(), 256);
+		peer_message::send(block_.signature(), block_.signature_size());
+
+		// send public key in pem format, unless the peer looks it up by the owner hash
+
+		if (owner.empty()) {
+			peer_message::send(block_.owner()->pem() + "\n");
+		}
+
+		// send the leaf hashes, so the peer can check each chunk as it arrives
+
+		if (block_.merkle()) {
+			peer_message::send(block_.leaf_hashes());
+		}
+
+		// send data (shared with the block, not copied)
+		peer_message::send(payload);
+	}
+}
+
+// GET KEY
+
+/*
+ * == Sending perspective ==
+ * Ask for the owner key of a block that only named its owner hash (see
+ * STORE BLOCK and DELIVER BLOCK). The block waits for the KEY answer.
+ * == Receiving perspective ==
+ * Answer with the key from the key_registry, the peer got a block with it
+ * from us.
+ */
+
+peer_get_key::peer_get_key(local_peer &local_peer, peer_connection::pointer connection) :
+peer_message(local_peer, connection) {
+	memset(hash_, 0, 32);
+}
+
+peer_get_key::peer_get_key(local_peer &local_peer, peer_connection::pointer connection, const BYTE hash[32]) :
+peer_message(local_peer, connection) {
+	memcpy(hash_, hash, 32);
+}
+
+peer_get_key::~peer_get_key() {
+
+}
+
+void peer_get_key::first_action(UINT32 &type, size_t &expected_size) {
+	type = DDSN_MESSAGE_TYPE_STRING;
+}
+
+void peer_get_key::feed(const std::string &line, UINT32 &type, size_t &expected_size) {
+	if (line == "") {
+		public_key_pointer key = key_registry::get(hash_);
+
+		if (key == nullptr && local_peer_.block_store() != nullptr) {
+			// nothing holds the key right now, but a stored block may be the owner's
+			key = local_peer_.block_store()->owner_key(hash_);
+		}
+
+		peer_key(local_peer_, connection_, hash_, key).send();
+
+		type = DDSN_MESSAGE_TYPE_END;
+	} else {
+		size_t colon_pos = line.find(": ");
+		if (colon_pos == string::npos) {
+			type = DDSN_MESSAGE_TYPE_ERROR;
+			return;
+		}
+		string field_name = line.substr(0, colon_pos);
+		string field_value = line.substr(colon_pos + 2);
+
+		if (field_name == "Owner") {
+			if (field_value.length() != 64) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			hex_to_bytes(field_value, hash_, 32);
+		}
+
+		type = DDSN_MESSAGE_TYPE_STRING;
+	}
+}
+
+void peer_get_key::feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size) {
+
+}
+
+void peer_get_key::send() {
+	peer_message::send("GET KEY\n"
+		"Owner: " + bytes_to_hex(hash_, 32) + "\n"
+		"\n");
+}
+
+// KEY
+
+/*
+ * == Sending perspective ==
+ * The owner key asked for with GET KEY in PEM format, or "Success: no".
+ * == Receiving perspective ==
+ * Register the key and continue the blocks waiting for it.
+ */
+
+peer_key::peer_key(local_peer &local_peer, peer_connection::pointer connection) :
+peer_message(local_peer, connection), state_(0), hash_set_(false), success_(false) {
 
-		// send public key in pem format
+}
 
-		BIO *pub = BIO_new(BIO_s_mem());
+peer_key::peer_key(local_peer &local_peer, peer_connection::pointer connection, const BYTE hash[32], public_key_pointer key) :
+peer_message(local_peer, connection), state_(0), hash_set_(true), success_(key != nullptr), key_(key) {
+	memcpy(hash_, hash, 32);
+}
 
-		PEM_write_bio_RSAPublicKey(pub, block_.owner());
+peer_key::~peer_key() {
 
-		size_t pub_len = BIO_pending(pub);
+}
 
-		BYTE *pub_key = new BYTE[pub_len];
+void peer_key::first_action(UINT32 &type, size_t &expected_size) {
+	type = DDSN_MESSAGE_TYPE_STRING;
+}
 
-		BIO_read(pub, pub_key, pub_len);
+void peer_key::feed(const std::string &line, UINT32 &type, size_t &expected_size) {
+	if (state_ == 0) {
+		if (line == "") {
+			if (!hash_set_ || !connection_->awaits_key(hash_)) {
+				// we didn't ask for it
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+
+			if (!success_) {
+				connection_->key_arrived(hash_, nullptr);
 
-		BIO_free(pub);
+				type = DDSN_MESSAGE_TYPE_END;
+			} else {
+				state_ = 1;
 
-		// actually a string, but we can use byte verion of send
-		peer_message::send(pub_key, pub_len);
-		peer_message::send("\n");
+				type = DDSN_MESSAGE_TYPE_STRING;
+			}
+		} else {
+			size_t colon_pos = line.find(": ");
+			if (colon_pos == string::npos) {
+				type = DDSN_MESSAGE_TYPE_ERROR;
+				return;
+			}
+			string field_name = line.substr(0, colon_pos);
+			string field_value = line.substr(colon_pos + 2);
 
-		delete[] pub_key;
+			if (field_name == "Owner") {
+				if (field_value.length() != 64) {
+					type = DDSN_MESSAGE_TYPE_ERROR;
+					return;
+				}
 
-		// send data
-		peer_message::send(block_.data(), block_.size());
+				hex_to_bytes(field_value, hash_, 32);
+				hash_set_ = true;
+			} else if (field_name == "Success") {
+				success_ = field_value == "yes";
+			}
+
+			type = DDSN_MESSAGE_TYPE_STRING;
+		}
+	} else if (state_ == 1) {
+		if (line == "") {
+			public_key_pointer key = key_registry::parse_pem(public_key_);
+
+			if (key == nullptr || memcmp(key->hash(), hash_, 32) != 0) {
+				cout << "PEER#" << connection_->id() << " sent a wrong key" << endl;
+				key = nullptr;
+			} else {
+				key = key_registry::add(key);
+			}
+
+			connection_->key_arrived(hash_, key);
+
+			type = DDSN_MESSAGE_TYPE_END;
+		} else {
+			public_key_ += line + "\n";
+
+			type = DDSN_MESSAGE_TYPE_STRING;
+		}
+	}
+}
+
+void peer_key::feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size) {
+
+}
+
+void peer_key::send() {
+	if (key_ == nullptr) {
+		peer_message::send("KEY\n"
+			"Owner: " + bytes_to_hex(hash_, 32) + "\n"
+			"Success: no\n"
+			"\n");
+	} else {
+		peer_message::send("KEY\n"
+			"Owner: " + bytes_to_hex(hash_, 32) + "\n"
+			"Success: yes\n"
+			"\n" +
+			key_->pem() +
+			"\n");
 	}
 }
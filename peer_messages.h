@@ -4,6 +4,7 @@
 #include "peer_connection.h"
 #include "definitions.h"
 #include "foreign_peer.h"
+#include "frame.h"
 #include "local_peer.h"
 
 namespace ddsn {
@@ -15,6 +16,8 @@ class peer_connection;
 class peer_message {
 public:
 	static peer_message *create_message(local_peer &local_peer, peer_connection::pointer connection, const std::string &first_line);
+	// a message that came as binary frame (see frame.h)
+	static peer_message *create_message(local_peer &local_peer, peer_connection::pointer connection, UINT32 frame_type);
 
 	peer_message(local_peer &local_peer, peer_connection::pointer connection);
 	virtual ~peer_message();
@@ -28,13 +31,46 @@ public:
 	// provides this message with a byte array
 	virtual void feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size) = 0;
 
+	// bytes of the expected byte array received so far (in order, without
+	// repeating any), before the whole array is passed to feed
+	// returns false if they are already known to be wrong, ending the connection
+	virtual bool feed_partial(const BYTE *data, size_t size);
+
+	// provides this message with the fields of its frame, instead of the
+	// lines following the first one
+	virtual void feed(frame_reader &frame, UINT32 &type, size_t &expected_size);
+
 	virtual void send() = 0;
 protected:
 	void send(const std::string &string);
 	void send(const BYTE *bytes, size_t size);
+	void send(const shared_buffer &buffer);
+
+	// the block's data as it goes on the wire, deflated if the connection allows it
+	// and it compresses; fields gets the matching header fields
+	shared_buffer block_payload(const block &block, std::string &fields);
+	// the fields of a block frame sending payload (deflated if encoded)
+	void add_block_fields(frame_writer &frame, const block &block, const shared_buffer &payload, bool encoded);
+
+	// run job on the crypto pool and call done with its result on the network thread
+	// the message returns DDSN_MESSAGE_TYPE_WAIT meanwhile and done ends it with finish,
+	// so the connection doesn't read on while the job waits for room in the pool
+	void run_crypto(boost::function<bool()> job, boost::function<void(bool)> done);
+
+	// send GET KEY for an owner key as soon as a block names one we don't have,
+	// so it arrives while the data is read; kept holds the key once it's there
+	void fetch_key(const BYTE hash[32], std::shared_ptr<public_key_pointer> kept);
+
+	// end a message that returned DDSN_MESSAGE_TYPE_WAIT: resumes the connection,
+	// or deletes the message if it was detached from it
+	void finish(UINT32 type);
 
 	local_peer &local_peer_;
 	peer_connection::pointer connection_;
+
+	// a copy of a message that outlives its turn on the connection, e.g. a
+	// received block waiting for its owner key (see GET KEY)
+	bool detached_;
 };
 
 class peer_hello : public peer_message {
@@ -49,9 +85,19 @@ public:
 
 	void send();
 private:
+	// answer the peer's nonce with VERIFY IDENTITY
+	void signed_nonce(bool success);
+
 	UINT32 state_;
 	std::string public_key_;
 	std::string type_;
+	// the peer's nonce, absent with peers that send PROVE IDENTITY instead
+	BYTE nonce_[32];
+	bool nonce_set_;
+	// the id of the session ticket the peer holds for us, if any
+	BYTE ticket_id_[32];
+	bool ticket_set_;
+	BYTE signature_[DDSN_SIGNATURE_MAX_SIZE];
 };
 
 class peer_prove_identity : public peer_message {
@@ -65,13 +111,25 @@ public:
 
 	void send();
 private:
+	bool sign();
+	void signed_message(bool success);
+
 	std::string message_;
+	BYTE signature_[DDSN_SIGNATURE_MAX_SIZE];
 };
 
 class peer_verify_identity : public peer_message {
 public:
+	// signature_size(key_signature_type(key)) bytes
+	static bool sign(EVP_PKEY *key, const std::string &message, BYTE signature[DDSN_SIGNATURE_MAX_SIZE]);
+	// what a peer signs to answer the nonce of the verifying peer, together with
+	// the X25519 keys of both peers if they sent them (see session tickets)
+	static std::string nonce_message(const BYTE nonce[32], const peer_id &verifier, const BYTE *prover_exchange_key, const BYTE *verifier_exchange_key);
+	// the peer proved its identity (by signature or session ticket), welcome it
+	static void welcome(local_peer &local_peer, peer_connection::pointer connection);
+
 	peer_verify_identity(local_peer &local_peer, peer_connection::pointer connection);
-	peer_verify_identity(local_peer &local_peer, peer_connection::pointer connection, const std::string &message);
+	peer_verify_identity(local_peer &local_peer, peer_connection::pointer connection, const BYTE signature[DDSN_SIGNATURE_MAX_SIZE]);
 	~peer_verify_identity();
 
 	void first_action(UINT32 &type, size_t &expected_size);
@@ -80,7 +138,29 @@ public:
 
 	void send();
 private:
-	std::string message_;
+	bool verify(public_key_pointer key, const std::string &sign_message);
+	void verified(bool success);
+
+	BYTE signature_[DDSN_SIGNATURE_MAX_SIZE];
+	size_t signature_size_;
+	// secret agreed on while verifying, kept as session ticket for the peer
+	BYTE ticket_secret_[32];
+	bool ticket_agreed_;
+};
+
+class peer_resume_identity : public peer_message {
+public:
+	peer_resume_identity(local_peer &local_peer, peer_connection::pointer connection);
+	peer_resume_identity(local_peer &local_peer, peer_connection::pointer connection, const BYTE mac[32]);
+	~peer_resume_identity();
+
+	void first_action(UINT32 &type, size_t &expected_size);
+	void feed(const std::string &line, UINT32 &type, size_t &expected_size);
+	void feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size);
+
+	void send();
+private:
+	BYTE mac_[32];
 };
 
 class peer_welcome : public peer_message {
@@ -181,13 +261,39 @@ public:
 	void first_action(UINT32 &type, size_t &expected_size);
 	void feed(const std::string &line, UINT32 &type, size_t &expected_size);
 	void feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size);
+	void feed(frame_reader &frame, UINT32 &type, size_t &expected_size);
+	bool feed_partial(const BYTE *data, size_t size);
 
 	void send();
 private:
+	// inflate and verify the received block
+	bool check();
+	void checked(bool valid);
+	// continue a detached copy once the owner key arrived
+	void owner_arrived(public_key_pointer owner);
+	// the leaf hashes of Merkle blocks come before the data
+	void expect_data(UINT32 &type, size_t &expected_size);
+
 	block block_;
 
 	UINT32 state_;
+	int signature_type_;
+	// the owner key comes as PEM, or just its hash with key references
 	std::string public_key_;
+	// or as DER in a frame
+	std::string public_key_der_;
+	BYTE owner_hash_[32];
+	bool key_reference_;
+	// holds the owner key fetched early, the registry only has it while it's used
+	std::shared_ptr<public_key_pointer> fetched_owner_;
+	size_t encoded_size_;
+	shared_buffer received_;
+	// hash of the data received so far, unless it's deflated
+	data_hasher hasher_;
+	size_t hashed_;
+	// Merkle blocks: the leaf hashes sent ahead, checked chunk by chunk
+	shared_buffer leaf_hashes_;
+	merkle_hasher merkle_hasher_;
 };
 
 class peer_load_block : public peer_message {
@@ -199,6 +305,7 @@ public:
 	void first_action(UINT32 &type, size_t &expected_size);
 	void feed(const std::string &line, UINT32 &type, size_t &expected_size);
 	void feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size);
+	void feed(frame_reader &frame, UINT32 &type, size_t &expected_size);
 
 	void send();
 private:
@@ -214,6 +321,7 @@ public:
 	void first_action(UINT32 &type, size_t &expected_size);
 	void feed(const std::string &line, UINT32 &type, size_t &expected_size);
 	void feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size);
+	void feed(frame_reader &frame, UINT32 &type, size_t &expected_size);
 
 	void send();
 private:
@@ -230,13 +338,75 @@ public:
 	void first_action(UINT32 &type, size_t &expected_size);
 	void feed(const std::string &line, UINT32 &type, size_t &expected_size);
 	void feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size);
+	void feed(frame_reader &frame, UINT32 &type, size_t &expected_size);
+	bool feed_partial(const BYTE *data, size_t size);
 
 	void send();
 private:
+	// inflate and verify the received block
+	bool check();
+	void checked(bool valid);
+	// continue a detached copy once the owner key arrived
+	void owner_arrived(public_key_pointer owner);
+	// the leaf hashes of Merkle blocks come before the data
+	void expect_data(UINT32 &type, size_t &expected_size);
+
 	UINT32 state_;
 	block block_;
+	int signature_type_;
+	// the owner key comes as PEM, or just its hash with key references
 	std::string public_key_;
+	// or as DER in a frame
+	std::string public_key_der_;
+	BYTE owner_hash_[32];
+	bool key_reference_;
+	// holds the owner key fetched early, the registry only has it while it's used
+	std::shared_ptr<public_key_pointer> fetched_owner_;
 	bool success_;
+	size_t encoded_size_;
+	shared_buffer received_;
+	// hash of the data received so far, unless it's deflated
+	data_hasher hasher_;
+	size_t hashed_;
+	// Merkle blocks: the leaf hashes sent ahead, checked chunk by chunk
+	shared_buffer leaf_hashes_;
+	merkle_hasher merkle_hasher_;
+};
+
+class peer_get_key : public peer_message {
+public:
+	peer_get_key(local_peer &local_peer, peer_connection::pointer connection);
+	peer_get_key(local_peer &local_peer, peer_connection::pointer connection, const BYTE hash[32]);
+	~peer_get_key();
+
+	void first_action(UINT32 &type, size_t &expected_size);
+	void feed(const std::string &line, UINT32 &type, size_t &expected_size);
+	void feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size);
+
+	void send();
+private:
+	BYTE hash_[32];
+};
+
+class peer_key : public peer_message {
+public:
+	peer_key(local_peer &local_peer, peer_connection::pointer connection);
+	// key is nullptr if it's unknown
+	peer_key(local_peer &local_peer, peer_connection::pointer connection, const BYTE hash[32], public_key_pointer key);
+	~peer_key();
+
+	void first_action(UINT32 &type, size_t &expected_size);
+	void feed(const std::string &line, UINT32 &type, size_t &expected_size);
+	void feed(const BYTE *data, size_t size, UINT32 &type, size_t &expected_size);
+
+	void send();
+private:
+	UINT32 state_;
+	BYTE hash_[32];
+	bool hash_set_;
+	bool success_;
+	public_key_pointer key_;
+	std::string public_key_;
 };
 
 }
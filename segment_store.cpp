@@ -0,0 +1,933 @@
+#include "segment_store.h"
+
+#include "sha256.h"
+
+#include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+using namespace ddsn;
+using namespace std;
+
+segment_block_store::segment_block_store(key_table &keys, const string &directory) :
+keys_(keys), directory_(directory), active_segment_(0), active_end_(0), ring_(nullptr) {
+
+}
+
+segment_block_store::~segment_block_store() {
+	for (auto it = files_.begin(); it != files_.end(); ++it) {
+		delete *it;
+	}
+
+	for (auto it = fds_.begin(); it != fds_.end(); ++it) {
+		if (*it >= 0) {
+			close(*it);
+		}
+	}
+}
+
+void segment_block_store::set_ring(io_ring *ring) {
+	ring_ = ring;
+}
+
+string segment_block_store::segment_path(UINT32 segment) const {
+	char name[24];
+	snprintf(name, sizeof(name), "segment_%08x", segment);
+	return directory_ + name;
+}
+
+fstream *segment_block_store::segment_file(UINT32 segment) {
+	while (files_.size() <= segment) {
+		files_.push_back(nullptr);
+	}
+
+	if (files_[segment] == nullptr) {
+		string path = segment_path(segment);
+
+		if (!boost::filesystem::exists(path)) {
+			ofstream create(path, ios::out | ios::binary);
+			if (!create.is_open()) {
+				return nullptr;
+			}
+		}
+
+		fstream *file = new fstream(path, ios::in | ios::out | ios::binary);
+
+		if (!file->is_open()) {
+			delete file;
+			return nullptr;
+		}
+
+		files_[segment] = file;
+	}
+
+	return files_[segment];
+}
+
+int segment_block_store::segment_fd(UINT32 segment) {
+	while (fds_.size() <= segment) {
+		fds_.push_back(-1);
+	}
+
+	if (fds_[segment] < 0) {
+		fds_[segment] = ::open(segment_path(segment).c_str(), O_RDWR | O_CREAT, 0644);
+	}
+
+	return fds_[segment];
+}
+
+shared_buffer segment_block_store::map(UINT32 segment, UINT64 offset, size_t size) {
+	while (maps_.size() <= segment) {
+		maps_.push_back(nullptr);
+	}
+
+	if (!maps_[segment] || offset + size > maps_[segment]->size()) {
+		// the segment grew since it was mapped, views on the old mapping stay valid
+		maps_[segment] = mapped_file::open(segment_path(segment));
+	}
+
+	return shared_buffer::map(maps_[segment], offset, size);
+}
+
+int segment_block_store::open(const block_manifest &manifest) {
+	index_.clear();
+	payloads_.clear();
+
+	vector<UINT32> segments;
+	list_segments(segments);
+
+	if (segments.empty()) {
+		// empty store, start the first segment
+		active_segment_ = 0;
+		active_end_ = 0;
+
+		return segment_file(0) != nullptr ? 0 : 1;
+	}
+
+	if (!manifest.located() || load_manifest(manifest, segments) != 0) {
+		if (manifest.located()) {
+			cout << "Block manifest doesn't match the segments, scanning them" << endl;
+		}
+
+		index_.clear();
+		payloads_.clear();
+
+		for (size_t i = 0; i < segments.size(); i++) {
+			if (scan_segment(segments[i], i + 1 == segments.size(), 0) != 0) {
+				return 1;
+			}
+		}
+	}
+
+	count_refs();
+
+	cout << "Opened " << segments.size() << " segments with " << index_.size() << " blocks and " << payloads_.size() << " payloads" << endl;
+
+	// the last segment is still appended to
+	segments.pop_back();
+	compact(segments);
+
+	return 0;
+}
+
+int segment_block_store::load_manifest(const block_manifest &manifest, const vector<UINT32> &segments) {
+	std::map<UINT32, UINT64> sizes;
+
+	for (auto it = segments.begin(); it != segments.end(); ++it) {
+		sizes[*it] = boost::filesystem::file_size(segment_path(*it));
+	}
+
+	UINT32 last = segments.back();
+	// end of the last record of the last segment the manifest knows about
+	UINT64 end = 0;
+
+	for (auto it = manifest.entries().begin(); it != manifest.entries().end(); ++it) {
+		const manifest_entry &entry = it->second;
+
+		if (!entry.located) {
+			return 1;
+		}
+
+		location loc;
+		loc.segment = entry.record.segment;
+		loc.offset = entry.record.offset;
+		loc.length = entry.record.length;
+		loc.payload = entry.payload;
+
+		auto size = sizes.find(loc.segment);
+
+		if (size == sizes.end() || loc.offset + DDSN_SEGMENT_HEADER_SIZE + loc.length > size->second) {
+			return 1;
+		}
+
+		if (loc.segment == last) {
+			end = max(end, loc.offset + DDSN_SEGMENT_HEADER_SIZE + loc.length);
+		}
+
+		index_[entry.code] = loc;
+
+		if (loc.payload.layers() == 0) {
+			continue;
+		}
+
+		payload &p = payloads_[loc.payload];
+		p.loc.segment = entry.payload_record.segment;
+		p.loc.offset = entry.payload_record.offset;
+		p.loc.length = entry.payload_record.length;
+		p.refs = 0;
+		p.deflated = entry.payload_deflated;
+
+		size = sizes.find(p.loc.segment);
+
+		if (size == sizes.end() || p.loc.offset + DDSN_SEGMENT_HEADER_SIZE + p.loc.length > size->second) {
+			return 1;
+		}
+
+		if (p.loc.segment == last) {
+			end = max(end, p.loc.offset + DDSN_SEGMENT_HEADER_SIZE + p.loc.length);
+		}
+	}
+
+	// records appended after the manifest was last written (or torn by a crash)
+	return scan_segment(last, true, end);
+}
+
+void segment_block_store::list_segments(vector<UINT32> &segments) const {
+	if (!boost::filesystem::exists(directory_)) {
+		return;
+	}
+
+	boost::filesystem::directory_iterator end;
+
+	// compacted segments are deleted, so the numbers have gaps
+	for (boost::filesystem::directory_iterator it(directory_); it != end; ++it) {
+		string name = it->path().filename().string();
+
+		if (name.length() == 16 && name.compare(0, 8, "segment_") == 0 && name.find_first_not_of("0123456789abcdef", 8) == string::npos) {
+			segments.push_back(strtoul(name.c_str() + 8, nullptr, 16));
+		}
+	}
+
+	sort(segments.begin(), segments.end());
+}
+
+void segment_block_store::count_refs() {
+	for (auto it = payloads_.begin(); it != payloads_.end(); ++it) {
+		it->second.refs = 0;
+	}
+
+	// a payload may sit behind its block refs once it was moved by a compaction
+	for (auto it = index_.begin(); it != index_.end();) {
+		if (it->second.payload.layers() == 0) {
+			++it;
+			continue;
+		}
+
+		auto p = payloads_.find(it->second.payload);
+
+		if (p != payloads_.end()) {
+			p->second.refs++;
+			++it;
+		} else {
+			cout << "Block " << it->first.string('_') << " references a missing payload" << endl;
+			it = index_.erase(it);
+		}
+	}
+
+	// payloads whose blocks were all removed or overwritten
+	for (auto it = payloads_.begin(); it != payloads_.end();) {
+		if (it->second.refs == 0) {
+			it = payloads_.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+void segment_block_store::compact(const vector<UINT32> &segments) {
+	std::map<UINT32, UINT64> live;
+
+	for (auto it = index_.begin(); it != index_.end(); ++it) {
+		live[it->second.segment] += DDSN_SEGMENT_HEADER_SIZE + it->second.length;
+	}
+
+	for (auto it = payloads_.begin(); it != payloads_.end(); ++it) {
+		live[it->second.loc.segment] += DDSN_SEGMENT_HEADER_SIZE + it->second.loc.length;
+	}
+
+	// tombstones only matter while an older segment may still hold the blocks they remove
+	bool older = false;
+
+	for (auto it = segments.begin(); it != segments.end(); ++it) {
+		UINT64 size = boost::filesystem::file_size(segment_path(*it));
+
+		if (live[*it] * 100 >= size * DDSN_SEGMENT_COMPACT_LIVE || compact_segment(*it, older) != 0) {
+			older = true;
+		}
+	}
+}
+
+int segment_block_store::compact_segment(UINT32 segment, bool tombstones) {
+	UINT64 file_size = boost::filesystem::file_size(segment_path(segment));
+	UINT64 offset = 0;
+	UINT64 kept = 0;
+
+	// segments the live records were copied to
+	set<UINT32> written;
+
+	while (offset + DDSN_SEGMENT_HEADER_SIZE <= file_size) {
+		shared_buffer header = read_bytes(segment, offset, DDSN_SEGMENT_HEADER_SIZE);
+
+		if (header.empty()) {
+			return 1;
+		}
+
+		BYTE type = header.data()[0];
+		ddsn::code code(256, header.data() + 1);
+		UINT32 length;
+		memcpy(&length, header.data() + 33, 4);
+
+		if (type == 0 || offset + DDSN_SEGMENT_HEADER_SIZE + length > file_size) {
+			// the rest wasn't found on open either
+			break;
+		}
+
+		bool copy = false;
+		location *moved = nullptr;
+
+		if (type == DDSN_SEGMENT_RECORD_BLOCK || type == DDSN_SEGMENT_RECORD_BLOCK_REF) {
+			auto it = index_.find(code);
+			copy = it != index_.end() && it->second.segment == segment && it->second.offset == offset;
+			moved = copy ? &it->second : nullptr;
+		} else if (type == DDSN_SEGMENT_RECORD_PAYLOAD) {
+			auto it = payloads_.find(code);
+			copy = it != payloads_.end() && it->second.loc.segment == segment && it->second.loc.offset == offset;
+			moved = copy ? &it->second.loc : nullptr;
+		} else if (type == DDSN_SEGMENT_RECORD_TOMBSTONE) {
+			copy = tombstones && index_.count(code) == 0;
+		}
+
+		if (copy) {
+			shared_buffer body = length > 0 ? read_bytes(segment, offset + DDSN_SEGMENT_HEADER_SIZE, length) : shared_buffer();
+
+			struct iovec piece;
+			piece.iov_base = (void *)body.data();
+			piece.iov_len = length;
+
+			location loc;
+
+			if ((length > 0 && body.empty()) || append(type, code, &piece, length > 0 ? 1 : 0, loc) != 0) {
+				cout << "Could not compact segment " << segment << endl;
+				return 1;
+			}
+
+			if (moved != nullptr) {
+				moved->segment = loc.segment;
+				moved->offset = loc.offset;
+			}
+
+			written.insert(loc.segment);
+			kept += DDSN_SEGMENT_HEADER_SIZE + length;
+		}
+
+		offset += DDSN_SEGMENT_HEADER_SIZE + length;
+	}
+
+	// the copies must be on disk before the originals go
+	for (auto it = written.begin(); it != written.end(); ++it) {
+		if (fdatasync(segment_fd(*it)) != 0) {
+			cout << "Could not compact segment " << segment << endl;
+			return 1;
+		}
+	}
+
+	if (segment < fds_.size() && fds_[segment] >= 0) {
+		close(fds_[segment]);
+		fds_[segment] = -1;
+	}
+
+	if (segment < files_.size()) {
+		delete files_[segment];
+		files_[segment] = nullptr;
+	}
+
+	if (segment < maps_.size()) {
+		maps_[segment].reset();
+	}
+
+	boost::system::error_code error;
+	boost::filesystem::remove(segment_path(segment), error);
+
+	cout << "Compacted segment " << segment << ", moved " << kept << " of " << file_size << " bytes" << endl;
+
+	return 0;
+}
+
+int segment_block_store::scan_segment(UINT32 segment, bool last, UINT64 offset) {
+	fstream *file = segment_file(segment);
+
+	if (file == nullptr) {
+		return 1;
+	}
+
+	UINT64 file_size = boost::filesystem::file_size(segment_path(segment));
+
+	file->clear();
+
+	while (offset + DDSN_SEGMENT_HEADER_SIZE <= file_size) {
+		// the header, plus the content hash of block ref records
+		BYTE header[DDSN_SEGMENT_HEADER_SIZE + 32];
+
+		file->seekg(offset, ios::beg);
+		file->read((CHAR *)header, DDSN_SEGMENT_HEADER_SIZE);
+
+		if (!file->good()) {
+			break;
+		}
+
+		BYTE type = header[0];
+		ddsn::code code(256, header + 1);
+		UINT32 length;
+		memcpy(&length, header + 33, 4);
+
+		if (offset + DDSN_SEGMENT_HEADER_SIZE + length > file_size) {
+			break;
+		}
+
+		location loc;
+		loc.segment = segment;
+		loc.offset = offset;
+		loc.length = length;
+
+		if (type == DDSN_SEGMENT_RECORD_BLOCK || type == DDSN_SEGMENT_RECORD_BLOCK_REF || type == DDSN_SEGMENT_RECORD_TOMBSTONE) {
+			auto it = index_.find(code);
+
+			if (it != index_.end()) {
+				// replaced or removed
+				index_.erase(it);
+			}
+		}
+
+		if (type == DDSN_SEGMENT_RECORD_BLOCK) {
+			index_[code] = loc;
+		} else if (type == DDSN_SEGMENT_RECORD_BLOCK_REF) {
+			if (length < 32) {
+				break;
+			}
+
+			file->read((CHAR *)header + DDSN_SEGMENT_HEADER_SIZE, 32);
+
+			if (!file->good()) {
+				break;
+			}
+
+			// the payload is looked up once all segments are scanned
+			loc.payload = ddsn::code(256, header + DDSN_SEGMENT_HEADER_SIZE);
+			index_[code] = loc;
+		} else if (type == DDSN_SEGMENT_RECORD_PAYLOAD) {
+			BYTE flags = 0;
+			file->read((CHAR *)&flags, 1);
+
+			if (length < 1 || !file->good()) {
+				break;
+			}
+
+			// the last copy of a payload wins, it may be appended again after it was dropped
+			payload &p = payloads_[code];
+			p.loc = loc;
+			p.refs = 0;
+			p.deflated = (flags & DDSN_BLOCK_FLAG_DEFLATED) != 0;
+		} else if (type == 0) {
+			// zeros, space that was reserved but never written
+			break;
+		}
+
+		// padding (and records of unknown types) are skipped by their length
+		offset += DDSN_SEGMENT_HEADER_SIZE + length;
+	}
+
+	file->clear();
+
+	if (offset < file_size && last) {
+		// torn record at the end (crash while appending), cut it off
+		// appends behind it didn't succeed, they wait for the records before them
+		cout << "Truncating segment " << segment << " from " << file_size << " to " << offset << " bytes" << endl;
+		boost::filesystem::resize_file(segment_path(segment), offset);
+	} else if (offset < file_size) {
+		// never cut into an older segment, only the last one ends in appends that were cut short
+		cout << "Segment " << segment << " has an unreadable record at " << offset << ", skipping the " << file_size - offset << " bytes behind it" << endl;
+	}
+
+	active_segment_ = segment;
+	active_end_ = offset;
+
+	return 0;
+}
+
+int segment_block_store::append(BYTE type, const ddsn::code &code, const struct iovec *pieces, int count, location &loc) {
+	BYTE header[DDSN_SEGMENT_HEADER_SIZE];
+	UINT32 length = 0;
+
+	for (int i = 0; i < count; i++) {
+		length += pieces[i].iov_len;
+	}
+
+	header[0] = type;
+	memcpy(header + 1, code.bytes(), 32);
+	memcpy(header + 33, &length, 4);
+
+	unique_lock<mutex> lock(mutex_);
+
+	if (active_end_ > 0 && active_end_ + DDSN_SEGMENT_HEADER_SIZE + length > DDSN_SEGMENT_MAX_SIZE) {
+		// roll over to a new segment
+		active_segment_++;
+		active_end_ = 0;
+	}
+
+	loc.segment = active_segment_;
+	loc.offset = active_end_;
+	loc.length = length;
+
+	if (ring_ != nullptr) {
+		int fd = segment_fd(loc.segment);
+
+		if (fd < 0) {
+			return 1;
+		}
+
+		// reserve the space and write without the lock, so concurrent appends share a submission
+		active_end_ += DDSN_SEGMENT_HEADER_SIZE + length;
+
+		pair<UINT32, UINT64> reserved(loc.segment, loc.offset);
+		pending_.insert(reserved);
+
+		lock.unlock();
+
+		vector<struct iovec> iov;
+		iov.push_back({ header, DDSN_SEGMENT_HEADER_SIZE });
+		iov.insert(iov.end(), pieces, pieces + count);
+
+		bool written = ring_->writev(fd, iov.data(), iov.size(), loc.offset) == (ssize_t)(DDSN_SEGMENT_HEADER_SIZE + length);
+		bool padded = written;
+
+		if (!written) {
+			cout << "Could not append to segment " << loc.segment << endl;
+
+			// cover the space with a padding record, so the records behind it are found on open
+			header[0] = DDSN_SEGMENT_RECORD_PADDING;
+			struct iovec padding = { header, DDSN_SEGMENT_HEADER_SIZE };
+
+			padded = ring_->writev(fd, &padding, 1, loc.offset) == DDSN_SEGMENT_HEADER_SIZE;
+		}
+
+		lock.lock();
+
+		if (!padded) {
+			// open stops at the hole, nothing behind it may be reported as stored
+			auto hole = holes_.find(loc.segment);
+
+			if (hole == holes_.end() || hole->second > loc.offset) {
+				holes_[loc.segment] = loc.offset;
+			}
+
+			if (active_segment_ == loc.segment) {
+				active_segment_++;
+				active_end_ = 0;
+			}
+		}
+
+		pending_.erase(reserved);
+		pending_done_.notify_all();
+
+		// wait for the records before this one in the segment
+		while (true) {
+			auto first = pending_.lower_bound(make_pair(loc.segment, (UINT64)0));
+
+			if (first == pending_.end() || *first >= reserved) {
+				break;
+			}
+
+			pending_done_.wait(lock);
+		}
+
+		auto hole = holes_.find(loc.segment);
+
+		if (hole != holes_.end() && hole->second < loc.offset) {
+			cout << "Record at " << loc.offset << " of segment " << loc.segment << " is behind a hole" << endl;
+			return 1;
+		}
+
+		return written ? 0 : 1;
+	}
+
+	fstream *file = segment_file(loc.segment);
+
+	if (file == nullptr) {
+		return 1;
+	}
+
+	file->clear();
+	file->seekp(loc.offset, ios::beg);
+	file->write((CHAR *)header, DDSN_SEGMENT_HEADER_SIZE);
+
+	for (int i = 0; i < count; i++) {
+		file->write((const CHAR *)pieces[i].iov_base, pieces[i].iov_len);
+	}
+
+	file->flush();
+
+	if (!file->good()) {
+		file->clear();
+		return 1;
+	}
+
+	active_end_ += DDSN_SEGMENT_HEADER_SIZE + length;
+
+	return 0;
+}
+
+shared_buffer segment_block_store::read_bytes(UINT32 segment, UINT64 offset, size_t size) {
+	if (mapped_reads_) {
+		lock_guard<mutex> lock(mutex_);
+		return map(segment, offset, size);
+	}
+
+	shared_buffer data(size);
+	int fd;
+
+	{
+		lock_guard<mutex> lock(mutex_);
+		fd = segment_fd(segment);
+	}
+
+	if (fd < 0) {
+		return shared_buffer();
+	}
+
+	// records are never changed once appended, no lock needed
+	if (ring_ != nullptr) {
+		if (ring_->read(fd, data.mutable_data(), size, offset) != (ssize_t)size) {
+			return shared_buffer();
+		}
+
+		return data;
+	}
+
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t n = pread(fd, data.mutable_data() + done, size - done, offset + done);
+
+		if (n <= 0) {
+			return shared_buffer();
+		}
+
+		done += n;
+	}
+
+	return data;
+}
+
+int segment_block_store::acquire_payload(const ddsn::code &hash, const shared_buffer &stored, bool deflated, payload &p) {
+	lock_guard<mutex> payload_lock(payload_mutex_);
+
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		auto it = payloads_.find(hash);
+
+		if (it != payloads_.end()) {
+			it->second.refs++;
+			p = it->second;
+			return 0;
+		}
+	}
+
+	BYTE flags = deflated ? DDSN_BLOCK_FLAG_DEFLATED : 0;
+
+	struct iovec pieces[2];
+	pieces[0].iov_base = &flags;
+	pieces[0].iov_len = 1;
+	pieces[1].iov_base = (void *)stored.data();
+	pieces[1].iov_len = stored.size();
+
+	location loc;
+
+	if (append(DDSN_SEGMENT_RECORD_PAYLOAD, hash, pieces, 2, loc) != 0) {
+		return 1;
+	}
+
+	p.loc = loc;
+	p.refs = 1;
+	p.deflated = deflated;
+
+	lock_guard<mutex> lock(mutex_);
+
+	payloads_[hash] = p;
+
+	return 0;
+}
+
+void segment_block_store::release_payload(const ddsn::code &hash) {
+	// called with mutex_ held
+	auto it = payloads_.find(hash);
+
+	if (it != payloads_.end() && --it->second.refs == 0) {
+		// the space is only given back when the segment is rewritten
+		payloads_.erase(it);
+	}
+}
+
+int segment_block_store::save(const block &block) {
+	if (block.code().layers() != 256) {
+		return -1;
+	}
+
+	if (keys_.add(block.owner()) != 0) {
+		return 1;
+	}
+
+	ostringstream record;
+	location loc;
+
+	if (block.size() >= DDSN_SEGMENT_DEDUP_MIN_SIZE) {
+		BYTE hash_bytes[32];
+		sha256::hash(block.data(), block.size(), hash_bytes);
+		ddsn::code hash(256, hash_bytes);
+
+		shared_buffer stored = deflate_ ? block.deflated() : shared_buffer();
+		bool deflated = !stored.empty();
+
+		if (!deflated) {
+			stored = block.data_buffer();
+		}
+
+		payload p;
+
+		if (acquire_payload(hash, stored, deflated, p) != 0) {
+			return 1;
+		}
+
+		// the payload may have been stored in another form by an earlier block
+		if (block.write_reference(record, p.loc.length - 1, p.deflated) != 0) {
+			lock_guard<mutex> lock(mutex_);
+			release_payload(hash);
+			return 1;
+		}
+
+		string header = record.str();
+
+		struct iovec pieces[2];
+		pieces[0].iov_base = hash_bytes;
+		pieces[0].iov_len = 32;
+		pieces[1].iov_base = (void *)header.data();
+		pieces[1].iov_len = header.length();
+
+		if (append(DDSN_SEGMENT_RECORD_BLOCK_REF, block.code(), pieces, 2, loc) != 0) {
+			lock_guard<mutex> lock(mutex_);
+			release_payload(hash);
+			return 1;
+		}
+
+		loc.payload = hash;
+	} else {
+		if (block.write(record, deflate_) != 0) {
+			return 1;
+		}
+
+		string data = record.str();
+
+		struct iovec piece;
+		piece.iov_base = (void *)data.data();
+		piece.iov_len = data.length();
+
+		if (append(DDSN_SEGMENT_RECORD_BLOCK, block.code(), &piece, 1, loc) != 0) {
+			return 1;
+		}
+	}
+
+	lock_guard<mutex> lock(mutex_);
+
+	auto it = index_.find(block.code());
+
+	if (it != index_.end() && it->second.payload.layers() > 0) {
+		release_payload(it->second.payload);
+	}
+
+	index_[block.code()] = loc;
+
+	return 0;
+}
+
+int segment_block_store::load(block &block) {
+	if (block.code().layers() != 256) {
+		return -1;
+	}
+
+	location loc;
+	location payload_loc;
+
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		auto it = index_.find(block.code());
+
+		if (it == index_.end()) {
+			return 1;
+		}
+
+		loc = it->second;
+
+		if (loc.payload.layers() > 0) {
+			auto p = payloads_.find(loc.payload);
+
+			if (p == payloads_.end()) {
+				return 1;
+			}
+
+			payload_loc = p->second.loc;
+		}
+	}
+
+	// the block record starts after the segment header (and the content hash)
+	UINT64 offset = loc.offset + DDSN_SEGMENT_HEADER_SIZE;
+	size_t length = loc.length;
+
+	if (loc.payload.layers() > 0) {
+		offset += 32;
+		length -= 32;
+	}
+
+	// the first read gets the block header and, for most blocks, the data as well
+	size_t prefix = min(length, (size_t)DDSN_SEGMENT_READ_PREFIX);
+	shared_buffer record = read_bytes(loc.segment, offset, prefix);
+
+	if (record.empty() || prefix < DDSN_BLOCK_RECORD_HEADER_SIZE) {
+		return 1;
+	}
+
+	size_t data_offset = block::record_header_size(record.data());
+
+	if (data_offset == 0 || data_offset > prefix) {
+		// not a block record, or a name too long for the first read
+		return 1;
+	}
+
+	int ret_code = block.read_header(record.data(), data_offset);
+
+	if (ret_code != 0) {
+		return ret_code;
+	}
+
+	shared_buffer data;
+
+	if (block.stored_external()) {
+		if (loc.payload.layers() == 0 || block.stored_size() != payload_loc.length - 1) {
+			return 1;
+		}
+
+		data = read_bytes(payload_loc.segment, payload_loc.offset + DDSN_SEGMENT_HEADER_SIZE + 1, block.stored_size());
+	} else if (data_offset + block.stored_size() > length) {
+		return 1;
+	} else if (data_offset + block.stored_size() <= prefix) {
+		data = record.slice(data_offset, block.stored_size());
+	} else {
+		data = read_bytes(loc.segment, offset + data_offset, block.stored_size());
+	}
+
+	if (data.empty() && block.stored_size() != 0) {
+		return 1;
+	}
+
+	ret_code = block.set_stored_data(data);
+
+	if (ret_code != 0) {
+		return ret_code;
+	}
+
+	// verification doesn't need the lock
+	return finish_load(block, keys_);
+}
+
+int segment_block_store::remove(const ddsn::code &code) {
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		if (index_.find(code) == index_.end()) {
+			return 1;
+		}
+	}
+
+	location loc;
+
+	if (append(DDSN_SEGMENT_RECORD_TOMBSTONE, code, nullptr, 0, loc) != 0) {
+		return 1;
+	}
+
+	lock_guard<mutex> lock(mutex_);
+
+	auto it = index_.find(code);
+
+	if (it != index_.end()) {
+		if (it->second.payload.layers() > 0) {
+			release_payload(it->second.payload);
+		}
+
+		index_.erase(it);
+	}
+
+	return 0;
+}
+
+int segment_block_store::list(vector<ddsn::code> &codes) {
+	lock_guard<mutex> lock(mutex_);
+
+	for (auto it = index_.begin(); it != index_.end(); ++it) {
+		codes.push_back(it->first);
+	}
+
+	return 0;
+}
+
+public_key_pointer segment_block_store::owner_key(const BYTE hash[32]) {
+	return keys_.get(hash);
+}
+
+void segment_block_store::locate(const ddsn::code &code, manifest_entry &entry) {
+	lock_guard<mutex> lock(mutex_);
+
+	entry.located = false;
+
+	auto it = index_.find(code);
+
+	if (it == index_.end()) {
+		return;
+	}
+
+	const location &loc = it->second;
+
+	entry.record.segment = loc.segment;
+	entry.record.offset = loc.offset;
+	entry.record.length = loc.length;
+	entry.payload = loc.payload;
+
+	if (loc.payload.layers() > 0) {
+		auto p = payloads_.find(loc.payload);
+
+		if (p == payloads_.end()) {
+			return;
+		}
+
+		entry.payload_record.segment = p->second.loc.segment;
+		entry.payload_record.offset = p->second.loc.offset;
+		entry.payload_record.length = p->second.loc.length;
+		entry.payload_deflated = p->second.deflated;
+	}
+
+	entry.located = true;
+}
@@ -0,0 +1,155 @@
+#ifndef DDSN_SEGMENT_STORE_H
+#define DDSN_SEGMENT_STORE_H
+
+#include "block_store.h"
+#include "buffer.h"
+#include "code.h"
+#include "definitions.h"
+#include "io_ring.h"
+
+#include <sys/uio.h>
+#include <condition_variable>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define DDSN_SEGMENT_RECORD_BLOCK     1
+#define DDSN_SEGMENT_RECORD_TOMBSTONE 2
+#define DDSN_SEGMENT_RECORD_PAYLOAD   3
+#define DDSN_SEGMENT_RECORD_BLOCK_REF 4
+// fills the space of a record that couldn't be written
+#define DDSN_SEGMENT_RECORD_PADDING   5
+
+#define DDSN_SEGMENT_HEADER_SIZE 37
+
+// blocks read with a first read of this size usually need no second one
+#define DDSN_SEGMENT_READ_PREFIX 64 * 1024
+
+// smaller blocks keep their data in their own record
+#define DDSN_SEGMENT_DEDUP_MIN_SIZE 4 * 1024
+
+// sealed segments with less live data than this (percent) are rewritten on open
+#define DDSN_SEGMENT_COMPACT_LIVE 50
+
+namespace ddsn {
+
+/*
+ * Log-structured block store.
+ * Blocks are appended to large segment files (blocks/segment_<n>) and found
+ * through an in-memory index from block code to (segment, offset, length).
+ * The index is rebuilt on open from the locations kept in the block manifest.
+ * Every record starts with a header of type (1 byte), code (32 bytes) and
+ * length (4 bytes), so without a manifest the index is rebuilt by hopping
+ * from header to header. Removing a block appends a tombstone record.
+ *
+ * Block data of DDSN_SEGMENT_DEDUP_MIN_SIZE bytes or more is stored once per
+ * content: a payload record, keyed by the SHA-256 of the data, holds the
+ * (maybe deflated) bytes and block ref records hold the content hash and a
+ * block record without data. Payload reference counts are rebuilt from the
+ * block ref records on open; payloads nobody references any more are dropped
+ * from the index.
+ *
+ * Space of replaced and removed blocks is given back on open: the live records
+ * of a sealed segment that is mostly dead are appended again and the segment
+ * is deleted, so segment numbers have gaps.
+ *
+ * Safe to use from several disk threads, appends and the index are shared
+ * under one lock. Records never change once appended, so they are read with
+ * pread on a descriptor per segment outside of the lock.
+ * With an io_ring, records are written and read through io_uring outside
+ * of the lock instead of through the fstreams and pread. Space for them is reserved
+ * under the lock, and an append only succeeds once every record before it in
+ * the segment is written, so no stored block sits behind a hole. The space
+ * of a failed write is covered with a padding record.
+ */
+class segment_block_store : public block_store {
+public:
+	segment_block_store(key_table &keys, const std::string &directory = "blocks/");
+	~segment_block_store();
+
+	// read and write through io_uring (must be set before open)
+	void set_ring(io_ring *ring);
+
+	int open(const block_manifest &manifest);
+
+	int save(const block &block);
+	int load(block &block);
+	int remove(const code &code);
+
+	int list(std::vector<code> &codes);
+
+	public_key_pointer owner_key(const BYTE hash[32]);
+
+	void locate(const code &code, manifest_entry &entry);
+private:
+	struct location {
+		UINT32 segment;
+		UINT64 offset;
+		UINT32 length;
+
+		// content hash of the payload for block ref records, no layers otherwise
+		code payload;
+	};
+
+	struct payload {
+		location loc;
+		UINT32 refs;
+		bool deflated;
+	};
+
+	std::string segment_path(UINT32 segment) const;
+	std::fstream *segment_file(UINT32 segment);
+	int segment_fd(UINT32 segment);
+	shared_buffer map(UINT32 segment, UINT64 offset, size_t size);
+	void list_segments(std::vector<UINT32> &segments) const;
+	// take the index from the manifest, only the end of the last segment is scanned
+	int load_manifest(const block_manifest &manifest, const std::vector<UINT32> &segments);
+	// a torn record is only cut off the last segment
+	int scan_segment(UINT32 segment, bool last, UINT64 offset);
+	void count_refs();
+
+	// rewrite the live records of mostly dead segments and delete them
+	void compact(const std::vector<UINT32> &segments);
+	int compact_segment(UINT32 segment, bool tombstones);
+
+	// empty buffer on failure
+	shared_buffer read_bytes(UINT32 segment, UINT64 offset, size_t size);
+	int append(BYTE type, const code &code, const struct iovec *pieces, int count, location &loc);
+
+	// take a reference on the payload of the data, appending it if it's new
+	int acquire_payload(const code &hash, const shared_buffer &stored, bool deflated, payload &p);
+	void release_payload(const code &hash);
+
+	key_table &keys_;
+	std::string directory_;
+
+	std::unordered_map<code, location> index_;
+	std::unordered_map<code, payload> payloads_;
+	std::vector<std::fstream *> files_;
+	std::vector<int> fds_;
+	std::vector<std::shared_ptr<mapped_file>> maps_;
+
+	UINT32 active_segment_;
+	UINT64 active_end_;
+
+	// reserved records (segment, offset) still being written through the ring
+	std::set<std::pair<UINT32, UINT64>> pending_;
+	std::condition_variable pending_done_;
+	// offset of the first space in a segment that couldn't be written or padded
+	std::map<UINT32, UINT64> holes_;
+
+	io_ring *ring_;
+
+	std::mutex mutex_;
+	// held while a payload is looked up and appended, so it's only appended once
+	std::mutex payload_mutex_;
+};
+
+}
+
+#endif
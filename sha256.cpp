@@ -0,0 +1,523 @@
+#include "sha256.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define DDSN_SHA256_X86
+#endif
+
+using namespace ddsn;
+using namespace std;
+
+static const UINT32 initial_state[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const UINT32 round_constants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// compress blocks (64 bytes each) into the state
+typedef void (*compress_function)(UINT32 state[8], const BYTE *data, size_t blocks);
+
+#ifdef DDSN_SHA256_X86
+
+static bool cpu_has_sha() {
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+
+	// SHA extensions, the kernel also needs SSE4.1 for the blend
+	return (ebx & (1 << 29)) != 0 && __builtin_cpu_supports("sse4.1");
+}
+
+static bool cpu_has_avx2() {
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("sha,sse4.1")))
+static void compress_sha_ni(UINT32 state[8], const BYTE *data, size_t blocks) {
+	const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	// the instructions want the state as ABEF and CDGH
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	for (size_t block = 0; block < blocks; block++, data += 64) {
+		__m128i abef = state0;
+		__m128i cdgh = state1;
+
+		// message schedule, 4 words per group
+		__m128i w[4];
+
+		for (int i = 0; i < 4; i++) {
+			w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 16)), byte_swap);
+		}
+
+		// unrolled, so the schedule stays in registers
+#pragma GCC unroll 16
+		for (int i = 0; i < 16; i++) {
+			__m128i msg = _mm_add_epi32(w[i % 4], _mm_loadu_si128((const __m128i *)&round_constants[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+
+			if (i < 12) {
+				// words of group i + 4 from groups i to i + 3
+				__m128i next = _mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]);
+				next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+				w[i % 4] = _mm_sha256msg2_epu32(next, w[(i + 3) % 4]);
+			}
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i rotr8x(__m256i x, int n) {
+	return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+// one block of each of 8 messages, lane i of state[j] is word j of message i's state
+// lanes whose active mask is 0 keep their state
+__attribute__((target("avx2")))
+static void compress_avx2_x8(__m256i state[8], const BYTE *const blocks[DDSN_SHA256_LANES], __m256i active) {
+	const __m256i byte_swap = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL, 0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	__m256i w[16];
+
+	for (int half = 0; half < 2; half++) {
+		// transpose 8 words of 8 lanes, so w[t] holds word t of every lane
+		__m256i r[8], t[8], u[8];
+
+		for (int lane = 0; lane < DDSN_SHA256_LANES; lane++) {
+			r[lane] = _mm256_loadu_si256((const __m256i *)(blocks[lane] + half * 32));
+		}
+
+		for (int i = 0; i < 8; i += 2) {
+			t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+			t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+		}
+
+		for (int i = 0; i < 8; i += 4) {
+			u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+			u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+			u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+			u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+		}
+
+		for (int i = 0; i < 4; i++) {
+			w[half * 8 + i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x20), byte_swap);
+			w[half * 8 + i + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x31), byte_swap);
+		}
+	}
+
+	__m256i a = state[0], b = state[1], c = state[2], d = state[3];
+	__m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+#pragma GCC unroll 64
+	for (int t = 0; t < 64; t++) {
+		if (t >= 16) {
+			__m256i w15 = w[(t - 15) % 16];
+			__m256i w2 = w[(t - 2) % 16];
+			__m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr8x(w15, 7), rotr8x(w15, 18)), _mm256_srli_epi32(w15, 3));
+			__m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr8x(w2, 17), rotr8x(w2, 19)), _mm256_srli_epi32(w2, 10));
+			w[t % 16] = _mm256_add_epi32(_mm256_add_epi32(w[t % 16], s0), _mm256_add_epi32(w[(t - 7) % 16], s1));
+		}
+
+		__m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr8x(e, 6), rotr8x(e, 11)), rotr8x(e, 25));
+		__m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+		__m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, s1), _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32(round_constants[t]), w[t % 16])));
+		__m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr8x(a, 2), rotr8x(a, 13)), rotr8x(a, 22));
+		__m256i maj = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)), _mm256_and_si256(b, c));
+		__m256i t2 = _mm256_add_epi32(s0, maj);
+
+		h = g;
+		g = f;
+		f = e;
+		e = _mm256_add_epi32(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = _mm256_add_epi32(t1, t2);
+	}
+
+	__m256i result[8] = { a, b, c, d, e, f, g, h };
+
+	for (int j = 0; j < 8; j++) {
+		state[j] = _mm256_blendv_epi8(state[j], _mm256_add_epi32(state[j], result[j]), active);
+	}
+}
+
+// messages padded to blocks[lane] whole blocks, at most DDSN_SHA256_LANES of them
+__attribute__((target("avx2")))
+static void hash_lanes(const BYTE padded[][DDSN_SHA256_LANE_SIZE], const size_t lane_blocks[], size_t count, BYTE hashes[][32]) {
+	static const BYTE zero_block[64] = { 0 };
+
+	__m256i state[8];
+
+	for (int j = 0; j < 8; j++) {
+		state[j] = _mm256_set1_epi32(initial_state[j]);
+	}
+
+	size_t max_blocks = 0;
+
+	for (size_t lane = 0; lane < count; lane++) {
+		max_blocks = max(max_blocks, lane_blocks[lane]);
+	}
+
+	for (size_t block = 0; block < max_blocks; block++) {
+		const BYTE *blocks[DDSN_SHA256_LANES];
+		alignas(32) INT32 active[DDSN_SHA256_LANES];
+
+		for (size_t lane = 0; lane < DDSN_SHA256_LANES; lane++) {
+			bool has_block = lane < count && block < lane_blocks[lane];
+
+			blocks[lane] = has_block ? padded[lane] + block * 64 : zero_block;
+			active[lane] = has_block ? -1 : 0;
+		}
+
+		compress_avx2_x8(state, blocks, _mm256_load_si256((const __m256i *)active));
+	}
+
+	for (int j = 0; j < 8; j++) {
+		alignas(32) UINT32 words[DDSN_SHA256_LANES];
+		_mm256_store_si256((__m256i *)words, state[j]);
+
+		for (size_t lane = 0; lane < count; lane++) {
+			hashes[lane][j * 4] = words[lane] >> 24;
+			hashes[lane][j * 4 + 1] = words[lane] >> 16;
+			hashes[lane][j * 4 + 2] = words[lane] >> 8;
+			hashes[lane][j * 4 + 3] = words[lane];
+		}
+	}
+}
+
+#endif
+
+namespace {
+
+struct kernel_choice {
+	compress_function compress;
+	string name;
+	bool multi_buffer;
+	bool avx2;
+
+	// OpenSSL unless a kernel is asked for, the own ones are only faster
+	// where the bench says so
+	kernel_choice() : compress(nullptr), name("openssl"), multi_buffer(false), avx2(false) {
+#ifdef DDSN_SHA256_X86
+		avx2 = cpu_has_avx2();
+#endif
+	}
+};
+
+kernel_choice &choice() {
+	static kernel_choice kernel;
+	return kernel;
+}
+
+// fetched once, looking it up by name for every hash costs more than hashing a code
+const EVP_MD *digest() {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	static const EVP_MD *md = EVP_MD_fetch(nullptr, "SHA256", nullptr);
+#else
+	static const EVP_MD *md = EVP_sha256();
+#endif
+	return md;
+}
+
+// reused for one-shot hashes on each thread
+struct digest_context {
+	EVP_MD_CTX *ctx;
+
+	digest_context() : ctx(EVP_MD_CTX_new()) {
+	}
+
+	~digest_context() {
+		EVP_MD_CTX_free(ctx);
+	}
+};
+
+// message, 0x80, zeros and the length in bits, returns the number of blocks
+size_t pad(const BYTE *data, size_t size, BYTE padded[DDSN_SHA256_LANE_SIZE]) {
+	size_t padded_size = (size + 8) / 64 * 64 + 64;
+
+	memcpy(padded, data, size);
+	memset(padded + size, 0, padded_size - size);
+	padded[size] = 0x80;
+
+	UINT64 bits = (UINT64)size * 8;
+
+	for (int i = 0; i < 8; i++) {
+		padded[padded_size - 1 - i] = bits >> (i * 8);
+	}
+
+	return padded_size / 64;
+}
+
+}
+
+void sha256::hash(const void *data, size_t size, BYTE hash[32]) {
+	if (choice().compress == nullptr) {
+		static thread_local digest_context context;
+
+		EVP_DigestInit_ex(context.ctx, digest(), nullptr);
+		EVP_DigestUpdate(context.ctx, data, size);
+		EVP_DigestFinal_ex(context.ctx, hash, nullptr);
+		return;
+	}
+
+	sha256 sha;
+	sha.update(data, size);
+	sha.finish(hash);
+}
+
+void sha256::hmac(const BYTE *key, size_t key_size, const void *data, size_t size, BYTE mac[32]) {
+	BYTE block_key[64] = { 0 };
+
+	if (key_size > 64) {
+		hash(key, key_size, block_key);
+	} else {
+		memcpy(block_key, key, key_size);
+	}
+
+	BYTE pad[64];
+
+	for (int i = 0; i < 64; i++) {
+		pad[i] = block_key[i] ^ 0x36;
+	}
+
+	BYTE inner[32];
+	sha256 sha;
+	sha.update(pad, 64);
+	sha.update(data, size);
+	sha.finish(inner);
+
+	for (int i = 0; i < 64; i++) {
+		pad[i] = block_key[i] ^ 0x5c;
+	}
+
+	sha = sha256();
+	sha.update(pad, 64);
+	sha.update(inner, 32);
+	sha.finish(mac);
+}
+
+void sha256::hash_many(const BYTE *const data[], const size_t sizes[], size_t count, BYTE hashes[][32]) {
+#ifdef DDSN_SHA256_X86
+	if (choice().multi_buffer && count > 1) {
+		BYTE padded[DDSN_SHA256_LANES][DDSN_SHA256_LANE_SIZE];
+		size_t lane_blocks[DDSN_SHA256_LANES];
+		// where the messages of the lanes go
+		size_t lane_message[DDSN_SHA256_LANES];
+		BYTE lane_hashes[DDSN_SHA256_LANES][32];
+		size_t lanes = 0;
+
+		for (size_t i = 0; i < count; i++) {
+			if (sizes[i] > DDSN_SHA256_LANE_SIZE - 9) {
+				hash(data[i], sizes[i], hashes[i]);
+				continue;
+			}
+
+			lane_blocks[lanes] = pad(data[i], sizes[i], padded[lanes]);
+			lane_message[lanes] = i;
+			lanes++;
+
+			if (lanes == DDSN_SHA256_LANES) {
+				hash_lanes(padded, lane_blocks, lanes, lane_hashes);
+
+				for (size_t lane = 0; lane < lanes; lane++) {
+					memcpy(hashes[lane_message[lane]], lane_hashes[lane], 32);
+				}
+
+				lanes = 0;
+			}
+		}
+
+		if (lanes > 0) {
+			hash_lanes(padded, lane_blocks, lanes, lane_hashes);
+
+			for (size_t lane = 0; lane < lanes; lane++) {
+				memcpy(hashes[lane_message[lane]], lane_hashes[lane], 32);
+			}
+		}
+
+		return;
+	}
+#endif
+
+	for (size_t i = 0; i < count; i++) {
+		hash(data[i], sizes[i], hashes[i]);
+	}
+}
+
+vector<string> sha256::kernels() {
+	vector<string> names;
+	names.push_back("openssl");
+
+#ifdef DDSN_SHA256_X86
+	if (cpu_has_sha()) {
+		names.push_back("sha-ni");
+	}
+#endif
+
+	return names;
+}
+
+bool sha256::use_kernel(const string &name) {
+	if (name == "openssl") {
+		choice().compress = nullptr;
+#ifdef DDSN_SHA256_X86
+	} else if (name == "sha-ni" && cpu_has_sha()) {
+		choice().compress = &compress_sha_ni;
+#endif
+	} else {
+		return false;
+	}
+
+	choice().name = name;
+
+	return true;
+}
+
+string sha256::kernel() {
+	return choice().name;
+}
+
+bool sha256::multi_buffer() {
+	return choice().multi_buffer;
+}
+
+void sha256::set_multi_buffer(bool multi_buffer) {
+	choice().multi_buffer = multi_buffer && choice().avx2;
+}
+
+sha256::sha256() : compress_(choice().compress), ctx_(nullptr), buffered_(0), length_(0) {
+	if (compress_ == nullptr) {
+		ctx_ = EVP_MD_CTX_new();
+		EVP_DigestInit_ex(ctx_, digest(), nullptr);
+	}
+
+	memcpy(state_, initial_state, 32);
+}
+
+sha256::sha256(const sha256 &other) : compress_(other.compress_), ctx_(nullptr), buffered_(other.buffered_), length_(other.length_) {
+	if (other.ctx_ != nullptr) {
+		ctx_ = EVP_MD_CTX_new();
+		EVP_MD_CTX_copy_ex(ctx_, other.ctx_);
+	}
+
+	memcpy(state_, other.state_, 32);
+	memcpy(buffer_, other.buffer_, buffered_);
+}
+
+sha256::~sha256() {
+	EVP_MD_CTX_free(ctx_);
+}
+
+sha256 &sha256::operator=(const sha256 &other) {
+	if (this == &other) {
+		return *this;
+	}
+
+	if (other.ctx_ == nullptr) {
+		EVP_MD_CTX_free(ctx_);
+		ctx_ = nullptr;
+	} else {
+		if (ctx_ == nullptr) {
+			ctx_ = EVP_MD_CTX_new();
+		}
+
+		EVP_MD_CTX_copy_ex(ctx_, other.ctx_);
+	}
+
+	compress_ = other.compress_;
+	buffered_ = other.buffered_;
+	length_ = other.length_;
+	memcpy(state_, other.state_, 32);
+	memcpy(buffer_, other.buffer_, buffered_);
+
+	return *this;
+}
+
+void sha256::update(const void *data, size_t size) {
+	if (ctx_ != nullptr) {
+		EVP_DigestUpdate(ctx_, data, size);
+		return;
+	}
+
+	const BYTE *bytes = (const BYTE *)data;
+	length_ += size;
+
+	if (buffered_ > 0) {
+		size_t fill = min(size, 64 - buffered_);
+		memcpy(buffer_ + buffered_, bytes, fill);
+		buffered_ += fill;
+		bytes += fill;
+		size -= fill;
+
+		if (buffered_ < 64) {
+			return;
+		}
+
+		compress_(state_, buffer_, 1);
+		buffered_ = 0;
+	}
+
+	if (size >= 64) {
+		compress_(state_, bytes, size / 64);
+		bytes += size / 64 * 64;
+		size %= 64;
+	}
+
+	memcpy(buffer_, bytes, size);
+	buffered_ = size;
+}
+
+void sha256::finish(BYTE hash[32]) {
+	if (ctx_ != nullptr) {
+		EVP_DigestFinal_ex(ctx_, hash, nullptr);
+		return;
+	}
+
+	UINT64 bits = length_ * 8;
+
+	BYTE padding[72] = { 0x80 };
+	size_t padding_size = (buffered_ < 56 ? 56 : 120) - buffered_;
+
+	for (int i = 0; i < 8; i++) {
+		padding[padding_size + i] = bits >> (56 - i * 8);
+	}
+
+	update(padding, padding_size + 8);
+
+	for (int j = 0; j < 8; j++) {
+		hash[j * 4] = state_[j] >> 24;
+		hash[j * 4 + 1] = state_[j] >> 16;
+		hash[j * 4 + 2] = state_[j] >> 8;
+		hash[j * 4 + 3] = state_[j];
+	}
+}
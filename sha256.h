@@ -0,0 +1,65 @@
+#ifndef DDSN_SHA256_H
+#define DDSN_SHA256_H
+
+#include "definitions.h"
+
+#include <openssl/evp.h>
+#include <string>
+#include <vector>
+
+#define DDSN_SHA256_LANES 8
+// longer messages aren't hashed in the lanes
+#define DDSN_SHA256_LANE_SIZE 256
+
+namespace ddsn {
+
+/*
+ * SHA-256 for codes, ids and block data.
+ * OpenSSL hashes by default (it uses SHA-NI itself where the CPU has it).
+ * The own SHA-NI kernel and the AVX2 lanes of hash_many, which hash
+ * DDSN_SHA256_LANES short messages (like the inputs of block codes) at
+ * once, are only used when turned on (see --sha256-kernel and
+ * --sha256-lanes); check with sha256_bench that they are faster with the
+ * flags ddsn was built with first.
+ */
+class sha256 {
+public:
+	// one message
+	static void hash(const void *data, size_t size, BYTE hash[32]);
+	// count independent messages
+	static void hash_many(const BYTE *const data[], const size_t sizes[], size_t count, BYTE hashes[][32]);
+	// HMAC-SHA-256 (RFC 2104)
+	static void hmac(const BYTE *key, size_t key_size, const void *data, size_t size, BYTE mac[32]);
+
+	// kernels this CPU can run, "openssl" always
+	static std::vector<std::string> kernels();
+	// use the kernel from now on, false if it isn't available (for benchmarks)
+	static bool use_kernel(const std::string &name);
+	static std::string kernel();
+
+	// whether hash_many uses the AVX2 lanes (can't be turned on without AVX2)
+	static bool multi_buffer();
+	static void set_multi_buffer(bool multi_buffer);
+
+	sha256();
+	sha256(const sha256 &other);
+	~sha256();
+
+	sha256 &operator=(const sha256 &other);
+
+	void update(const void *data, size_t size);
+	void finish(BYTE hash[32]);
+private:
+	// the kernel chosen when hashing started, nullptr for OpenSSL
+	void (*compress_)(UINT32 state[8], const BYTE *data, size_t blocks);
+	EVP_MD_CTX *ctx_;
+
+	UINT32 state_[8];
+	BYTE buffer_[64];
+	size_t buffered_;
+	UINT64 length_;
+};
+
+}
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * Throughput of the SHA-256 kernels on this machine:
+ * large buffers (block data) per kernel and short messages (block codes)
+ * one by one and through hash_many.
+ */
+
+#include "sha256.h"
+
+#include <openssl/sha.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+using namespace ddsn;
+using namespace std;
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// compare with OpenSSL's one-shot SHA256 before timing anything
+static bool check(const vector<BYTE> &data) {
+	size_t sizes[] = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 1000, data.size() };
+
+	for (size_t size : sizes) {
+		BYTE expected[32], hash[32];
+		SHA256(data.data(), size, expected);
+		sha256::hash(data.data(), size, hash);
+
+		if (memcmp(expected, hash, 32) != 0) {
+			cout << "Wrong hash of " << size << " bytes with " << sha256::kernel() << endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv) {
+	const size_t buffer_size = 8 * 1024 * 1024;
+	const int buffer_rounds = 32;
+	const size_t messages = 1 << 20;
+	// name, owner hash and occurrence of a block code
+	const size_t message_size = 16 + 32 + 4;
+
+	vector<BYTE> data(buffer_size);
+
+	for (size_t i = 0; i < data.size(); i++) {
+		data[i] = rand();
+	}
+
+	cout << fixed << setprecision(1);
+
+	vector<string> kernels = sha256::kernels();
+
+	for (auto it = kernels.begin(); it != kernels.end(); ++it) {
+		sha256::use_kernel(*it);
+
+		if (!check(data)) {
+			return 1;
+		}
+
+		BYTE hash[32];
+		auto start = chrono::steady_clock::now();
+
+		for (int i = 0; i < buffer_rounds; i++) {
+			sha256::hash(data.data(), data.size(), hash);
+		}
+
+		double seconds = seconds_since(start);
+
+		cout << setw(8) << *it << ": " << setw(8) << buffer_size * buffer_rounds / seconds / (1024 * 1024) << " MiB/s (8 MiB buffers)" << endl;
+
+		start = chrono::steady_clock::now();
+
+		for (size_t i = 0; i < messages; i++) {
+			sha256::hash(data.data() + i % 4096, message_size, hash);
+		}
+
+		seconds = seconds_since(start);
+
+		cout << setw(8) << *it << ": " << setw(8) << messages / seconds / 1e6 << " M hashes/s (" << message_size << " byte messages)" << endl;
+	}
+
+	sha256::use_kernel(kernels.back());
+	sha256::set_multi_buffer(true);
+
+	if (!sha256::multi_buffer()) {
+		cout << "No AVX2, hash_many hashes one message after the other" << endl;
+		return 0;
+	}
+
+	vector<const BYTE *> inputs(messages);
+	vector<size_t> sizes(messages, message_size);
+	vector<BYTE> hashes(messages * 32);
+
+	for (size_t i = 0; i < messages; i++) {
+		inputs[i] = data.data() + i % 4096;
+	}
+
+	auto start = chrono::steady_clock::now();
+	sha256::hash_many(inputs.data(), sizes.data(), messages, (BYTE (*)[32])hashes.data());
+	double seconds = seconds_since(start);
+
+	for (size_t i = 0; i < messages; i += 4099) {
+		BYTE expected[32];
+		SHA256(inputs[i], sizes[i], expected);
+
+		if (memcmp(expected, &hashes[i * 32], 32) != 0) {
+			cout << "Wrong multi-buffer hash" << endl;
+			return 1;
+		}
+	}
+
+	cout << setw(8) << "avx2-x8" << ": " << setw(8) << messages / seconds / 1e6 << " M hashes/s (" << message_size << " byte messages)" << endl;
+
+	return 0;
+}
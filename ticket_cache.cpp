@@ -0,0 +1,62 @@
+#include "ticket_cache.h"
+
+#include "keys.h"
+#include "sha256.h"
+
+#include <cstring>
+
+using namespace ddsn;
+using namespace std;
+
+bool ticket_cache::get(const peer_id &peer, BYTE secret[32]) {
+	auto it = tickets_.find(peer);
+
+	if (it == tickets_.end()) {
+		return false;
+	}
+
+	if (chrono::steady_clock::now() - it->second.issued > chrono::seconds(DDSN_TICKET_LIFETIME)) {
+		tickets_.erase(it);
+		return false;
+	}
+
+	memcpy(secret, it->second.secret, 32);
+
+	return true;
+}
+
+void ticket_cache::put(const peer_id &peer, const BYTE secret[32]) {
+	ticket &t = tickets_[peer];
+
+	memcpy(t.secret, secret, 32);
+	t.issued = chrono::steady_clock::now();
+}
+
+void ticket_cache::remove(const peer_id &peer) {
+	tickets_.erase(peer);
+}
+
+bool ticket_cache::agree(EVP_PKEY *exchange_key, const BYTE public_key[32], const BYTE peer_public_key[32], BYTE secret[32]) {
+	BYTE shared[32];
+
+	if (!exchange_secret(exchange_key, peer_public_key, shared)) {
+		return false;
+	}
+
+	// both public keys in the same order on both sides
+	bool ours_first = memcmp(public_key, peer_public_key, 32) < 0;
+
+	sha256 sha;
+	sha.update(shared, 32);
+	sha.update(ours_first ? public_key : peer_public_key, 32);
+	sha.update(ours_first ? peer_public_key : public_key, 32);
+	sha.finish(secret);
+
+	return true;
+}
+
+void ticket_cache::ticket_id(const BYTE secret[32], BYTE id[32]) {
+	static const char label[] = "ticket";
+
+	sha256::hmac(secret, 32, label, sizeof(label) - 1, id);
+}
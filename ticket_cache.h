@@ -0,0 +1,45 @@
+#ifndef DDSN_TICKET_CACHE_H
+#define DDSN_TICKET_CACHE_H
+
+#include "definitions.h"
+#include "peer_id.h"
+
+#include <openssl/evp.h>
+#include <chrono>
+#include <unordered_map>
+
+// seconds until a peer has to prove its identity with its key again
+#define DDSN_TICKET_LIFETIME (12 * 60 * 60)
+
+namespace ddsn {
+
+/*
+ * Secrets agreed on with peers whose identity was verified by signature
+ * (see HELLO). When such a peer reconnects, both sides prove they know the
+ * secret with an HMAC (RESUME IDENTITY) instead of signing and verifying.
+ * Kept in memory only, a restarted peer does the full handshake again.
+ * Used from the network thread.
+ */
+class ticket_cache {
+public:
+	// the secret shared with the peer, false if there's none or it expired
+	bool get(const peer_id &peer, BYTE secret[32]);
+	void put(const peer_id &peer, const BYTE secret[32]);
+	void remove(const peer_id &peer);
+
+	// names a secret in HELLO without giving it away
+	static void ticket_id(const BYTE secret[32], BYTE id[32]);
+	// the secret of two peers from their X25519 keys (see keys.h), the same on both sides
+	static bool agree(EVP_PKEY *exchange_key, const BYTE public_key[32], const BYTE peer_public_key[32], BYTE secret[32]);
+private:
+	struct ticket {
+		BYTE secret[32];
+		std::chrono::steady_clock::time_point issued;
+	};
+
+	std::unordered_map<peer_id, ticket> tickets_;
+};
+
+}
+
+#endif
@@ -1,6 +1,5 @@
 #include "utilities.h"
 
-#include <openssl/sha.h>
 #include <cassert>
 
 UINT32 ddsn::next_power(UINT32 number, UINT32 base) {
@@ -54,17 +53,27 @@ std::string ddsn::bytes_to_hex(const BYTE *bytes, size_t size) {
 	return string;
 }
 
-void ddsn::hash_from_rsa(RSA *public_key, BYTE hash[32]) {
-	BYTE *buf, *p;
-	int len = i2d_RSAPublicKey(public_key, nullptr);
-	buf = new BYTE[len];
-	p = buf;
-	i2d_RSAPublicKey(public_key, &p);
+bool ddsn::parse_size(const std::string &string, UINT64 &size) {
+	size_t pos;
 
-	SHA256_CTX sha256;
-	SHA256_Init(&sha256);
-	SHA256_Update(&sha256, buf, len);
-	SHA256_Final(hash, &sha256);
+	try {
+		size = std::stoull(string, &pos);
+	} catch (...) {
+		return false;
+	}
+
+	std::string unit = string.substr(pos);
+
+	if (unit == "") {
+	} else if (unit == "K" || unit == "k") {
+		size *= 1024;
+	} else if (unit == "M" || unit == "m") {
+		size *= 1024 * 1024;
+	} else if (unit == "G" || unit == "g") {
+		size *= 1024 * 1024 * 1024;
+	} else {
+		return false;
+	}
 
-	delete[] buf;
+	return true;
 }
\ No newline at end of file
@@ -3,7 +3,6 @@
 
 #include "definitions.h"
 
-#include <openssl/rsa.h>
 #include <string>
 
 namespace ddsn {
@@ -14,7 +13,8 @@ size_t hex_to_bytes(const std::string &hex, BYTE *bytes, size_t size);
 
 std::string bytes_to_hex(const BYTE *bytes, size_t size);
 
-void hash_from_rsa(RSA *public_key, BYTE hash[32]);
+// parses sizes like "512", "64K", "256M" or "2G"
+bool parse_size(const std::string &string, UINT64 &size);
 
 }
 
@@ -0,0 +1,65 @@
+#include "verify_cache.h"
+
+#include "sha256.h"
+
+using namespace ddsn;
+using namespace std;
+
+verify_cache::verify_cache(size_t capacity) : capacity_(capacity) {
+
+}
+
+verify_cache::~verify_cache() {
+
+}
+
+size_t verify_cache::size() {
+	lock_guard<mutex> lock(mutex_);
+	return entries_.size();
+}
+
+code verify_cache::key(const BYTE owner_hash[32], const BYTE data_hash[32], const BYTE *signature, size_t signature_size) {
+	sha256 sha;
+	sha.update(owner_hash, 32);
+	sha.update(data_hash, 32);
+	sha.update(signature, signature_size);
+
+	BYTE key_bytes[32];
+	sha.finish(key_bytes);
+
+	return code(256, key_bytes);
+}
+
+bool verify_cache::contains(const BYTE owner_hash[32], const BYTE data_hash[32], const BYTE *signature, size_t signature_size) {
+	code k = key(owner_hash, data_hash, signature, signature_size);
+
+	lock_guard<mutex> lock(mutex_);
+
+	auto it = entries_.find(k);
+
+	if (it == entries_.end()) {
+		return false;
+	}
+
+	order_.splice(order_.begin(), order_, it->second);
+
+	return true;
+}
+
+void verify_cache::add(const BYTE owner_hash[32], const BYTE data_hash[32], const BYTE *signature, size_t signature_size) {
+	code k = key(owner_hash, data_hash, signature, signature_size);
+
+	lock_guard<mutex> lock(mutex_);
+
+	if (entries_.find(k) != entries_.end()) {
+		return;
+	}
+
+	order_.push_front(k);
+	entries_[k] = order_.begin();
+
+	while (entries_.size() > capacity_) {
+		entries_.erase(order_.back());
+		order_.pop_back();
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef DDSN_VERIFY_CACHE_H
+#define DDSN_VERIFY_CACHE_H
+
+#include "code.h"
+#include "definitions.h"
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#define DDSN_VERIFY_CACHE_SIZE 16384
+
+namespace ddsn {
+
+/*
+ * Block signatures that passed verification, so verifying the same signature again
+ * (another occurrence, a block read back from disk, ...) only costs a lookup.
+ * Entries are keyed by a SHA-256 over owner hash, data hash and signature
+ * and evicted least recently used first. Used from the network and disk threads.
+ */
+class verify_cache {
+public:
+	verify_cache(size_t capacity = DDSN_VERIFY_CACHE_SIZE);
+	~verify_cache();
+
+	size_t size();
+
+	// whether this owner's signature over the data hash was verified before
+	bool contains(const BYTE owner_hash[32], const BYTE data_hash[32], const BYTE *signature, size_t signature_size);
+	void add(const BYTE owner_hash[32], const BYTE data_hash[32], const BYTE *signature, size_t signature_size);
+private:
+	static code key(const BYTE owner_hash[32], const BYTE data_hash[32], const BYTE *signature, size_t signature_size);
+
+	size_t capacity_;
+
+	// most recently used at the front
+	std::list<code> order_;
+	std::unordered_map<code, std::list<code>::iterator> entries_;
+
+	std::mutex mutex_;
+};
+
+}
+
+#endif
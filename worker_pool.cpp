@@ -0,0 +1,74 @@
+#include "worker_pool.h"
+
+#include <boost/bind.hpp>
+
+using namespace ddsn;
+using namespace std;
+
+worker_pool::worker_pool(size_t threads, size_t max_queued) : work_(new boost::asio::io_service::work(io_service_)), queue_limit_(max_queued),
+completed_(0), refused_(0), queued_(0), max_queued_(0), wait_us_(0) {
+	for (size_t i = 0; i < threads; i++) {
+		threads_.push_back(thread(boost::bind(&boost::asio::io_service::run, &io_service_)));
+	}
+}
+
+worker_pool::~worker_pool() {
+	stop();
+}
+
+void worker_pool::post(boost::function<void()> task) {
+	size_t queued = ++queued_;
+
+	// high-water mark
+	size_t max_queued = max_queued_;
+	while (queued > max_queued && !max_queued_.compare_exchange_weak(max_queued, queued)) {
+	}
+
+	io_service_.post(boost::bind(&worker_pool::run, this, task, chrono::steady_clock::now()));
+}
+
+bool worker_pool::try_post(boost::function<void()> task) {
+	if (queue_limit_ > 0 && queued_ >= queue_limit_) {
+		refused_++;
+		return false;
+	}
+
+	post(task);
+
+	return true;
+}
+
+void worker_pool::run(boost::function<void()> task, chrono::steady_clock::time_point queued_at) {
+	queued_--;
+	wait_us_ += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - queued_at).count();
+
+	task();
+
+	completed_++;
+}
+
+void worker_pool::stop() {
+	work_.reset();
+
+	for (auto it = threads_.begin(); it != threads_.end(); ++it) {
+		if (it->joinable()) {
+			it->join();
+		}
+	}
+}
+
+size_t worker_pool::threads() const {
+	return threads_.size();
+}
+
+worker_pool::statistics worker_pool::stats() const {
+	statistics stats;
+
+	stats.completed = completed_;
+	stats.refused = refused_;
+	stats.queued = queued_;
+	stats.max_queued = max_queued_;
+	stats.wait_us = wait_us_;
+
+	return stats;
+}
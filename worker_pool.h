@@ -0,0 +1,65 @@
+#ifndef DDSN_WORKER_POOL_H
+#define DDSN_WORKER_POOL_H
+
+#include "definitions.h"
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace ddsn {
+
+/*
+ * Threads running tasks off the network io_service.
+ * Tasks report back by posting their completion to the network io_service.
+ * With a queue limit, try_post refuses tasks while that many are waiting,
+ * so the caller can hold back its work instead of piling up more.
+ */
+class worker_pool {
+public:
+	struct statistics {
+		UINT64 completed;
+		// tasks try_post refused because the queue was full
+		UINT64 refused;
+		size_t queued;
+		size_t max_queued;
+		// total time completed tasks waited in the queue
+		UINT64 wait_us;
+	};
+
+	// max_queued 0: no limit
+	worker_pool(size_t threads, size_t max_queued = 0);
+	~worker_pool();
+
+	void post(boost::function<void()> task);
+	// false if the queue is full, the task isn't queued then
+	bool try_post(boost::function<void()> task);
+
+	// finish queued tasks and join the threads
+	void stop();
+
+	size_t threads() const;
+	statistics stats() const;
+private:
+	void run(boost::function<void()> task, std::chrono::steady_clock::time_point queued_at);
+
+	boost::asio::io_service io_service_;
+	std::unique_ptr<boost::asio::io_service::work> work_;
+	std::vector<std::thread> threads_;
+
+	size_t queue_limit_;
+
+	std::atomic<UINT64> completed_;
+	std::atomic<UINT64> refused_;
+	std::atomic<size_t> queued_;
+	std::atomic<size_t> max_queued_;
+	std::atomic<UINT64> wait_us_;
+};
+
+}
+
+#endif